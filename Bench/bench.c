@@ -0,0 +1,411 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../Utils/arena.h"
+#include "../Utils/image.h"
+#include "../Utils/kernels.h"
+#include "../Utils/options.h"
+#include "../Utils/separable.h"
+#include "../Utils/stages.h"
+#include "../Utils/utils.h"
+#include "../Utils/weights.h"
+
+// Untimed runs of every stage before its samples are taken, to fault the pages in and warm the caches
+#define WARMUP 3
+// Iterations the fixed point pipeline is compared with float over, and how far the first one may be
+// off with the default kernels
+#define FIXED_ITERATIONS 3
+#define FIXED_TOLERANCE 1
+
+int width;
+int height;
+int num_channels;
+Options opts;
+Arena *arena;
+// Synthetic image, the copy every sample starts from and the image the stages run on
+Channels **source;
+Channels **img;
+// Packed rows of the row kernels, 'vertical_in' has taps / 2 zero rows above and below the image
+// and every row of 'horizontal_in' taps / 2 zero pixels on each side
+unsigned char *vertical_in;
+unsigned char *horizontal_in;
+unsigned char *packed_out;
+// Planes of the synthetic image, the copy the planar stages start from, and the halo of their fused pass
+Image *planar_source;
+Image *planes;
+unsigned char *planar_halo;
+FusedWorkspace *ws;
+StageLines *lines;
+FixedKernel vertical_fixed;
+FixedKernel horizontal_fixed;
+float *K;
+char pnm_name[] = "/tmp/benchXXXXXX";
+
+/* A stage timed on its own. 'prepare' resets its input outside of the timing and 'run' is the
+timed part. 'bytes' is the number of bytes per pixel the stage has to read and write at the
+least, from which the effective bandwidth is taken. */
+typedef struct
+{
+    const char *name;
+    void (*prepare)(void);
+    void (*run)(void);
+    int bytes;
+} Stage;
+
+typedef struct
+{
+    double median;
+    double p95;
+} Summary;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Median and nearest rank 95th percentile of 'n' samples, which get sorted
+static Summary summarize(double *samples, int n)
+{
+    qsort(samples, n, sizeof(double), compare_doubles);
+    Summary s;
+    s.median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    s.p95 = samples[(95 * n + 99) / 100 - 1];
+    return s;
+}
+
+static void reset_image(void)
+{
+    memcpy(img[0], source[0], (size_t)height * width * sizeof(Channels));
+}
+
+static void reset_planes(void)
+{
+    memcpy(planes->data, planar_source->data, (size_t)planes->planes * planes->height * planes->stride);
+}
+
+// The decode reads the channels the encode writes, so it starts from an encoded image
+static void reset_encoded(void)
+{
+    reset_image();
+    depthwise_encode_rows(lines, img, width, 0, height, num_channels, K);
+}
+
+static void nothing(void)
+{
+}
+
+static unsigned char apply_taps(unsigned char *out, const unsigned char *const *src, int n, const Kernel1D *Kf,
+                                const FixedKernel *Kq)
+{
+    return kernels.fixed_point ? kernels.taps_fixed(out, src, n, Kq) : kernels.taps(out, src, n, Kf);
+}
+
+// The vertical kernel over every row of the packed image, what the split pass runs
+static void run_vertical(void)
+{
+    int line_size = width * channel_count;
+    const unsigned char *rows[MAX_TAPS];
+    for (int i = 0; i < height; i++)
+    {
+        for (int k = 0; k < opts.vertical.taps; k++)
+            rows[k] = vertical_in + (size_t)(i + k) * line_size;
+        apply_taps(packed_out + (size_t)i * line_size, rows, line_size, &opts.vertical, &vertical_fixed);
+    }
+}
+
+// The horizontal kernel over every row of the packed image, what the split pass runs
+static void run_horizontal(void)
+{
+    int line_size = width * channel_count;
+    int border = opts.horizontal.taps / 2;
+    size_t bordered_size = (size_t)(width + 2 * border) * channel_count;
+    const unsigned char *shifted[MAX_TAPS];
+    for (int i = 0; i < height; i++)
+    {
+        for (int k = 0; k < opts.horizontal.taps; k++)
+            shifted[k] = horizontal_in + i * bordered_size + k * channel_count;
+        apply_taps(packed_out + (size_t)i * line_size, shifted, line_size, &opts.horizontal, &horizontal_fixed);
+    }
+}
+
+static void run_fused(void)
+{
+    fused_capture_halo(ws, img, 0, height, 0, height);
+    conv_separable_fused(ws, img, 0, height, 0, height);
+}
+
+static void run_fused_planar(void)
+{
+    fused_store_halo_planar(ws, planes, 0, height, planar_halo);
+    fused_load_halo(ws, planar_halo);
+    conv_separable_planar(ws, planes, 0, height);
+}
+
+static void run_normalize(void)
+{
+    normalize_rows(lines, img, width, 0, height, 255.f / 200);
+}
+
+static void run_encode(void)
+{
+    depthwise_encode_rows(lines, img, width, 0, height, num_channels, K);
+}
+
+static void run_decode(void)
+{
+    depthwise_decode_rows(lines, img, width, 0, height, num_channels);
+}
+
+static void run_pointwise(void)
+{
+    pointwise_rows(lines, img, width, 0, height, 255.f / 200, num_channels, K, 0);
+}
+
+static void run_pointwise_planar(void)
+{
+    pointwise_planes(lines, planes, 0, width, 0, height, 255.f / 200, num_channels, K);
+}
+
+static void run_write(void)
+{
+    write_image_pnm(img, pnm_name, width, height, 255);
+}
+
+static void run_read(void)
+{
+    read_image_pnm_into(pnm_name, img);
+}
+
+// Fills the image with a fixed pseudo random pattern, so every build sees the same bytes
+static void make_image(void)
+{
+    size_t size = channel_array_size(height, width, 0);
+    size_t vertical_size = (size_t)(height + opts.vertical.taps - 1) * width * channel_count;
+    size_t horizontal_size = (size_t)height * (width + opts.horizontal.taps - 1) * channel_count;
+    size_t out_size = (size_t)height * width * channel_count;
+    size_t halo_size = fused_halo_size(width, &opts.vertical);
+    arena = new_arena(3 * size + arena_size(vertical_size) + arena_size(horizontal_size) + arena_size(out_size) +
+                      arena_size(halo_size));
+    source = arena_channel_array(arena, height, width, 0);
+    img = arena_channel_array(arena, height, width, 0);
+    vertical_in = arena_alloc(arena, vertical_size);
+    horizontal_in = arena_alloc(arena, horizontal_size);
+    packed_out = arena_alloc(arena, out_size);
+    planar_halo = arena_alloc(arena, halo_size);
+
+    srand(1);
+    for (int i = 0; i < height; i++)
+        for (int j = 0; j < width; j++)
+            for (int c = 0; c < channel_count; c++)
+                source[i][j].channel[c] = rand() % 256;
+
+    int line_size = width * channel_count;
+    int border = opts.horizontal.taps / 2;
+    size_t bordered_size = (size_t)(width + 2 * border) * channel_count;
+    memset(vertical_in, 0, vertical_size);
+    memset(horizontal_in, 0, horizontal_size);
+    for (int i = 0; i < height; i++)
+    {
+        pack_channels(vertical_in + (size_t)(i + opts.vertical.taps / 2) * line_size, source[i], width, 0);
+        pack_channels(horizontal_in + i * bordered_size + border * channel_count, source[i], width, 0);
+    }
+
+    planar_source = image_from_channels(source, height, width, channel_count);
+    planes = new_image(height, width, channel_count);
+
+    reset_image();
+    write_image_pnm(img, pnm_name, width, height, 255);
+}
+
+// One iteration of the pipeline over the whole image, normalized with the top of its spatial stage
+static void run_iteration(Channels **image)
+{
+    fused_capture_halo(ws, image, 0, height, 0, height);
+    int top = conv_separable_fused(ws, image, 0, height, 0, height);
+    pointwise_rows(lines, image, width, 0, height, 255.f / top, num_channels, K, 0);
+}
+
+/* Runs FIXED_ITERATIONS iterations over the image in float and in fixed point, and puts the
+largest difference of any channel after each of them in 'deviations'. With the default kernels
+kernels.h bounds the first one by FIXED_TOLERANCE, the later ones renormalize and amplify it. */
+static void fixed_deviations(int *deviations)
+{
+    Channels **fixed = arena_channel_array(arena, height, width, 0);
+    memcpy(fixed[0], source[0], (size_t)height * width * sizeof(Channels));
+    reset_image();
+
+    for (int it = 0; it < FIXED_ITERATIONS; it++)
+    {
+        select_kernels(opts.isa, 0);
+        run_iteration(img);
+        select_kernels(opts.isa, 1);
+        run_iteration(fixed);
+
+        deviations[it] = 0;
+        for (int i = 0; i < height; i++)
+            for (int j = 0; j < width; j++)
+                for (int c = 0; c < channel_count; c++)
+                    deviations[it] = fmax(deviations[it], abs(img[i][j].channel[c] - fixed[i][j].channel[c]));
+    }
+    select_kernels(opts.isa, opts.fixed_point);
+}
+
+static int same_kernel(const Kernel1D *a, const Kernel1D *b)
+{
+    return a->taps == b->taps && memcmp(a->coefficients, b->coefficients, a->taps * sizeof(float)) == 0;
+}
+
+// Times 'repeats' runs of a stage after the warmup
+static Summary time_stage(Stage *stage, int repeats, double *samples)
+{
+    for (int r = 0; r < WARMUP + repeats; r++)
+    {
+        stage->prepare();
+        double start = now();
+        stage->run();
+        double elapsed = now() - start;
+        if (r >= WARMUP)
+            samples[r - WARMUP] = elapsed;
+    }
+    return summarize(samples, repeats);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 6)
+    {
+        fprintf(stderr, "Usage: %s WIDTH HEIGHT CHANNEL_MULTIPLIER REPEATS JSON [options]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+    int channel_multiplier = atoi(argv[3]);
+    int repeats = atoi(argv[4]);
+    char *json_name = argv[5];
+    opts = parse_options(argc, argv, 6);
+    select_kernels(opts.isa, opts.fixed_point);
+    load_weights(opts.weights);
+    if (weights)
+        channel_multiplier = weights->multiplier;
+    if (width < 1 || height < 1 || repeats < 1 || channel_multiplier < 1 ||
+        channel_count * channel_multiplier > LAYER_HEIGHT)
+    {
+        fprintf(stderr, "The image needs at least one pixel, the run at least one repeat and the channel "
+                        "multiplier has to be between 1 and %d\n",
+                LAYER_HEIGHT / channel_count);
+        return EXIT_FAILURE;
+    }
+    num_channels = channel_count * channel_multiplier;
+
+    int fd = mkstemp(pnm_name);
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    make_image();
+    ws = new_fused_workspace(width, &opts.vertical, &opts.horizontal);
+    lines = new_stage_lines(width);
+    vertical_fixed = quantize_kernel(&opts.vertical);
+    horizontal_fixed = quantize_kernel(&opts.horizontal);
+    K = get_kernel(42);
+
+    Stage stages[] = {
+        {"vertical", nothing, run_vertical, 2 * channel_count},
+        {"horizontal", nothing, run_horizontal, 2 * channel_count},
+        {"fused", reset_image, run_fused, 2 * channel_count},
+        {"normalize", reset_image, run_normalize, 2 * channel_count},
+        {"encode", reset_image, run_encode, channel_count + num_channels},
+        {"decode", reset_encoded, run_decode, num_channels + channel_count},
+        {"pointwise", reset_image, run_pointwise, 2 * channel_count},
+        {"write", reset_image, run_write, channel_count},
+        {"read", nothing, run_read, channel_count},
+        {"fused planar", reset_planes, run_fused_planar, 2 * channel_count},
+        {"pointwise planar", reset_planes, run_pointwise_planar, 2 * channel_count},
+    };
+    // The planes have no learned layer
+    int n_stages = sizeof(stages) / sizeof(stages[0]) - (weights != NULL);
+
+    FILE *json = fopen(json_name, "w");
+    if (!json)
+    {
+        perror(json_name);
+        return EXIT_FAILURE;
+    }
+    fprintf(json, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"channel_multiplier\": %d,\n", width, height,
+            channel_multiplier);
+    fprintf(json, "  \"repeats\": %d,\n  \"warmup\": %d,\n  \"isa\": \"%s\",\n  \"arith\": \"%s\",\n", repeats, WARMUP,
+            kernels.name, kernels.fixed_point ? "fixed" : "float");
+    fprintf(json, "  \"vertical_taps\": %d,\n  \"horizontal_taps\": %d,\n  \"weights\": %s,\n  \"stages\": [\n",
+            opts.vertical.taps, opts.horizontal.taps, weights ? "true" : "false");
+
+    printf("%dx%d, channel multiplier %d, %s %s, median and p95 of %d runs\n", width, height, channel_multiplier,
+           kernels.name, kernels.fixed_point ? "fixed" : "float", repeats);
+    printf("%-16s %12s %12s %10s %10s\n", "stage", "median ms", "p95 ms", "Mpix/s", "GB/s");
+
+    double *samples = malloc(repeats * sizeof(double));
+    double pixels = (double)width * height;
+    for (int s = 0; s < n_stages; s++)
+    {
+        Summary summary = time_stage(&stages[s], repeats, samples);
+        double mpix = pixels / summary.median * 1e-6;
+        double gbs = pixels * stages[s].bytes / summary.median * 1e-9;
+
+        printf("%-16s %12.3f %12.3f %10.1f %10.2f\n", stages[s].name, summary.median * 1e3, summary.p95 * 1e3, mpix,
+               gbs);
+        fprintf(json,
+                "    {\"name\": \"%s\", \"median_ms\": %.4f, \"p95_ms\": %.4f, \"mpix_s\": %.2f, \"gb_s\": %.3f, "
+                "\"bytes_per_pixel\": %d}%s\n",
+                stages[s].name, summary.median * 1e3, summary.p95 * 1e3, mpix, gbs, stages[s].bytes,
+                s + 1 < n_stages ? "," : "");
+    }
+    fprintf(json, "  ],\n");
+
+    int deviations[FIXED_ITERATIONS];
+    fixed_deviations(deviations);
+    printf("fixed point against float after 1 to %d iterations:", FIXED_ITERATIONS);
+    fprintf(json, "  \"fixed_deviation\": [");
+    for (int it = 0; it < FIXED_ITERATIONS; it++)
+    {
+        printf(" %d", deviations[it]);
+        fprintf(json, "%d%s", deviations[it], it + 1 < FIXED_ITERATIONS ? ", " : "");
+    }
+    printf("\n");
+    fprintf(json, "]\n}\n");
+    fclose(json);
+
+    unlink(pnm_name);
+    free(samples);
+    free(K);
+    free_fused_workspace(ws);
+    free_stage_lines(lines);
+    free_image(planar_source);
+    free_image(planes);
+    free_arena(arena);
+    free_weights();
+
+    Options defaults = parse_options(0, NULL, 0);
+    int default_kernels = same_kernel(&opts.vertical, &defaults.vertical) &&
+                          same_kernel(&opts.horizontal, &defaults.horizontal);
+    if (default_kernels && deviations[0] > FIXED_TOLERANCE)
+    {
+        fprintf(stderr, "Fixed point is %d away from float after one iteration, more than %d\n", deviations[0],
+                FIXED_TOLERANCE);
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "../Utils/utils.h"
+
+#define MAX_LIST 32
+#define COMMAND_SIZE 4096
+
+/* A backend under study. The pthreads and OpenMP ones take the number of threads as their first
+argument, the MPI one is started by mpirun with that many processes on the local machine. */
+typedef struct
+{
+    const char *name;
+    const char *binary;
+    int mpi;
+} Backend;
+
+Backend backends[] = {
+    {"threads", "../PThreads/conv_threads", 0},
+    {"openmp", "../OpenMp/conv_openmp", 0},
+    {"mpi", "../MPI/imageProcessing", 1},
+};
+
+int iterations;
+int channel_multiplier;
+int repeats;
+// Flags handed to every backend, and the mpirun command line, which MPIRUN replaces
+char flags[COMMAND_SIZE];
+const char *mpirun = "mpirun";
+char in_name[] = "/tmp/scalingXXXXXX";
+char out_name[COMMAND_SIZE];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Splits a comma separated list of positive numbers, or of WIDTHxHEIGHT sizes when 'heights' is given
+static int parse_list(char *text, int *values, int *heights)
+{
+    int n = 0;
+    for (char *item = strtok(text, ","); item && n < MAX_LIST; item = strtok(NULL, ","), n++)
+    {
+        char *end;
+        values[n] = strtol(item, &end, 10);
+        if (heights)
+        {
+            if (*end != 'x')
+                values[n] = 0;
+            else
+                heights[n] = strtol(end + 1, &end, 10);
+        }
+        if (values[n] < 1 || *end || (heights && heights[n] < 1))
+        {
+            fprintf(stderr, "Invalid list item '%s'\n", item);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return n;
+}
+
+// Writes a synthetic image of the given size to 'in_name', the same bytes for every run
+static void make_input(int width, int height)
+{
+    Channels **img = new_channel_array(height, width);
+    srand(1);
+    for (int i = 0; i < height; i++)
+        for (int j = 0; j < width; j++)
+            for (int c = 0; c < channel_count; c++)
+                img[i][j].channel[c] = rand() % 256;
+    write_image_pnm(img, in_name, width, height, 255);
+    free_channel_array(img, height);
+}
+
+/* Median wall time of 'repeats' runs of a backend with 'workers' threads or processes on the
+current input. A run that fails aborts the study, its timing would be meaningless. */
+static double time_backend(Backend *backend, int workers)
+{
+    char command[3 * COMMAND_SIZE];
+    if (backend->mpi)
+        snprintf(command, sizeof(command), "%s -np %d %s %s %s %d %d%s > /dev/null", mpirun, workers, backend->binary, in_name,
+                 out_name, iterations, channel_multiplier, flags);
+    else
+        snprintf(command, sizeof(command), "%s %d %s %s %d %d%s > /dev/null", backend->binary, workers, in_name, out_name,
+                 iterations, channel_multiplier, flags);
+
+    double samples[repeats];
+    for (int r = 0; r < repeats; r++)
+    {
+        double start = now();
+        int status = system(command);
+        samples[r] = now() - start;
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+        {
+            fprintf(stderr, "'%s' failed\n", command);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    qsort(samples, repeats, sizeof(double), compare_doubles);
+    return repeats % 2 ? samples[repeats / 2] : (samples[repeats / 2 - 1] + samples[repeats / 2]) / 2;
+}
+
+/* Single thread reference of the current input, the fastest of the selected backends run with
+one worker, so that no backend gets credit for a slow serial path. */
+static double time_reference(Backend **selected, int n_selected)
+{
+    double best = 0;
+    for (int b = 0; b < n_selected; b++)
+    {
+        double t = time_backend(selected[b], 1);
+        if (b == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 9)
+    {
+        fprintf(stderr,
+                "Usage: %s strong|weak BACKENDS SIZES WORKERS ITERATIONS CHANNEL_MULTIPLIER REPEATS CSV [options]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    int weak = strcmp(argv[1], "weak") == 0;
+    if (!weak && strcmp(argv[1], "strong") != 0)
+    {
+        fprintf(stderr, "Unknown scaling mode '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    Backend *selected[MAX_LIST];
+    int n_selected = 0;
+    for (char *name = strtok(argv[2], ","); name && n_selected < MAX_LIST; name = strtok(NULL, ","))
+    {
+        int b = 0;
+        while (b < (int)(sizeof(backends) / sizeof(backends[0])) && strcmp(backends[b].name, name) != 0)
+            b++;
+        if (b == sizeof(backends) / sizeof(backends[0]))
+        {
+            fprintf(stderr, "Unknown backend '%s', expected threads, openmp or mpi\n", name);
+            return EXIT_FAILURE;
+        }
+        selected[n_selected++] = &backends[b];
+    }
+
+    int widths[MAX_LIST], heights[MAX_LIST], workers[MAX_LIST];
+    int n_sizes = parse_list(argv[3], widths, heights);
+    int n_workers = parse_list(argv[4], workers, NULL);
+    iterations = atoi(argv[5]);
+    channel_multiplier = atoi(argv[6]);
+    repeats = atoi(argv[7]);
+    if (repeats < 1)
+    {
+        fprintf(stderr, "The study needs at least one repeat\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 9; i < argc; i++)
+        snprintf(flags + strlen(flags), sizeof(flags) - strlen(flags), " %s", argv[i]);
+    if (getenv("MPIRUN"))
+        mpirun = getenv("MPIRUN");
+
+    FILE *csv = fopen(argv[8], "w");
+    if (!csv)
+    {
+        perror(argv[8]);
+        return EXIT_FAILURE;
+    }
+    int fd = mkstemp(in_name);
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    snprintf(out_name, sizeof(out_name), "%s.out", in_name);
+
+    fprintf(csv, "mode,backend,width,height,workers,seconds,reference_seconds,speedup,efficiency,karp_flatt\n");
+    printf("%-6s %-8s %11s %7s %10s %10s %8s %10s %10s\n", "mode", "backend", "size", "workers", "seconds",
+           "reference", "speedup", "efficiency", "karp-flatt");
+
+    double reference = 0;
+    for (int s = 0; s < n_sizes; s++)
+        for (int w = 0; w < n_workers; w++)
+        {
+            // Weak scaling gives every worker the rows of a whole base image
+            int width = widths[s];
+            int height = weak ? heights[s] * workers[w] : heights[s];
+            // A strong study keeps the input and the reference of the size for every worker count
+            if (weak || w == 0)
+            {
+                make_input(width, height);
+                reference = time_reference(selected, n_selected);
+            }
+
+            for (int b = 0; b < n_selected; b++)
+            {
+                int p = workers[w];
+                double t = time_backend(selected[b], p);
+                double speedup = reference / t;
+                double efficiency = speedup / p;
+
+                char karp_flatt[32] = "";
+                // The experimentally determined serial fraction, undefined for a single worker
+                if (p > 1)
+                    snprintf(karp_flatt, sizeof(karp_flatt), "%.4f", (1 / speedup - 1. / p) / (1 - 1. / p));
+
+                fprintf(csv, "%s,%s,%d,%d,%d,%.4f,%.4f,%.3f,%.3f,%s\n", argv[1], selected[b]->name, width, height, p,
+                        t, reference, speedup, efficiency, karp_flatt);
+                printf("%-6s %-8s %5dx%-5d %7d %10.4f %10.4f %8.2f %10.3f %10s\n", argv[1], selected[b]->name, width,
+                       height, p, t, reference, speedup, efficiency, karp_flatt);
+                fflush(stdout);
+            }
+        }
+
+    fclose(csv);
+    unlink(in_name);
+    unlink(out_name);
+
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include "plan.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../Utils/arena.h"
+#include "../Utils/kernels.h"
+#include "../Utils/pool.h"
+#include "../Utils/scheduler.h"
+#include "../Utils/separable.h"
+#include "../Utils/stages.h"
+#include "../Utils/trace.h"
+
+struct ConvPlan
+{
+    int width;
+    int height;
+    int num_channels;
+    int n_threads;
+    Options opts;
+    // Depthwise kernel of every iteration, made once instead of reseeding rand on every stage
+    float *K;
+    ThreadPool *pool;
+    TileScheduler *sched;
+    // Halos of the bands of the fused pass, and a fused workspace and pointwise lines per thread, out of one arena
+    Arena *arena;
+    unsigned char *halos;
+    FusedWorkspace **workspaces;
+    StageLines **lines;
+    // Held for a whole execution, the scratch and the pool serve one image at a time
+    pthread_mutex_t lock;
+    // Image and iterations of the running execution, and the top of its last decode
+    Channels **img;
+    int iterations;
+    int top;
+};
+
+// Guards the kernel selection, which is process wide, and get_kernel, which seeds rand
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int kernels_selected;
+
+// Picks the row kernels for the first plan, later plans have to agree with them
+static int select_plan_kernels(const Options *opts)
+{
+    if (!kernels_selected)
+    {
+        select_kernels(opts->isa, opts->fixed_point);
+        kernels_selected = 1;
+        return 1;
+    }
+    return kernels.fixed_point == opts->fixed_point && (!opts->isa || strcmp(opts->isa, kernels.name) == 0);
+}
+
+static int supported(const Options *opts)
+{
+    return opts->fused && !opts->stream_rows && !opts->batch && !opts->temporal && !opts->weights &&
+           !opts->exchange && !opts->grid && opts->affinity == AFFINITY_NONE && opts->pages == PAGES_DEFAULT &&
+           !opts->planar;
+}
+
+/* Makes a plan for images of 'width' x 'height', whose depthwise encode expands them into
+3 * 'channel_multiplier' channels, run on 'n_threads' threads. Returns NULL if the options
+can't be planned or the allocations fail. */
+ConvPlan *conv_plan_create(int width, int height, int channel_multiplier, int n_threads, const Options *opts)
+{
+    if (width < 1 || height < 1 || n_threads < 1 || channel_multiplier < 1 ||
+        channel_count * channel_multiplier > LAYER_HEIGHT || !supported(opts))
+        return NULL;
+
+    pthread_mutex_lock(&setup_lock);
+    if (!select_plan_kernels(opts))
+    {
+        pthread_mutex_unlock(&setup_lock);
+        return NULL;
+    }
+    float *K = get_kernel(42);
+    pthread_mutex_unlock(&setup_lock);
+
+    ConvPlan *plan = calloc(1, sizeof(ConvPlan));
+    if (!plan || !K)
+    {
+        free(plan);
+        free(K);
+        return NULL;
+    }
+    plan->width = width;
+    plan->height = height;
+    plan->num_channels = channel_count * channel_multiplier;
+    plan->n_threads = n_threads;
+    plan->opts = *opts;
+    plan->K = K;
+    pthread_mutex_init(&plan->lock, NULL);
+
+    TileShape bands = {opts->tile.rows, 0};
+    size_t halos_size = tile_count(0, height, width, bands) * fused_halo_size(width, &plan->opts.vertical);
+    size_t workspace_size = fused_workspace_size(width, &plan->opts.vertical, &plan->opts.horizontal);
+    size_t lines_size = stage_lines_size(width);
+    plan->arena = new_arena(arena_size(halos_size) + arena_size(n_threads * sizeof(FusedWorkspace *)) +
+                            n_threads * arena_size(workspace_size) + arena_size(n_threads * sizeof(StageLines *)) +
+                            n_threads * arena_size(lines_size));
+    plan->sched = new_tile_scheduler(n_threads);
+    plan->pool = new_thread_pool(n_threads);
+    if (!plan->arena || !plan->sched || !plan->pool)
+    {
+        conv_plan_destroy(plan);
+        return NULL;
+    }
+
+    // The arena is sized for all of these, so carving them out of it can't fail
+    plan->halos = arena_alloc(plan->arena, halos_size);
+    plan->workspaces = arena_alloc(plan->arena, n_threads * sizeof(FusedWorkspace *));
+    plan->lines = arena_alloc(plan->arena, n_threads * sizeof(StageLines *));
+    for (int t = 0; t < n_threads; t++)
+    {
+        plan->workspaces[t] = place_fused_workspace(arena_alloc(plan->arena, workspace_size), width,
+                                                    &plan->opts.vertical, &plan->opts.horizontal);
+        plan->lines[t] = place_stage_lines(arena_alloc(plan->arena, lines_size), width);
+    }
+
+    return plan;
+}
+
+// Fused spatial pass over the whole image, the threads taking bands of rows from the scheduler
+static int plan_spatial(ConvPlan *plan, int thread_id)
+{
+    int top = 0;
+    Tile tile;
+    TileShape shape = {plan->opts.tile.rows, 0};
+    size_t halo_size = fused_halo_size(plan->width, &plan->opts.vertical);
+    FusedWorkspace *ws = plan->workspaces[thread_id];
+
+    TRACE_BEGIN("plan_spatial");
+    // The band borders have to be read before any of the threads overwrites them
+    scheduler_begin(plan->sched, thread_id, plan->n_threads, 0, plan->height, plan->width, shape);
+    while (scheduler_next(plan->sched, thread_id, &tile))
+        fused_store_halo(ws, plan->img, 0, plan->height, tile.row, tile.row + tile.rows,
+                         plan->halos + tile.index * halo_size);
+    pool_barrier(plan->pool);
+
+    scheduler_begin(plan->sched, thread_id, plan->n_threads, 0, plan->height, plan->width, shape);
+    while (scheduler_next(plan->sched, thread_id, &tile))
+    {
+        fused_load_halo(ws, plan->halos + tile.index * halo_size);
+        top = fmax(top, conv_separable_fused(ws, plan->img, 0, plan->height, tile.row, tile.row + tile.rows));
+    }
+    TRACE_END();
+
+    return top;
+}
+
+// Normalize, encode and decode a tile at a time, returns the top of the tiles of this thread
+static int plan_pointwise(ConvPlan *plan, float upscale_factor, int thread_id)
+{
+    int top = 0;
+    Tile tile;
+    Channels *view[plan->opts.tile.rows];
+
+    TRACE_BEGIN("plan_pointwise");
+    scheduler_begin(plan->sched, thread_id, plan->n_threads, 0, plan->height, plan->width, plan->opts.tile);
+    while (scheduler_next(plan->sched, thread_id, &tile))
+    {
+        tile_view(plan->img, &tile, view);
+        top = fmax(top, pointwise_rows(plan->lines[thread_id], view, tile.cols, 0, tile.rows, upscale_factor,
+                                       plan->num_channels, plan->K, plan->opts.expanded));
+    }
+    TRACE_END();
+
+    return top;
+}
+
+// Every iteration on every thread of the pool, the top reductions being the only barriers between them
+static void plan_job(void *var, int thread_id)
+{
+    ConvPlan *plan = var;
+
+    for (int j = 0; j < plan->iterations; j++)
+    {
+        int top = pool_reduce_max(plan->pool, thread_id, plan_spatial(plan, thread_id));
+        top = plan_pointwise(plan, 255.f / top, thread_id);
+
+        // The reduction also keeps the next spatial pass from reading rows that are still being decoded
+        top = pool_reduce_max(plan->pool, thread_id, top);
+        if (thread_id == 0)
+            plan->top = top;
+    }
+}
+
+/* Runs 'iterations' iterations over 'img', which has to have the shape of the plan, in place.
+Returns the top of the last decode, which is the range of the result, or -1 without iterations. */
+int conv_plan_execute(ConvPlan *plan, Channels **img, int iterations)
+{
+    pthread_mutex_lock(&plan->lock);
+    plan->img = img;
+    plan->iterations = iterations;
+    plan->top = -1;
+    if (iterations > 0)
+        pool_run(plan->pool, plan_job, plan);
+    int top = plan->top;
+    plan->img = NULL;
+    pthread_mutex_unlock(&plan->lock);
+
+    return top;
+}
+
+void conv_plan_destroy(ConvPlan *plan)
+{
+    if (!plan)
+        return;
+    // A plan whose creation failed may be missing any of them
+    if (plan->pool)
+        free_thread_pool(plan->pool);
+    if (plan->sched)
+        free_tile_scheduler(plan->sched);
+    if (plan->arena)
+        free_arena(plan->arena);
+    pthread_mutex_destroy(&plan->lock);
+    free(plan->K);
+    free(plan);
+}
@@ -0,0 +1,28 @@
+#ifndef PLAN_H_
+#define PLAN_H_
+
+#include "../Utils/options.h"
+#include "../Utils/utils.h"
+
+/* Precomputed execution of the pipeline, for embedding it instead of running a backend as a
+process. A plan is made once for an image shape, a channel multiplier and a number of threads,
+and owns everything the iterations need: the depthwise kernel, the scratch of the stages carved
+out of one arena, the tile scheduler and a pool of threads that stay parked between executions.
+It can then run on any number of images of that shape.
+
+Executions of different plans can run at the same time from different threads. Executions of
+one plan are serialized, so a service runs a plan per concurrent request. The instruction set
+and the arithmetic of the row kernels are chosen for the whole process by the first plan, and a
+later plan that asks for different ones is refused.
+
+Plans run the pthreads pipeline with the fused spatial pass. They take the same Options as the
+backends, from parse_options, and refuse the ones that only make sense for a whole run:
+--separable=split, --stream, --batch, --temporal, --weights, --affinity, --pages and the MPI
+options. */
+typedef struct ConvPlan ConvPlan;
+
+ConvPlan *conv_plan_create(int width, int height, int channel_multiplier, int n_threads, const Options *opts);
+int conv_plan_execute(ConvPlan *plan, Channels **img, int iterations);
+void conv_plan_destroy(ConvPlan *plan);
+
+#endif // PLAN_H_
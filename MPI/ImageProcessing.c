@@ -1,334 +1,904 @@
-#include <math.h>
-#include <mpi.h>
-#include <stddef.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-#include "../Utils/utils.h"
-
-int rank;
-int n_processes;
-int width;
-int height;
-int iterations;
-
-// Vectorize a single channel for sending
-unsigned char *pack_channel(Channels *vec, int length, int channel_id)
-{
-    unsigned char *channel = malloc(length * sizeof(unsigned char));
-    for (int i = 0; i < length; i++)
-        channel[i] = vec[i].channel[channel_id];
-
-    return channel;
-}
-
-// Unpacks the given channels into the first 3 channels of the array, used for RGB representation
-Channels *unpack_rgb_channels(unsigned char *red, unsigned char *green, unsigned char *blue, int length)
-{
-    Channels *colors = malloc(length * sizeof(Channels));
-    for (int i = 0; i < length; i++)
-    {
-        colors[i].channel[0] = red[i];
-        colors[i].channel[1] = green[i];
-        colors[i].channel[2] = blue[i];
-    }
-
-    return colors;
-}
-
-// Standardizes a batch 1 image into the range 0-255
-Channels **normalize_batch(Channels **img, int num_channels, int top, int start, int end, int offset)
-{
-    float upscale_factor = 255.f / top;
-    int size = end - start;
-    for (int i = 1 + offset; i < size + 2 * iterations - offset - 1; i++)
-        for (int j = 1; j < width + 1; j++)
-            for (int c = 0; c < num_channels; c++)
-                img[i][j].channel[c] = clamp_to_byte(upscale_factor * img[i][j].channel[c]);
-
-    return img;
-}
-
-// Applies the vertical part of the spatial sepratable convolution
-void conv_vertical(Channels **img, int num_channels, int start, int end, int offset)
-{
-    int size = end - start;
-    float K[channel_count] = {1.f / channel_count, 2.f / channel_count, 1.f / channel_count};
-
-    // The array is extended 'iterations' amount of rows in each direction
-    // And bordered with 0 on width
-    Channels **bordered_img = new_channel_array(size + 2 * iterations, width + 2);
-
-    for (int i = 0; i < size + 2 * iterations; i++)
-        for (int j = 0; j < width; j++)
-            bordered_img[i][j + 1] = img[i][j];
-
-    for (int i = 1 + offset; i < size + 2 * iterations - offset - 1; i++)
-        for (int j = 1; j < width + 1; j++)
-        {
-            float *final_pixel = calloc(num_channels, sizeof(float));
-            for (int m = -1, k = 0; m <= 1; m++, k++)
-                // In case of margins, those can't be extended, so we have to treat them as bordered with 0
-                if (!((start == 0 && i < iterations) || (end == height && i > size + iterations - 1)))
-                    for (int c = 0; c < num_channels; c++)
-                        final_pixel[c] += bordered_img[i + m][j].channel[c] * K[k];
-
-            for (int c = 0; c < num_channels; c++)
-                img[i][j - 1].channel[c] = clamp_to_byte(final_pixel[c]);
-
-            free(final_pixel);
-        }
-}
-
-// Applies the horizonal part of the spatial sepratable convolution
-int conv_horizontal(Channels **img, int num_channels, int start, int end, int offset)
-{
-    int size = end - start;
-    int top = 0;
-    float K[channel_count] = {-1.f / channel_count, 0 / channel_count, 1.f / channel_count};
-
-    Channels **bordered_img = new_channel_array(size + 2 * iterations, width + 2);
-
-    for (int i = 0; i < size + 2 * iterations; i++)
-        for (int j = 0; j < width; j++)
-            bordered_img[i][j + 1] = img[i][j];
-
-    for (int i = 1 + offset; i < size + 2 * iterations - offset - 1; i++)
-        for (int j = 1; j < width + 1; j++)
-        {
-            float *final_pixel = calloc(num_channels, sizeof(float));
-            for (int n = -1, k = 0; n <= 1; n++, k++)
-                if (!((start == 0 && i < iterations) || (end == height && i > size + iterations - 1)))
-                    for (int c = 0; c < num_channels; c++)
-                        final_pixel[c] += bordered_img[i][j + n].channel[c] * K[k];
-
-            for (int c = 0; c < num_channels; c++)
-            {
-                img[i][j - 1].channel[c] = clamp_to_byte(final_pixel[c]);
-                // Also keep in mind the top range of the distribution here to avoid another traversal
-                top = fmax(top, img[i][j - 1].channel[c]);
-            }
-
-            free(final_pixel);
-        }
-
-    return top;
-}
-
-/* Applies a depthwise convolution with a random kernel, increasing the number of channels
-to the specified amount. Must be a multiple of the original arrays number of channels! */
-void conv_depthwise_encode(Channels **img, int num_channels, int start, int end, int offset)
-{
-
-    int size = end - start;
-    // This kernel should be learned by our network, but here we will randomly generate it
-    float *K = get_kernel(offset);
-
-    // Pool the channels with a stride of 'channel_count'
-    for (int channel_id = channel_count; channel_id < num_channels; channel_id++)
-    {
-        for (int i = 1 + offset; i < size - offset - 1; i++)
-            for (int j = 1; j < width + 1; j++)
-            {
-                float final_pixel = 0;
-                for (int c = 0; c < channel_count; c++)
-                    final_pixel += img[i][j].channel[channel_id % channel_count] * K[c];
-
-                img[i][j].channel[channel_id] = clamp_to_byte(final_pixel);
-            }
-    }
-    free(K);
-}
-
-/* Applies the depthwise convolution with a static kernel, transforming the array back
-into a 3-channel image. */
-void conv_depthwise_decode(Channels **img, int num_channels, int start, int end, int offset)
-{
-    int size = end - start;
-    int multiplier = num_channels / channel_count;
-
-    for (int i = 1 + offset; i < size - offset - 1; i++)
-        for (int j = 1; j < width + 1; j++)
-        {
-            float red = 0;
-            float green = 0;
-            float blue = 0;
-
-            // This has the effect of averaging out all the dimensions into 3 colors
-            // An additional kernel could be used for more complex outputs
-            for (int c = 0; c < num_channels; c += channel_count)
-            {
-                red += img[i][j].channel[c + 0];
-                green += img[i][j].channel[c + 1];
-                blue += img[i][j].channel[c + 2];
-            }
-            img[i][j].channel[0] = clamp_to_byte(red / multiplier);
-            img[i][j].channel[1] = clamp_to_byte(green / multiplier);
-            img[i][j].channel[2] = clamp_to_byte(blue / multiplier);
-        }
-}
-
-/* Applies the depthwise separable convolution to the given image.
-    - offset: Tells us how deep to convolve the extended rows of the bordered array
-when applying multiple iterations at once. This helps reduce the number of transfers between
-processes to 1, agnostic of the number of iterations.
-    - channel_multiplier: Applies a polling step the the array, extending the number of channels
-by the given amount.
-*/
-void conv_separable(Channels **img, int channel_multiplier, int start, int end, int offset)
-{
-    // First we apply the vertical kernel
-    conv_vertical(img, channel_count, start, end, offset);
-    // The applying the horizonal part of the decomposed kernel
-    int local_top = conv_horizontal(img, channel_count, start, end, offset);
-
-    // In order to normalize the batch, we need the values distribution from ALL the processes
-    int global_top = local_top;
-
-    for (int p = 0; p < n_processes; p++)
-        if (p != rank)
-            MPI_Send(&local_top, 1, MPI_INT, p, 0, MPI_COMM_WORLD);
-
-    for (int p = 0; p < n_processes; p++)
-        if (p != rank)
-        {
-            MPI_Recv(&local_top, 1, MPI_INT, p, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            global_top = fmax(global_top, local_top);
-        }
-
-    // Normalizing the batch using the widest range
-    normalize_batch(img, channel_count, global_top, start, end, offset);
-
-    // Applying deptwise encoding to the image, incresing the number of channels by 'channel_multiplier'
-    conv_depthwise_encode(img, channel_count * channel_multiplier, start, end, offset);
-    // Compressing the array back into a 3-channel image
-    conv_depthwise_decode(img, channel_count * channel_multiplier, start, end, offset);
-}
-
-int main(int argc, char *argv[])
-{
-    MPI_Init(&argc, &argv);
-
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &n_processes);
-
-    char *in_name = argv[1];
-    char *out_name = argv[2];
-    iterations = atoi(argv[3]);
-    int channel_multiplier = atoi(argv[4]);
-
-    if (rank == 0)
-    {
-
-        Channels **img = read_image_pnm(in_name, &width, &height);
-        printf("%d %d\n", width, height);
-        int start, end;
-
-        for (int p = 1; p < n_processes; p++)
-        {
-            MPI_Send(&width, 1, MPI_INT, p, 0, MPI_COMM_WORLD);
-            MPI_Send(&height, 1, MPI_INT, p, 0, MPI_COMM_WORLD);
-
-            start = p * ceil((double)height / n_processes);
-            end = fmin(height, (p + 1) * ceil((double)height / n_processes));
-
-            // Send the padded parts of the image to each process
-            for (int j = start - iterations; j < end + iterations; j++)
-                if (j < height)
-                {
-                    MPI_Send(pack_channel(img[j], width + 2, 0), width + 2, MPI_UNSIGNED_CHAR, p, 0, MPI_COMM_WORLD);
-                    MPI_Send(pack_channel(img[j], width + 2, 1), width + 2, MPI_UNSIGNED_CHAR, p, 0, MPI_COMM_WORLD);
-                    MPI_Send(pack_channel(img[j], width + 2, 2), width + 2, MPI_UNSIGNED_CHAR, p, 0, MPI_COMM_WORLD);
-                }
-        }
-
-        start = 0 * ceil((double)height / n_processes);
-        end = fmin(height, (0 + 1) * ceil((double)height / n_processes) + iterations);
-        int size = end - start;
-
-        // Master will also process it's part of the image
-        Channels **img0 = new_channel_array(size + 2 * iterations, width);
-
-        for (int j = 0; j < size; j++)
-            img0[j + iterations] = img[j];
-
-        for (int i = 0; i < iterations; i++)
-            conv_separable(img0, channel_multiplier, start, end, i);
-
-        for (int j = 0; j < size; j++)
-            img[j] = img0[j + iterations];
-
-        // After the convolution is done, gather back the parts
-        for (int i = 1; i < n_processes; i++)
-        {
-            start = i * ceil((double)height / n_processes);
-            end = fmin(height, (i + 1) * ceil((double)height / n_processes));
-
-            for (int j = start; j < end; j++)
-            {
-                unsigned char *red = malloc(width * sizeof(unsigned char));
-                unsigned char *green = malloc(width * sizeof(unsigned char));
-                unsigned char *blue = malloc(width * sizeof(unsigned char));
-
-                MPI_Recv(red, width, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                MPI_Recv(green, width, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                MPI_Recv(blue, width, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-                img[j] = unpack_rgb_channels(red, green, blue, width);
-                free(red);
-                free(green);
-                free(blue);
-            }
-        }
-        write_image_pnm(img, out_name, width, height);
-    }
-    else
-    {
-        MPI_Recv(&width, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        MPI_Recv(&height, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-        int start, end;
-        start = rank * ceil((double)height / n_processes);
-        end = fmin(height, (rank + 1) * ceil((double)height / n_processes));
-
-        int size = end - start;
-
-        // Each slave process gathers it's part of channels from master
-        Channels **img = (Channels **)calloc(size + 2 * iterations, sizeof(Channels *));
-        for (int j = 0; j < size + 2 * iterations; j++)
-        {
-            unsigned char *red = malloc(width * sizeof(unsigned char));
-            unsigned char *green = malloc(width * sizeof(unsigned char));
-            unsigned char *blue = malloc(width * sizeof(unsigned char));
-
-            if (!(rank == n_processes - 1 && j >= size + iterations))
-            {
-                MPI_Recv(red, width + 2, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                MPI_Recv(green, width + 2, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                MPI_Recv(blue, width + 2, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
-
-            img[j] = unpack_rgb_channels(red, green, blue, width);
-            free(red);
-            free(green);
-            free(blue);
-        }
-
-        /* There is no more communication at this point, each process can convolve it's padded 
-            part of the image agnostic of the number of iterations.
-        */
-        for (int i = 0; i < iterations; i++)
-            conv_separable(img, channel_multiplier, start, end, i);
-
-        // Send back the processed part of the image back to master
-        for (int j = iterations; j < size + iterations; j++)
-        {
-            MPI_Send(pack_channel(img[j], width, 0), width, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
-            MPI_Send(pack_channel(img[j], width, 1), width, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
-            MPI_Send(pack_channel(img[j], width, 2), width, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
-        }
-    }
-    MPI_Finalize();
-    return 0;
-}
+#include <math.h>
+#include <mpi.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "../Utils/arena.h"
+#include "../Utils/kernels.h"
+#include "../Utils/options.h"
+#include "../Utils/separable.h"
+#include "../Utils/stages.h"
+#include "../Utils/stream.h"
+#include "../Utils/trace.h"
+#include "../Utils/utils.h"
+#include "../Utils/weights.h"
+
+// Tags of the halo rows exchanged between neighbours, by the direction they travel in
+#define HALO_UP 1
+#define HALO_DOWN 2
+#define HALO_LEFT 3
+#define HALO_RIGHT 4
+
+int rank;
+int n_processes;
+// Threads of every process, the hybrid build runs the stages of a band on several of them
+int n_threads = 1;
+int width;
+int height;
+int iterations;
+int channel_multiplier;
+Options opts;
+// Rows eaten by the vertical kernel on each side of a band per iteration
+int radius;
+// Depth of the ghost zone exchanged once for all the iterations, or before every stage with --halo=exchange
+int halo;
+// Scratch of the whole run, carved out of one arena by new_workspace
+Arena *arena;
+// Process grid of --decomp=grid, 'dims' blocks down and across, and the neighbours of the block in it
+MPI_Comm grid;
+int dims[2];
+int coords[2];
+int north, south, west, east;
+// Columns of the image the process owns, its rows hold 'col_halo' more on each side. Bands of whole rows have none
+int cols;
+int col_halo;
+// Band of the process with its ghost rows, and on the master the whole image, both contiguous
+Channels **band_rows;
+Channels **image;
+// The owned columns of every row of the band, which the pointwise stages run on
+Channels **interior;
+// Band the split passes alternate with, bordered with a 0 pixel on each side
+Channels **spare;
+// A fused workspace and the lines of the pointwise stages per thread, and the halos of the parts of the band they run
+FusedWorkspace **workspaces;
+StageLines **stage_lines;
+unsigned char *halos;
+// With --halo=exchange, the rows sent to the neighbours and the halos of the two boundaries
+unsigned char *halo_out;
+unsigned char *halo_top;
+unsigned char *halo_bottom;
+// RGB channels of a pixel and of a row of the image, and the owned part and the halo strips of a block, see
+// new_datatypes
+MPI_Datatype pixel_type;
+MPI_Datatype row_type;
+MPI_Datatype block_type;
+MPI_Datatype column_strip;
+MPI_Datatype row_strip;
+
+/* Allocates the band of 'rows' rows and the scratch of every stage at once, along with
+'image_rows' rows for the whole image. The stages reuse it for all the iterations. */
+void new_workspace(int rows, int image_rows)
+{
+    int block_width = cols + 2 * col_halo;
+    size_t workspace_size = fused_workspace_size(block_width, &opts.vertical, &opts.horizontal);
+    size_t lines_size = stage_lines_size(cols);
+    size_t halo_size = fused_halo_size(width, &opts.vertical);
+    size_t halos_size = n_threads * fused_halo_size(block_width, &opts.vertical);
+    size_t size = arena_size(n_threads * sizeof(FusedWorkspace *)) + n_threads * arena_size(workspace_size) +
+                  arena_size(n_threads * sizeof(StageLines *)) + n_threads * arena_size(lines_size) +
+                  arena_size(halos_size) + channel_array_size(rows, block_width, 0) +
+                  arena_size(rows * sizeof(Channels *)) + channel_array_size(image_rows, width, 0);
+    if (!opts.fused)
+        size += channel_array_size(rows, cols, 1);
+    if (opts.exchange && !opts.grid)
+        size += 3 * arena_size(halo_size);
+    arena = new_arena(size);
+
+    workspaces = arena_alloc(arena, n_threads * sizeof(FusedWorkspace *));
+    stage_lines = arena_alloc(arena, n_threads * sizeof(StageLines *));
+    for (int t = 0; t < n_threads; t++)
+    {
+        workspaces[t] =
+            place_fused_workspace(arena_alloc(arena, workspace_size), block_width, &opts.vertical, &opts.horizontal);
+        workspaces[t]->first_col = col_halo;
+        workspaces[t]->last_col = col_halo + cols;
+        stage_lines[t] = place_stage_lines(arena_alloc(arena, lines_size), cols);
+    }
+    halos = arena_alloc(arena, halos_size);
+    band_rows = arena_channel_array(arena, rows, block_width, 0);
+    interior = arena_alloc(arena, rows * sizeof(Channels *));
+    for (int i = 0; i < rows; i++)
+        interior[i] = band_rows[i] + col_halo;
+    image = arena_channel_array(arena, image_rows, width, 0);
+    if (!opts.fused)
+        spare = arena_channel_array(arena, rows, cols, 1);
+    if (opts.exchange && !opts.grid)
+    {
+        halo_out = arena_alloc(arena, halo_size);
+        halo_top = arena_alloc(arena, halo_size);
+        halo_bottom = arena_alloc(arena, halo_size);
+    }
+}
+
+// Range [start, end) of part 'index' when 'n' rows or columns are split into 'parts'
+void block_range(int n, int parts, int index, int *start, int *end)
+{
+    int block = ceil((double)n / parts);
+    *start = fmin(n, index * block);
+    *end = fmin(n, (index + 1) * block);
+}
+
+// Image rows [start, end) process 'p' is responsible for
+void band_of(int p, int *start, int *end)
+{
+    block_range(height, n_processes, p, start, end);
+}
+
+// Number of image rows the process is responsible for, they start at row 'halo' of its band
+int owned_rows()
+{
+    int start, end;
+    if (opts.grid)
+        block_range(height, dims[0], coords[0], &start, &end);
+    else
+        band_of(rank, &start, &end);
+    return end - start;
+}
+
+/* Picks the shape of the process grid with the least halo to exchange per block, for square
+kernels the one whose blocks are the closest to squares given the aspect ratio of the image.
+Every block has to be at least as deep as the halo in both directions, so that a neighbour
+holds all of it. Returns 0 if no shape qualifies. */
+int choose_grid(int dims[2])
+{
+    int col_radius = opts.horizontal.taps / 2;
+    double best = -1;
+
+    for (int down = 1; down <= n_processes; down++)
+    {
+        if (n_processes % down)
+            continue;
+        int across = n_processes / down;
+        int block_rows = ceil((double)height / down);
+        int block_cols = ceil((double)width / across);
+
+        // The last block in each direction is the smallest one
+        if (height - (down - 1) * block_rows < fmax(1, radius) || width - (across - 1) * block_cols < fmax(1, col_radius))
+            continue;
+
+        double cost = (double)block_cols * radius + (double)block_rows * col_radius;
+        if (best < 0 || cost < best)
+        {
+            best = cost;
+            dims[0] = down;
+            dims[1] = across;
+        }
+    }
+
+    return best >= 0;
+}
+
+// Whether process 'p' owns any rows, the last processes are left without any on small images
+int has_rows(int p)
+{
+    return p < n_processes && p * ceil((double)height / n_processes) < height;
+}
+
+/* Rows [band_first, band_last) of the band of the image rows [start, end) lie in the image. The
+ghost rows outside of it can't be extended, they are treated as 0. */
+int band_first(int start)
+{
+    return fmax(0, halo - start);
+}
+
+int band_last(int start, int end)
+{
+    return fmin(end - start + 2 * halo, height - start + halo);
+}
+
+// First row of the band still up to date after the spatial stage 'offset', the rows before it are stale ghost rows
+int stale_rows(int offset)
+{
+    return opts.exchange ? halo : radius * (offset + 1);
+}
+
+/* Sends the 'halo' rows at each end of the band of 'size' rows to the neighbouring processes,
+and posts the receives of their rows into 'above' and 'below'. Returns the number of requests
+posted. A band shorter than the halo sends what it has, the receiver reads the rest as 0. */
+int post_halo_exchange(Channels **img, int size, unsigned char *above, unsigned char *below, MPI_Request *requests)
+{
+    int line_size = width * channel_count;
+    int rows = fmin(halo, size);
+    int n = 0;
+
+    if (size <= 0)
+        return 0;
+
+    for (int r = 0; r < rows; r++)
+    {
+        pack_channels(halo_out + r * line_size, img[halo + r], width, 0);
+        pack_channels(halo_out + (halo + r) * line_size, img[halo + size - rows + r], width, 0);
+    }
+
+    if (rank > 0)
+    {
+        memset(above, 0, halo * line_size);
+        MPI_Irecv(above, halo * line_size, MPI_UNSIGNED_CHAR, rank - 1, HALO_DOWN, MPI_COMM_WORLD, &requests[n++]);
+        MPI_Isend(halo_out, rows * line_size, MPI_UNSIGNED_CHAR, rank - 1, HALO_UP, MPI_COMM_WORLD, &requests[n++]);
+    }
+    if (has_rows(rank + 1))
+    {
+        memset(below, 0, halo * line_size);
+        MPI_Irecv(below, halo * line_size, MPI_UNSIGNED_CHAR, rank + 1, HALO_UP, MPI_COMM_WORLD, &requests[n++]);
+        MPI_Isend(halo_out + halo * line_size, rows * line_size, MPI_UNSIGNED_CHAR, rank + 1, HALO_DOWN,
+                  MPI_COMM_WORLD, &requests[n++]);
+    }
+
+    return n;
+}
+
+// Exchanges the halo rows with the neighbours and waits for them to land in the ghost rows of the band
+void exchange_halo(Channels **img, int size)
+{
+    int line_size = width * channel_count;
+    MPI_Request requests[4];
+
+    TRACE_BEGIN("exchange_halo");
+    int n = post_halo_exchange(img, size, halo_top, halo_bottom, requests);
+    MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
+
+    for (int r = 0; r < halo; r++)
+    {
+        if (rank > 0)
+            unpack_channels(img[r], halo_top + r * line_size, width, 0);
+        if (has_rows(rank + 1))
+            unpack_channels(img[halo + size + r], halo_bottom + r * line_size, width, 0);
+    }
+    TRACE_END();
+}
+
+/* Describes the RGB channels straight in the Channels arrays, so the rows and blocks are sent
+and received in place without packing them. The arrays must have no border, one row then
+follows the other. A block of 'rows' rows has the 'halo' rows above and below it, and the
+'col_halo' columns on each side. */
+void new_datatypes(int rows)
+{
+    MPI_Datatype rgb;
+    MPI_Type_contiguous(channel_count, MPI_UNSIGNED_CHAR, &rgb);
+    MPI_Type_create_resized(rgb, 0, sizeof(Channels), &pixel_type);
+    MPI_Type_commit(&pixel_type);
+    MPI_Type_free(&rgb);
+
+    MPI_Type_contiguous(width, pixel_type, &row_type);
+    MPI_Type_commit(&row_type);
+
+    if (opts.grid)
+    {
+        int stride = cols + 2 * col_halo;
+        MPI_Type_vector(rows, cols, stride, pixel_type, &block_type);
+        MPI_Type_vector(rows, col_halo, stride, pixel_type, &column_strip);
+        MPI_Type_contiguous(halo * stride, pixel_type, &row_strip);
+        MPI_Type_commit(&block_type);
+        MPI_Type_commit(&column_strip);
+        MPI_Type_commit(&row_strip);
+    }
+}
+
+void free_datatypes()
+{
+    MPI_Type_free(&pixel_type);
+    MPI_Type_free(&row_type);
+    if (opts.grid)
+    {
+        MPI_Type_free(&block_type);
+        MPI_Type_free(&column_strip);
+        MPI_Type_free(&row_strip);
+    }
+}
+
+/* Exchanges the halo of the block with its 8 neighbours in two steps. The columns go west and
+east first. Then the rows go north and south as wide as the halo columns just received, which
+carries the corners along. The halo past the edges of the image has no neighbour and stays 0. */
+void exchange_block_halo(Channels **img, int rows)
+{
+    MPI_Request requests[4];
+
+    TRACE_BEGIN("exchange_block_halo");
+    MPI_Irecv(&img[halo][0], 1, column_strip, west, HALO_RIGHT, grid, &requests[0]);
+    MPI_Irecv(&img[halo][col_halo + cols], 1, column_strip, east, HALO_LEFT, grid, &requests[1]);
+    MPI_Isend(&img[halo][col_halo], 1, column_strip, west, HALO_LEFT, grid, &requests[2]);
+    MPI_Isend(&img[halo][cols], 1, column_strip, east, HALO_RIGHT, grid, &requests[3]);
+    MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+    MPI_Irecv(img[0], 1, row_strip, north, HALO_DOWN, grid, &requests[0]);
+    MPI_Irecv(img[halo + rows], 1, row_strip, south, HALO_UP, grid, &requests[1]);
+    MPI_Isend(img[halo], 1, row_strip, north, HALO_UP, grid, &requests[2]);
+    MPI_Isend(img[rows], 1, row_strip, south, HALO_DOWN, grid, &requests[3]);
+    MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+    TRACE_END();
+}
+
+// Block of the master's image that process 'p' of the grid owns, as a datatype over the whole image
+MPI_Datatype image_block(int p)
+{
+    int at[2];
+    int sizes[2] = {height, width};
+    int subsizes[2];
+    int starts[2];
+    int end;
+    MPI_Cart_coords(grid, p, 2, at);
+    block_range(height, dims[0], at[0], &starts[0], &end);
+    subsizes[0] = end - starts[0];
+    block_range(width, dims[1], at[1], &starts[1], &end);
+    subsizes[1] = end - starts[1];
+
+    MPI_Datatype block;
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, pixel_type, &block);
+    MPI_Type_commit(&block);
+    return block;
+}
+
+/* Hands every process of the grid its block of the master's image, one message each, and then
+fills in the halos. With 'gather' set the owned blocks go back to the master instead. */
+void move_blocks(int rows, int gather)
+{
+    MPI_Request requests[n_processes + 1];
+    int n = 0;
+
+    TRACE_BEGIN("move_blocks");
+    if (gather)
+        MPI_Isend(&band_rows[halo][col_halo], 1, block_type, 0, 0, grid, &requests[n++]);
+    else
+        MPI_Irecv(&band_rows[halo][col_halo], 1, block_type, 0, 0, grid, &requests[n++]);
+
+    if (rank == 0)
+        for (int p = 0; p < n_processes; p++)
+        {
+            // The type is only released once the transfer is done
+            MPI_Datatype block = image_block(p);
+            if (gather)
+                MPI_Irecv(image[0], 1, block, p, 0, grid, &requests[n++]);
+            else
+                MPI_Isend(image[0], 1, block, p, 0, grid, &requests[n++]);
+            MPI_Type_free(&block);
+        }
+
+    MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
+    TRACE_END();
+    if (!gather)
+        exchange_block_halo(band_rows, rows);
+}
+
+/* Hands every process its band of the master's image. The owned rows go out in one scatter,
+which can't read any row twice, so the ghost zones, that overlap those of the neighbours,
+follow in one message per side. With --halo=exchange they come from the neighbours instead. */
+void scatter_bands(int start, int end)
+{
+    int size = end - start;
+    int counts[n_processes];
+    int displs[n_processes];
+    for (int p = 0; p < n_processes; p++)
+    {
+        int first, last;
+        band_of(p, &first, &last);
+        counts[p] = last - first;
+        displs[p] = first;
+    }
+
+    TRACE_BEGIN("MPI_Scatterv");
+    MPI_Scatterv(rank == 0 ? image[0] : NULL, counts, displs, row_type, band_rows[halo], size, row_type, 0,
+                 MPI_COMM_WORLD);
+    TRACE_END();
+
+    if (opts.exchange)
+    {
+        exchange_halo(band_rows, size);
+        return;
+    }
+
+    MPI_Request requests[2 * n_processes + 2];
+    int n = 0;
+    int above = fmin(halo, start);
+    int below = fmin(halo, height - end);
+    TRACE_BEGIN("scatter ghost rows");
+    MPI_Irecv(band_rows[halo - above], above, row_type, 0, HALO_DOWN, MPI_COMM_WORLD, &requests[n++]);
+    MPI_Irecv(band_rows[halo + size], below, row_type, 0, HALO_UP, MPI_COMM_WORLD, &requests[n++]);
+
+    if (rank == 0)
+        for (int p = 0; p < n_processes; p++)
+        {
+            int first, last;
+            band_of(p, &first, &last);
+            above = fmin(halo, first);
+            below = fmin(halo, height - last);
+            MPI_Isend(image[first - above], above, row_type, p, HALO_DOWN, MPI_COMM_WORLD, &requests[n++]);
+            // The image has no row past its end, so take the address from its first one
+            MPI_Isend(image[0] + (size_t)last * width, below, row_type, p, HALO_UP, MPI_COMM_WORLD, &requests[n++]);
+        }
+
+    MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
+    TRACE_END();
+}
+
+// Collects the rows every process owns back into the master's image
+void gather_bands(int start, int end)
+{
+    int counts[n_processes];
+    int displs[n_processes];
+    for (int p = 0; p < n_processes; p++)
+    {
+        int first, last;
+        band_of(p, &first, &last);
+        counts[p] = last - first;
+        displs[p] = first;
+    }
+
+    TRACE_BEGIN("MPI_Gatherv");
+    MPI_Gatherv(band_rows[halo], end - start, row_type, rank == 0 ? image[0] : NULL, counts, displs, row_type, 0,
+                MPI_COMM_WORLD);
+    TRACE_END();
+}
+
+// Applies the vertical part of the spatial sepratable convolution, reading 'img' and writing 'out'
+void conv_vertical(Channels **img, Channels **out, int num_channels, int start, int end, int offset)
+{
+    int size = end - start;
+    int first = band_first(start);
+    int last = band_last(start, end);
+    float K[channel_count] = {1.f / channel_count, 2.f / channel_count, 1.f / channel_count};
+
+    TRACE_BEGIN("conv_vertical");
+    // The array is extended 'halo' amount of rows in each direction
+    for (int i = stale_rows(offset); i < size + 2 * halo - stale_rows(offset); i++)
+        for (int j = 0; j < width; j++)
+        {
+            float final_pixel[num_channels];
+            for (int c = 0; c < num_channels; c++)
+                final_pixel[c] = 0;
+
+            // In case of margins, those can't be extended, so we have to treat them as bordered with 0
+            // The rows past the margins hold nothing either, so they are read as 0 as well
+            for (int m = -1, k = 0; m <= 1; m++, k++)
+                if (i >= first && i < last && i + m >= first && i + m < last)
+                    for (int c = 0; c < num_channels; c++)
+                        final_pixel[c] += img[i + m][j].channel[c] * K[k];
+
+            for (int c = 0; c < num_channels; c++)
+                out[i][j].channel[c] = clamp_to_byte(final_pixel[c]);
+        }
+    TRACE_END();
+}
+
+// Applies the horizonal part of the spatial sepratable convolution, reading the bordered 'img' and writing 'out'
+int conv_horizontal(Channels **img, Channels **out, int num_channels, int start, int end, int offset)
+{
+    int size = end - start;
+    int first = band_first(start);
+    int last = band_last(start, end);
+    int top = 0;
+    float K[channel_count] = {-1.f / channel_count, 0 / channel_count, 1.f / channel_count};
+
+    TRACE_BEGIN("conv_horizontal");
+    for (int i = stale_rows(offset); i < size + 2 * halo - stale_rows(offset); i++)
+        for (int j = 0; j < width; j++)
+        {
+            float final_pixel[num_channels];
+            for (int c = 0; c < num_channels; c++)
+                final_pixel[c] = 0;
+
+            for (int n = -1, k = 0; n <= 1; n++, k++)
+                if (i >= first && i < last)
+                    for (int c = 0; c < num_channels; c++)
+                        final_pixel[c] += img[i][j + n].channel[c] * K[k];
+
+            for (int c = 0; c < num_channels; c++)
+            {
+                out[i][j].channel[c] = clamp_to_byte(final_pixel[c]);
+                // Also keep in mind the top range of the distribution here to avoid another traversal
+                top = fmax(top, out[i][j].channel[c]);
+            }
+        }
+    TRACE_END();
+
+    return top;
+}
+
+// Rows [*from, *to) of the part of thread 't' when the rows [start, end) are split between the threads
+void thread_part(int start, int end, int t, int *from, int *to)
+{
+    block_range(end - start, n_threads, t, from, to);
+    *from += start;
+    *to += start;
+}
+
+/* Runs the fused pass over the rows [start, end) of the band, split between the threads. The
+halos of every part are stored before any of them starts writing. 'outer', when given, holds
+the halo of the whole range, stored by the caller before the rows around it were written. */
+int fused_rows(Channels **img, int first, int last, int start, int end, const unsigned char *outer)
+{
+    int radius = opts.vertical.taps / 2;
+    int line_size = (cols + 2 * col_halo) * channel_count;
+    size_t halo_size = fused_halo_size(cols + 2 * col_halo, &opts.vertical);
+    int top = 0;
+
+    for (int t = 0; t < n_threads; t++)
+    {
+        int from, to;
+        thread_part(start, end, t, &from, &to);
+        unsigned char *part_halo = halos + t * halo_size;
+        fused_store_halo(workspaces[t], img, first, last, from, to, part_halo);
+
+        // The rows outside of the range are taken from the outer halo
+        if (outer)
+            for (int k = 0; k < radius; k++)
+            {
+                if (from - radius + k < start)
+                    memcpy(part_halo + k * line_size, outer + (from - radius + k - start + radius) * line_size,
+                           line_size);
+                if (to + k >= end)
+                    memcpy(part_halo + (radius + k) * line_size, outer + (radius + to + k - end) * line_size,
+                           line_size);
+            }
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for reduction(max : top)
+#endif
+    for (int t = 0; t < n_threads; t++)
+    {
+        int from, to;
+        thread_part(start, end, t, &from, &to);
+        if (from < to)
+        {
+            TRACE_BEGIN("conv_separable_fused");
+            fused_load_halo(workspaces[t], halos + t * halo_size);
+            top = fmax(top, conv_separable_fused(workspaces[t], img, first, last, from, to));
+            TRACE_END();
+        }
+    }
+
+    return top;
+}
+
+// Runs the pointwise stages over the rows [start, end) of the band, split between the threads, and returns their top
+int pointwise_threads(Channels **img, int start, int end, float upscale_factor, int num_channels, float *K)
+{
+    int top = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for reduction(max : top)
+#endif
+    for (int t = 0; t < n_threads; t++)
+    {
+        int from, to;
+        thread_part(start, end, t, &from, &to);
+        if (from < to)
+        {
+            TRACE_BEGIN("pointwise_rows");
+            top = fmax(top, pointwise_rows(stage_lines[t], img, cols, from, to, upscale_factor, num_channels, K,
+                                           opts.expanded));
+            TRACE_END();
+        }
+    }
+
+    return top;
+}
+
+// Applies both spatial kernels in a single sweep, with the same ghost zone rules as the split passes
+int conv_spatial_fused(Channels **img, int start, int end, int offset)
+{
+    int size = end - start;
+
+    int first = band_first(start);
+    int last = band_last(start, end);
+
+    return fused_rows(img, first, last, stale_rows(offset), size + 2 * halo - stale_rows(offset), NULL);
+}
+
+/* Fused spatial stage with --halo=exchange. The interior rows, whose window stays within the
+band, are done while the halo rows travel, and the rows at each end once they have landed.
+Those run in place from the original rows around them, stored before the interior starts
+writing. Bands too thin to have an interior wait for the halos first. */
+int conv_spatial_exchange(Channels **img, int start, int end)
+{
+    int size = end - start;
+    int line_size = width * channel_count;
+    MPI_Request requests[4];
+
+    if (size <= 2 * halo)
+    {
+        exchange_halo(img, size);
+        return conv_spatial_fused(img, start, end, 0);
+    }
+
+    int first = band_first(start);
+    int last = band_last(start, end);
+
+    fused_store_halo(workspaces[0], img, first, last, halo, 2 * halo, halo_top);
+    fused_store_halo(workspaces[0], img, first, last, size, size + halo, halo_bottom);
+    int n = post_halo_exchange(img, size, halo_top, halo_bottom + halo * line_size, requests);
+
+    int top = fused_rows(img, first, last, 2 * halo, size, NULL);
+
+    TRACE_BEGIN("MPI_Waitall");
+    MPI_Waitall(n, requests, MPI_STATUSES_IGNORE);
+    TRACE_END();
+    top = fmax(top, fused_rows(img, first, last, halo, 2 * halo, halo_top));
+    top = fmax(top, fused_rows(img, first, last, size, size + halo, halo_bottom));
+
+    return top;
+}
+
+/* Normalizes the rows with 'upscale_factor' as they are loaded, then applies the depthwise
+encode and the decode in the same go, so the expanded channels never leave the line buffers.
+With --depthwise=expanded they are written into the rows in between. Returns the top of the
+rows owned by the process. */
+int conv_depthwise(Channels **img, int num_channels, int start, int end, int offset, float upscale_factor)
+{
+    int size = end - start;
+    int owned_end = halo + owned_rows();
+    // This kernel should be learned by our network, but here we will randomly generate it
+    float *K = get_kernel(offset);
+
+    // The ghost rows are done apart, they don't end up in the output and must not widen its range
+    pointwise_threads(img, stale_rows(offset), halo, upscale_factor, num_channels, K);
+    int top = pointwise_threads(img, halo, owned_end, upscale_factor, num_channels, K);
+    pointwise_threads(img, owned_end, size + 2 * halo - stale_rows(offset), upscale_factor, num_channels, K);
+    free(K);
+
+    return top;
+}
+
+/* Applies the depthwise separable convolution to the given image.
+    - offset: Tells us how deep to convolve the extended rows of the bordered array
+when applying multiple iterations at once. This helps reduce the number of transfers between
+processes to 1, agnostic of the number of iterations. With --halo=exchange the halo is sent
+again before every stage but the first, whose ghost rows come with the band.
+    - channel_multiplier: Applies a polling step the the array, extending the number of channels
+by the given amount.
+Returns the top of the rows of the process written by the last stage.
+*/
+int conv_separable(Channels **img, int channel_multiplier, int start, int end, int offset)
+{
+    int local_top;
+    if (opts.grid)
+    {
+        // The halos of the first stage come along with the block
+        if (offset > 0)
+            exchange_block_halo(img, end - start);
+        local_top = conv_spatial_fused(img, start, end, offset);
+    }
+    else if (opts.exchange && offset > 0 && opts.fused)
+        local_top = conv_spatial_exchange(img, start, end);
+    else if (opts.fused)
+        local_top = conv_spatial_fused(img, start, end, offset);
+    else
+    {
+        // The split passes read the ghost rows straight from the band, so they wait for them
+        if (opts.exchange && offset > 0)
+            exchange_halo(img, end - start);
+
+        // First we apply the vertical kernel
+        conv_vertical(img, spare, channel_count, start, end, offset);
+        // The applying the horizonal part of the decomposed kernel, which lands back in the band
+        local_top = conv_horizontal(spare, img, channel_count, start, end, offset);
+    }
+
+    // In order to normalize the batch, we need the values distribution from ALL the processes
+    int global_top;
+    TRACE_BEGIN("MPI_Allreduce");
+    MPI_Allreduce(&local_top, &global_top, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    TRACE_END();
+
+    // The batch is normalized using the widest range, as the next stage loads it
+    float upscale_factor = 255.f / global_top;
+
+    // Encoding and compressing back into a 3-channel image
+    return conv_depthwise(interior, channel_count * channel_multiplier, start, end, offset, upscale_factor);
+}
+
+/* Streaming mode, every process streams its own band of rows straight from the files. The
+stages run on the threads of the process, like in the in-memory mode. */
+int stream_spatial(Channels **rows, int strip_first, int first, int last, int start, int end)
+{
+    // The workspace is made by the first strip
+    if (!arena)
+    {
+        cols = width;
+        new_workspace(0, 0);
+    }
+
+    return fused_rows(rows, first, last, start, end, NULL);
+}
+
+int stream_pointwise(Channels **rows, int strip_first, int start, int end, float upscale_factor, int iteration)
+{
+    float *K = get_kernel(iteration);
+    int top = pointwise_threads(rows, start, end, upscale_factor, channel_count * channel_multiplier, K);
+    free(K);
+
+    return top;
+}
+
+int stream_reduce_top(int top)
+{
+    TRACE_BEGIN("MPI_Allreduce");
+    MPI_Allreduce(MPI_IN_PLACE, &top, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    TRACE_END();
+    return top;
+}
+
+void stream_barrier()
+{
+    TRACE_BEGIN("MPI_Barrier");
+    MPI_Barrier(MPI_COMM_WORLD);
+    TRACE_END();
+}
+
+#ifdef TRACE
+// Collects the spans of every process into the trace file of the master, each process being one pid
+void dump_trace()
+{
+    size_t size;
+    char *events = trace_format(&size);
+    int length = size;
+    int lengths[n_processes];
+    int displs[n_processes];
+    MPI_Gather(&length, 1, MPI_INT, lengths, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    int total = 0;
+    for (int p = 0; rank == 0 && p < n_processes; p++)
+    {
+        displs[p] = total;
+        total += lengths[p];
+    }
+    char *all = rank == 0 ? malloc(total) : NULL;
+    MPI_Gatherv(events, length, MPI_CHAR, all, lengths, displs, MPI_CHAR, 0, MPI_COMM_WORLD);
+    if (rank == 0)
+        trace_write(trace_filename(), all, lengths, n_processes);
+
+    free(all);
+    free(events);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    // Only the master thread of a process communicates, outside of the parallel regions
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+#ifdef _OPENMP
+    if (provided >= MPI_THREAD_FUNNELED)
+        n_threads = omp_get_max_threads();
+#endif
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &n_processes);
+    trace_set_process(rank);
+
+    char *in_name = argv[1];
+    char *out_name = argv[2];
+    iterations = atoi(argv[3]);
+    channel_multiplier = atoi(argv[4]);
+    opts = parse_options(argc, argv, 5);
+    select_kernels(opts.isa, opts.fixed_point);
+    load_weights(opts.weights);
+    if (opts.batch)
+    {
+        // The processes split the rows of a single image, a batch is run by the shared memory backends
+        if (rank == 0)
+            fprintf(stderr, "--batch is not supported by the MPI backend\n");
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+    radius = opts.vertical.taps / 2;
+    halo = opts.exchange ? radius : iterations * radius;
+
+    if (opts.stream_rows)
+    {
+        StreamStages stages = {stream_spatial, stream_pointwise, stream_reduce_top, stream_barrier};
+        stream_image(in_name, out_name, iterations, radius, opts.stream_rows, rank, n_processes, &width, &height,
+                     &stages);
+        if (rank == 0)
+            printf("%d %d\n", width, height);
+        if (arena)
+            free_arena(arena);
+        free_weights();
+#ifdef TRACE
+        dump_trace();
+#endif
+        MPI_Finalize();
+        return 0;
+    }
+
+    // Only the master reads the image, the others learn its size from it
+    int size[2];
+    if (rank == 0)
+    {
+        PnmHeader header = read_pnm_header(in_name);
+        size[0] = header.width;
+        size[1] = header.height;
+    }
+    TRACE_BEGIN("MPI_Bcast");
+    MPI_Bcast(size, 2, MPI_INT, 0, MPI_COMM_WORLD);
+    TRACE_END();
+    width = size[0];
+    height = size[1];
+
+    // A neighbour has to hold the whole halo of a band, only the last band may be shorter
+    if (opts.exchange && !opts.grid && ceil((double)height / n_processes) < radius)
+    {
+        if (rank == 0)
+            fprintf(stderr, "--halo=exchange needs at least %d rows per process\n", radius);
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+    if (opts.grid && !choose_grid(dims))
+    {
+        if (rank == 0)
+            fprintf(stderr, "--decomp=grid needs blocks of at least %d rows and %d columns\n", radius,
+                    opts.horizontal.taps / 2);
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    int start, end;
+    if (opts.grid)
+    {
+        int periods[2] = {0, 0};
+        int col_start, col_end;
+        // The ranks are kept, so the master is still the process 0 of the grid
+        MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &grid);
+        MPI_Cart_coords(grid, rank, 2, coords);
+        MPI_Cart_shift(grid, 0, 1, &north, &south);
+        MPI_Cart_shift(grid, 1, 1, &west, &east);
+        block_range(height, dims[0], coords[0], &start, &end);
+        block_range(width, dims[1], coords[1], &col_start, &col_end);
+        cols = col_end - col_start;
+        col_halo = opts.horizontal.taps / 2;
+    }
+    else
+    {
+        band_of(rank, &start, &end);
+        cols = width;
+    }
+    new_workspace(end - start + 2 * halo, rank == 0 ? height : 0);
+    new_datatypes(end - start);
+
+    if (rank == 0)
+    {
+        read_image_pnm_into(in_name, image);
+        printf("%d %d\n", width, height);
+    }
+    if (opts.grid)
+        move_blocks(end - start, 0);
+    else
+        scatter_bands(start, end);
+
+    /* With the default ghost zone there is no more communication at this point, each process
+        can convolve it's padded part of the image agnostic of the number of iterations.
+    */
+    // The writer takes the range from the last stage, without iterations it has to scan the image
+    int local_top = -1;
+    for (int i = 0; i < iterations; i++)
+        local_top = conv_separable(band_rows, channel_multiplier, start, end, i);
+
+    if (opts.grid)
+        move_blocks(end - start, 1);
+    else
+        gather_bands(start, end);
+
+    int top;
+    TRACE_BEGIN("MPI_Reduce");
+    MPI_Reduce(&local_top, &top, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+    TRACE_END();
+    if (rank == 0)
+        write_image_pnm(image, out_name, width, height, top);
+
+    free_datatypes();
+    if (opts.grid)
+        MPI_Comm_free(&grid);
+    if (arena)
+        free_arena(arena);
+    free_weights();
+#ifdef TRACE
+    dump_trace();
+#endif
+    MPI_Finalize();
+    return 0;
+}
@@ -5,167 +5,439 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "../Utils/arena.h"
+#include "../Utils/batch.h"
+#include "../Utils/kernels.h"
+#include "../Utils/numa.h"
+#include "../Utils/options.h"
+#include "../Utils/scheduler.h"
+#include "../Utils/separable.h"
+#include "../Utils/stages.h"
+#include "../Utils/stream.h"
+#include "../Utils/temporal.h"
+#include "../Utils/trace.h"
 #include "../Utils/utils.h"
+#include "../Utils/weights.h"
 
 int n_threads = 4;
 int width;
 int height;
 int iterations;
-
-// Standardizes a batch 1 image into the range 0-255
-Channels **normalize_batch(Channels **img, int num_channels, int top)
+int channel_multiplier;
+Options opts;
+TileScheduler *sched;
+TemporalScratch **scratches;
+// Scratch of the whole run, carved out of one arena by new_workspace
+Arena *arena;
+// Image the split passes alternate with, bordered with a 0 pixel on each side
+Channels **spare;
+// Image temporal blocking alternates with, placed like the image, NULL has temporal_image make its own
+Channels **temporal_dst;
+// Halos of the bands of the fused pass, and a fused workspace and the lines of the pointwise stages per thread
+unsigned char *halos;
+FusedWorkspace **workspaces;
+StageLines **stage_lines;
+
+/* Allocates the scratch of every stage at once, the bands of the fused pass being taken out of
+at most 'rows' rows. The stages reuse it for all the iterations. */
+void new_workspace(int rows)
 {
-    float upscale_factor = 255.f / top;
-    int i, j, c;
+    TileShape bands = {opts.tile.rows, 0};
+    size_t halos_size = tile_count(0, rows, width, bands) * fused_halo_size(width, &opts.vertical);
+    size_t workspace_size = fused_workspace_size(width, &opts.vertical, &opts.horizontal);
+    size_t lines_size = stage_lines_size(width);
+
+    size_t size = arena_size(halos_size) + arena_size(n_threads * sizeof(FusedWorkspace *)) +
+                  n_threads * arena_size(workspace_size) + arena_size(n_threads * sizeof(StageLines *)) +
+                  n_threads * arena_size(lines_size);
+    if (!opts.fused)
+        size += channel_array_size(height, width, 1);
+    arena = new_arena(size);
+
+    halos = arena_alloc(arena, halos_size);
+    workspaces = arena_alloc(arena, n_threads * sizeof(FusedWorkspace *));
+    stage_lines = arena_alloc(arena, n_threads * sizeof(StageLines *));
+    for (int t = 0; t < n_threads; t++)
+    {
+        workspaces[t] = place_fused_workspace(arena_alloc(arena, workspace_size), width, &opts.vertical,
+                                              &opts.horizontal);
+        stage_lines[t] = place_stage_lines(arena_alloc(arena, lines_size), width);
+    }
+    if (!opts.fused)
+        spare = arena_channel_array(arena, height, width, 1);
+}
 
-#pragma omp parallel for private(i, j, c) collapse(3) shared(img)
-    for (i = 1; i < height; i++)
-        for (j = 1; j < width + 1; j++)
-            for (c = 0; c < num_channels; c++)
-                img[i][j].channel[c] = clamp_to_byte(upscale_factor * img[i][j].channel[c]);
+// Starts a scheduled phase over the tiles of the rows [first, last) for the calling thread of a parallel region
+void begin_tiles(int first, int last, TileShape shape)
+{
+    scheduler_begin(sched, omp_get_thread_num(), omp_get_num_threads(), first, last, width, shape);
+}
 
-    return img;
+int next_tile(Tile *tile)
+{
+    return scheduler_next(sched, omp_get_thread_num(), tile);
 }
 
-// Applies the vertical part of the spatial sepratable convolution
-void conv_vertical(Channels **img, int num_channels)
+// Applies the vertical part of the spatial sepratable convolution, reading 'img' and writing 'out'
+void conv_vertical(Channels **img, Channels **out, int num_channels)
 {
     int i, j, m, c, k;
     float K[channel_count] = {1.f / channel_count, 2.f / channel_count, 1.f / channel_count};
 
-    // The array is bordered with 0
-    Channels **bordered_img = new_channel_array(height + 1, width + 1);
-
-    for (i = 0; i < height; i++)
-        for (j = 0; j < width; j++)
-            bordered_img[i][j + 1] = img[i][j];
-
-#pragma omp parallel for private(i, j, m, c, k) collapse(2) shared(img, bordered_img)
-    for (i = 1; i < height; i++)
-        for (j = 1; j < width + 1; j++)
-        {
-            float *final_pixel = calloc(num_channels, sizeof(float));
-            for (m = -1, k = 0; m <= 1; m++, k++)
-                for (c = 0; c < num_channels; c++)
-                    final_pixel[c] += bordered_img[i + m][j].channel[c] * K[k];
-
-            for (c = 0; c < num_channels; c++)
-                img[i][j - 1].channel[c] = clamp_to_byte(final_pixel[c]);
-
-            free(final_pixel);
-        }
+#pragma omp parallel private(i, j, m, c, k) shared(img, out)
+    {
+        Tile tile;
+        TRACE_BEGIN("conv_vertical");
+        begin_tiles(1, height, opts.tile);
+        while (next_tile(&tile))
+            for (i = tile.row; i < tile.row + tile.rows; i++)
+                for (j = tile.col; j < tile.col + tile.cols; j++)
+                {
+                    float final_pixel[num_channels];
+                    for (c = 0; c < num_channels; c++)
+                        final_pixel[c] = 0;
+
+                    // The row below the image is read as 0
+                    for (m = -1, k = 0; m <= 1; m++, k++)
+                        if (i + m < height)
+                            for (c = 0; c < num_channels; c++)
+                                final_pixel[c] += img[i + m][j].channel[c] * K[k];
+
+                    for (c = 0; c < num_channels; c++)
+                        out[i][j].channel[c] = clamp_to_byte(final_pixel[c]);
+                }
+        TRACE_END();
+    }
 }
 
-// Applies the horizonal part of the spatial sepratable convolution
-int conv_horizontal(Channels **img, int num_channels)
+// Applies the horizonal part of the spatial sepratable convolution, reading the bordered 'img' and writing 'out'
+int conv_horizontal(Channels **img, Channels **out, int num_channels)
 {
     int i, j, n, c, k;
     int top = 0;
     float K[channel_count] = {-1.f / channel_count, 0 / channel_count, 1.f / channel_count};
 
-    Channels **bordered_img = new_channel_array(height + 1, width + 1);
+#pragma omp parallel private(i, j, n, c, k) reduction(max : top) shared(img, out)
+    {
+        Tile tile;
+        TRACE_BEGIN("conv_horizontal");
+        begin_tiles(1, height, opts.tile);
+        while (next_tile(&tile))
+            for (i = tile.row; i < tile.row + tile.rows; i++)
+                for (j = tile.col; j < tile.col + tile.cols; j++)
+                {
+                    float final_pixel[num_channels];
+                    for (c = 0; c < num_channels; c++)
+                        final_pixel[c] = 0;
+
+                    for (n = -1, k = 0; n <= 1; n++, k++)
+                        for (c = 0; c < num_channels; c++)
+                            final_pixel[c] += img[i][j + n].channel[c] * K[k];
+
+                    for (c = 0; c < num_channels; c++)
+                    {
+                        out[i][j].channel[c] = clamp_to_byte(final_pixel[c]);
+                        // Also keep in mind the top range of the distribution here to avoid another traversal
+                        top = fmax(top, out[i][j].channel[c]);
+                    }
+                }
+        TRACE_END();
+    }
+
+    return top;
+}
 
-    for (i = 0; i < height; i++)
-        for (j = 0; j < width; j++)
-            bordered_img[i][j + 1] = img[i][j];
+/* Applies both spatial kernels in a single sweep over the rows [start, end), the threads taking
+bands of them from the scheduler. The sweep works in place on whole rows, so its tiles always
+span the width. Rows outside [first, last) are read as 0. */
+int conv_spatial_fused(Channels **img, int first, int last, int start, int end)
+{
+    int top = 0;
+    TileShape shape = {opts.tile.rows, 0};
+    size_t halo_size = fused_halo_size(width, &opts.vertical);
 
-#pragma omp parallel for private(i, j, n, c, k) collapse(2) shared(img, bordered_img)
-    for (i = 1; i < height; i++)
-        for (j = 1; j < width + 1; j++)
+#pragma omp parallel reduction(max : top) shared(img, halos)
+    {
+        Tile tile;
+        FusedWorkspace *ws = workspaces[omp_get_thread_num()];
+        TRACE_BEGIN("conv_spatial_fused");
+
+        // The band borders have to be read before any of the threads overwrites them
+        begin_tiles(start, end, shape);
+        while (next_tile(&tile))
+            fused_store_halo(ws, img, first, last, tile.row, tile.row + tile.rows, halos + tile.index * halo_size);
+        TRACE_BEGIN("omp barrier");
+#pragma omp barrier
+        TRACE_END();
+
+        begin_tiles(start, end, shape);
+        while (next_tile(&tile))
         {
-            float *final_pixel = calloc(num_channels, sizeof(float));
-            for (n = -1, k = 0; n <= 1; n++, k++)
-                for (c = 0; c < num_channels; c++)
-                    final_pixel[c] += bordered_img[i][j + n].channel[c] * K[k];
-
-            for (c = 0; c < num_channels; c++)
-            {
-                img[i][j - 1].channel[c] = clamp_to_byte(final_pixel[c]);
-                // Also keep in mind the top range of the distribution here to avoid another traversal
-                top = fmax(top, img[i][j - 1].channel[c]);
-            }
-
-            free(final_pixel);
+            fused_load_halo(ws, halos + tile.index * halo_size);
+            top = fmax(top, conv_separable_fused(ws, img, first, last, tile.row, tile.row + tile.rows));
         }
+        TRACE_END();
+    }
 
     return top;
 }
 
 /* Applies a depthwise convolution with a random kernel, increasing the number of channels
-to the specified amount. Must be a multiple of the original arrays number of channels! */
-void conv_depthwise_encode(Channels **img, int num_channels)
+to the specified amount. Must be a multiple of the original arrays number of channels! Each
+tile is standardized into the range 0-255 with 'upscale_factor' first. */
+void conv_depthwise_encode(Channels **img, int num_channels, float upscale_factor)
 {
     // This kernel should be learned by our network, but here we will randomly generate it
     float *K = get_kernel(42);
-    int i, j, final_pixel, c;
 
     // Pools the channels with a stride of 'channel_count'
-#pragma omp parallel for private(i, j, final_pixel, c) collapse(3) shared(img)
-    for (int channel_id = channel_count; channel_id < num_channels; channel_id++)
+#pragma omp parallel shared(img)
     {
-        for (i = 1; i < height; i++)
-            for (j = 1; j < width + 1; j++)
-            {
-                final_pixel = 0;
-                for (c = 0; c < channel_count; c++)
-                    final_pixel += img[i][j].channel[channel_id % channel_count] * K[c];
-
-                img[i][j].channel[channel_id] = clamp_to_byte(final_pixel);
-            }
+        Tile tile;
+        Channels *view[opts.tile.rows];
+        StageLines *lines = stage_lines[omp_get_thread_num()];
+        TRACE_BEGIN("conv_depthwise_encode");
+        begin_tiles(1, height, opts.tile);
+        while (next_tile(&tile))
+        {
+            tile_view(img, &tile, view);
+            normalize_rows(lines, view, tile.cols, 0, tile.rows, upscale_factor);
+            depthwise_encode_rows(lines, view, tile.cols, 0, tile.rows, num_channels, K);
+        }
+        TRACE_END();
     }
     free(K);
 }
 
 /* Applies the depthwise convolution with a static kernel, transforming the array back
-into a 3-channel image. */
-void conv_depthwise_decode(Channels **img, int num_channels)
+into a 3-channel image. Returns the top of the rows it wrote. */
+int conv_depthwise_decode(Channels **img, int num_channels)
 {
-    int multiplier = num_channels / channel_count;
-    int i, j, red, green, blue, c;
+    int top = 0;
 
-#pragma omp parallel for private(i, j, c) collapse(2) shared(img)
-    for (i = 1; i < height; i++)
-        for (j = 1; j < width + 1; j++)
+    // This has the effect of averaging out all the dimensions into 3 colors
+    // An additional kernel could be used for more complex outputs
+#pragma omp parallel reduction(max : top) shared(img)
+    {
+        Tile tile;
+        Channels *view[opts.tile.rows];
+        StageLines *lines = stage_lines[omp_get_thread_num()];
+        TRACE_BEGIN("conv_depthwise_decode");
+        begin_tiles(1, height, opts.tile);
+        while (next_tile(&tile))
         {
-            red = 0;
-            green = 0;
-            blue = 0;
-
-            // This has the effect of averaging out all the dimensions into 3 colors
-            // An additional kernel could be used for more complex outputs
-            for (c = 0; c < num_channels; c += channel_count)
-            {
-                red += img[i][j].channel[c + 0];
-                green += img[i][j].channel[c + 1];
-                blue += img[i][j].channel[c + 2];
-            }
-            img[i][j].channel[0] = clamp_to_byte(red / multiplier);
-            img[i][j].channel[1] = clamp_to_byte(green / multiplier);
-            img[i][j].channel[2] = clamp_to_byte(blue / multiplier);
+            tile_view(img, &tile, view);
+            top = fmax(top, depthwise_decode_rows(lines, view, tile.cols, 0, tile.rows, num_channels));
         }
+        TRACE_END();
+    }
+
+    return top;
+}
+
+/* Normalizes each tile with 'upscale_factor' as it is loaded, then applies the depthwise encode
+and the decode in the same go, so the expanded channels never leave the line buffers. Returns
+the top of the rows it wrote. */
+int conv_depthwise(Channels **img, int num_channels, float upscale_factor)
+{
+    int top = 0;
+    float *K = get_kernel(42);
+
+#pragma omp parallel reduction(max : top) shared(img)
+    {
+        Tile tile;
+        Channels *view[opts.tile.rows];
+        StageLines *lines = stage_lines[omp_get_thread_num()];
+        TRACE_BEGIN("conv_depthwise");
+        begin_tiles(1, height, opts.tile);
+        while (next_tile(&tile))
+        {
+            tile_view(img, &tile, view);
+            top = fmax(top, pointwise_rows(lines, view, tile.cols, 0, tile.rows, upscale_factor, num_channels, K, 0));
+        }
+        TRACE_END();
+    }
+
+    free(K);
+    return top;
 }
 
 /* Applies the depthwise separable convolution to the given image.
     - channel_multiplier: Applies a polling step the the array, extending the number of channels
 by the given amount.
+Returns the top of the rows written by the last stage.
 */
-void conv_separable(Channels **img, int channel_multiplier)
+int conv_separable(Channels **img, int channel_multiplier)
 {
     omp_set_num_threads(n_threads);
 
-    // First we apply the vertical kernel
-    conv_vertical(img, channel_count);
+    int top;
+    if (opts.fused)
+        top = conv_spatial_fused(img, 0, height, 1, height);
+    else
+    {
+        // First we apply the vertical kernel
+        conv_vertical(img, spare, channel_count);
 
-    // The applying the horizonal part of the decomposed kernel
-    int top = conv_horizontal(img, channel_count);
+        // The applying the horizonal part of the decomposed kernel, which lands back in the image
+        top = conv_horizontal(spare, img, channel_count);
+    }
+
+    // The batch is normalized using the widest range, as the next stage loads it
+    float upscale_factor = 255.f / top;
 
-    // Normalizing the batch using the widest range
-    normalize_batch(img, channel_count, top);
+    if (opts.expanded)
+    {
+        // Applying deptwise encoding to the image, incresing the number of channels by 'channel_multiplier'
+        conv_depthwise_encode(img, channel_count * channel_multiplier, upscale_factor);
+        // Compressing the array back into a 3-channel image
+        return conv_depthwise_decode(img, channel_count * channel_multiplier);
+    }
 
-    // Applying deptwise encoding to the image, incresing the number of channels by 'channel_multiplier'
-    conv_depthwise_encode(img, channel_count * channel_multiplier);
-    // Compressing the array back into a 3-channel image
-    conv_depthwise_decode(img, channel_count * channel_multiplier);
+    // Encoding and compressing back into a 3-channel image without writing the expanded channels
+    return conv_depthwise(img, channel_count * channel_multiplier, upscale_factor);
+}
+
+// Passes every tile of a block of iterations through all of its stages, each thread in its own scratch rows
+void temporal_block(TemporalBlock *block, int *tops)
+{
+    int n = block->depth + 1;
+
+#pragma omp parallel reduction(max : tops[:n])
+    {
+        Tile tile;
+        TemporalScratch *scratch = scratches[omp_get_thread_num()];
+        TRACE_BEGIN("temporal_tile");
+        begin_tiles(block->first, block->height, (TileShape){opts.tile.rows, 0});
+        while (next_tile(&tile))
+            temporal_tile(block, scratch, tile.row, tile.row + tile.rows, tops);
+        TRACE_END();
+    }
+}
+
+/* Applies all the iterations with temporal blocking, the threads taking tiles of whole rows
+through up to 'opts.temporal' iterations while they stay in cache. The result replaces *img.
+Returns the top of the last decode. */
+int conv_temporal(Channels ***img)
+{
+    omp_set_num_threads(n_threads);
+
+    float *K = get_kernel(42);
+    TemporalBlock block = {*img, temporal_dst, width, height, 1, &opts.vertical, &opts.horizontal,
+                           channel_count * channel_multiplier, K, opts.expanded};
+
+    scratches = malloc(n_threads * sizeof(TemporalScratch *));
+    for (int t = 0; t < n_threads; t++)
+        scratches[t] = new_temporal_scratch(width, opts.tile.rows, opts.temporal, &opts.vertical, &opts.horizontal);
+
+    int top = temporal_image(&block, iterations, opts.temporal, temporal_block);
+    *img = block.src;
+    temporal_dst = block.dst;
+
+    for (int t = 0; t < n_threads; t++)
+        free_temporal_scratch(scratches[t]);
+    free(scratches);
+    free(K);
+
+    return top;
+}
+
+// Spatial pass of a streamed strip, the workspace is made for the strips by the first one
+int stream_spatial(Channels **rows, int strip_first, int first, int last, int start, int end)
+{
+    if (!arena)
+        new_workspace(opts.stream_rows);
+
+    // Like in memory, row 0 of the image is read but never updated
+    return conv_spatial_fused(rows, first, last, fmax(start, 1 - strip_first), end);
+}
+
+/* Normalize, encode and decode of one iteration over the rows [start, end) of a streamed strip.
+Row 0 of the image is left as it is and only adds its range to the top, like in memory. */
+int stream_pointwise(Channels **rows, int strip_first, int start, int end, float upscale_factor, int iteration)
+{
+    int top = 0;
+    float *K = get_kernel(42);
+
+    if (strip_first + start <= 0 && strip_first + end > 0)
+        top = get_range(rows - strip_first, width, 1);
+    start = fmax(start, 1 - strip_first);
+
+#pragma omp parallel reduction(max : top) shared(rows)
+    {
+        Tile tile;
+        Channels *view[opts.tile.rows];
+        StageLines *lines = stage_lines[omp_get_thread_num()];
+        TRACE_BEGIN("stream_pointwise");
+        begin_tiles(start, end, opts.tile);
+        while (next_tile(&tile))
+        {
+            tile_view(rows, &tile, view);
+            top = fmax(top, pointwise_rows(lines, view, tile.cols, 0, tile.rows, upscale_factor,
+                                           channel_count * channel_multiplier, K, opts.expanded));
+        }
+        TRACE_END();
+    }
+
+    free(K);
+    return top;
+}
+
+/* Runs all the iterations over *img, which temporal blocking may replace. Returns the range
+for the writer. */
+int run_iterations(Channels ***img)
+{
+    // The writer takes the range from the last stage, without iterations it has to scan the image
+    int top = -1;
+    if (opts.temporal && iterations > 0)
+        top = conv_temporal(img);
+    else
+        for (int i = 0; i < iterations; i++)
+            top = conv_separable(*img, channel_multiplier);
+
+    // Row 0 is never processed, so it is the only one the stages did not see
+    if (top >= 0)
+        top = fmax(top, get_range(*img, width, 1));
+
+    return top;
+}
+
+// Compute stage of the batch mode, the workspace is only made again for an image it doesn't fit
+void process_image(BatchImage *image)
+{
+    if (arena && (image->width != width || image->height > height))
+    {
+        free_arena(arena);
+        arena = NULL;
+    }
+    width = image->width;
+    height = image->height;
+    if (!arena)
+        new_workspace(height);
+
+    image->top = run_iterations(&image->img);
+}
+
+/* Reads the image into pages backed as --pages asks, each band of them first written by the
+thread that is going to work on it. */
+Channels **read_placed_image(char *in_name)
+{
+    Channels **img = new_placed_channel_array(height, width, opts.pages);
+    if (opts.temporal && iterations > 0)
+        temporal_dst = new_placed_channel_array(height, width, opts.pages);
+
+    omp_set_num_threads(n_threads);
+#pragma omp parallel shared(img)
+    {
+        int start, end;
+        scheduler_band(omp_get_thread_num(), omp_get_num_threads(), 0, height, width, opts.tile, &start, &end);
+        touch_rows(img, width, start, end);
+        if (temporal_dst)
+            touch_rows(temporal_dst, width, start, end);
+    }
+    read_image_pnm_into(in_name, img);
+
+    return img;
 }
 
 int main(int argc, char *argv[])
@@ -174,14 +446,61 @@ int main(int argc, char *argv[])
     char *in_name = argv[2];
     char *out_name = argv[3];
     iterations = atoi(argv[4]);
-    int channel_multiplier = atoi(argv[5]);
+    channel_multiplier = atoi(argv[5]);
+    opts = parse_options(argc, argv, 6);
+    select_kernels(opts.isa, opts.fixed_point);
+    load_weights(opts.weights);
+    sched = new_tile_scheduler(n_threads);
+
+    // Every parallel region runs on the same team of threads, so they are pinned once for the run
+    if (opts.affinity != AFFINITY_NONE)
+    {
+        omp_set_num_threads(n_threads);
+#pragma omp parallel
+        pin_thread(omp_get_thread_num(), opts.affinity);
+    }
 
-    Channels **img = read_image_pnm(in_name, &width, &height);
+    if (opts.stream_rows)
+    {
+        // Out-of-core, only a strip of the image is ever in memory
+        omp_set_num_threads(n_threads);
+        StreamStages stages = {stream_spatial, stream_pointwise, NULL, NULL};
+        stream_image(in_name, out_name, iterations, opts.vertical.taps / 2, opts.stream_rows, 0, 1, &width, &height,
+                     &stages);
+        if (opts.stats)
+            print_scheduler_stats(sched);
+        free_tile_scheduler(sched);
+        if (arena)
+            free_arena(arena);
+        free_weights();
+        TRACE_DUMP();
+        return 0;
+    }
 
-    for (int i = 0; i < iterations; i++)
-        conv_separable(img, channel_multiplier);
+    if (opts.batch)
+        // 'in_name' lists the images and 'out_name' is the directory they are written to
+        run_batch(in_name, out_name, opts.queue_depth, opts.io_threads, process_image);
+    else
+    {
+        PnmHeader header = read_pnm_header(in_name);
+        width = header.width;
+        height = header.height;
+        Channels **img = read_placed_image(in_name);
+        new_workspace(height);
+        write_image_pnm(img, out_name, width, height, run_iterations(&img));
+        if (opts.stats)
+            print_band_nodes(img, width, height, n_threads, opts.tile);
+        free_placed_channel_array(img, height, width, opts.pages);
+        if (temporal_dst)
+            free_placed_channel_array(temporal_dst, height, width, opts.pages);
+    }
 
-    write_image_pnm(img, out_name, width, height);
+    if (opts.stats)
+        print_scheduler_stats(sched);
+    free_tile_scheduler(sched);
+    free_arena(arena);
+    free_weights();
+    TRACE_DUMP();
 
     return 0;
 }
@@ -5,223 +5,656 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include "../Utils/arena.h"
+#include "../Utils/batch.h"
+#include "../Utils/image.h"
+#include "../Utils/kernels.h"
+#include "../Utils/numa.h"
+#include "../Utils/options.h"
+#include "../Utils/pool.h"
+#include "../Utils/scheduler.h"
+#include "../Utils/separable.h"
+#include "../Utils/stages.h"
+#include "../Utils/stream.h"
+#include "../Utils/temporal.h"
+#include "../Utils/trace.h"
 #include "../Utils/utils.h"
+#include "../Utils/weights.h"
+#include "../Utils/wisdom.h"
+
+// Iterations every candidate of --tune is timed over at most, and how many times
+#define TUNE_ITERATIONS 4
+#define TUNE_REPEATS 3
 
 int n_threads = 4;
 int width;
 int height;
-int global_top;
+int iterations;
 int channel_multiplier;
 Channels **img;
-pthread_mutex_t mutex_top;
-
-// Standardizes a batch 1 image into the range 0-255
-void *normalize_batch(void *var)
+// The image with --layout=planar, which then takes the place of 'img'
+Image *planes;
+ThreadPool *pool;
+TileScheduler *sched;
+TemporalScratch **scratches;
+Options opts;
+// Scratch of the whole run, carved out of one arena by new_workspace
+Arena *arena;
+// Image the split passes alternate with, bordered with a 0 pixel on each side
+Channels **spare;
+// Image temporal blocking alternates with, placed like the image, NULL has temporal_image make its own
+Channels **temporal_dst;
+// Halos of the bands of the fused pass, and a fused workspace and the lines of the pointwise stages per thread
+unsigned char *halos;
+FusedWorkspace **workspaces;
+StageLines **stage_lines;
+// Configuration of the wisdom file, which the options point into
+Wisdom wisdom;
+
+/* Allocates the scratch of every stage at once, the bands of the fused pass being taken out of
+at most 'rows' rows. The stages reuse it for all the iterations. */
+void new_workspace(int rows)
 {
-    float upscale_factor = 255.f / global_top;
-    int i, j, c;
-
-    int thread_id = *(int *)var;
-    unsigned long start, end;
-    start = thread_id * ceil((double)height / n_threads);
-    end = fmin(height, (thread_id + 1) * ceil((double)height / n_threads));
-
-    for (i = start; i < end; i++)
-        for (j = 1; j < width + 1; j++)
-            for (c = 0; c < channel_count; c++)
-                img[i][j].channel[c] = clamp_to_byte(upscale_factor * img[i][j].channel[c]);
+    TileShape bands = {opts.tile.rows, 0};
+    size_t halos_size = tile_count(0, rows, width, bands) * fused_halo_size(width, &opts.vertical);
+    size_t workspace_size = fused_workspace_size(width, &opts.vertical, &opts.horizontal);
+    size_t lines_size = stage_lines_size(width);
+
+    size_t size = arena_size(halos_size) + arena_size(n_threads * sizeof(FusedWorkspace *)) +
+                  n_threads * arena_size(workspace_size) + arena_size(n_threads * sizeof(StageLines *)) +
+                  n_threads * arena_size(lines_size);
+    if (!opts.fused)
+        size += channel_array_size(height, width, 1);
+    arena = new_arena(size);
+
+    halos = arena_alloc(arena, halos_size);
+    workspaces = arena_alloc(arena, n_threads * sizeof(FusedWorkspace *));
+    stage_lines = arena_alloc(arena, n_threads * sizeof(StageLines *));
+    for (int t = 0; t < n_threads; t++)
+    {
+        workspaces[t] = place_fused_workspace(arena_alloc(arena, workspace_size), width, &opts.vertical,
+                                              &opts.horizontal);
+        stage_lines[t] = place_stage_lines(arena_alloc(arena, lines_size), width);
+    }
+    if (!opts.fused)
+        spare = arena_channel_array(arena, height, width, 1);
 }
 
-// Applies the vertical part of the spatial sepratable convolution
-void *conv_vertical(void *var)
+// Standardizes a batch 1 tile into the range 0-255
+void normalize_batch(StageLines *lines, Channels **tile, int cols, int rows, float upscale_factor)
 {
-    int thread_id = *(int *)var;
-    unsigned long start, end;
-    start = thread_id * ceil((double)height / n_threads);
-    end = fmin(height, (thread_id + 1) * ceil((double)height / n_threads));
+    normalize_rows(lines, tile, cols, 0, rows, upscale_factor);
+}
 
+// Applies the vertical part of the spatial sepratable convolution, reading 'img' and writing 'out'
+void conv_vertical(Channels **img, Channels **out, int thread_id)
+{
     int i, j, m, c, k;
+    Tile tile;
     float K[channel_count] = {1.f / channel_count, 2.f / channel_count, 1.f / channel_count};
 
-    // The array is bordered with 0
-    Channels **bordered_img = new_channel_array(height + 2, width + 2);
+    TRACE_BEGIN("conv_vertical");
+    scheduler_begin(sched, thread_id, n_threads, 0, height, width, opts.tile);
+    while (scheduler_next(sched, thread_id, &tile))
+        for (i = tile.row; i < tile.row + tile.rows; i++)
+            for (j = tile.col; j < tile.col + tile.cols; j++)
+            {
+                float final_pixel[channel_count] = {0};
 
-    for (i = fmax(0, (int)start - 2); i < fmin(height, (int)end + 2); i++)
-        for (j = 0; j < width; j++)
-            bordered_img[i][j + 1] = img[i][j];
+                // The rows above and below the image are read as 0
+                for (m = -1, k = 0; m <= 1; m++, k++)
+                    if (i + m >= 0 && i + m < height)
+                        for (c = 0; c < channel_count; c++)
+                            final_pixel[c] += img[i + m][j].channel[c] * K[k];
 
-    for (i = start; i <= end; i++)
-        for (j = 1; j < width + 1; j++)
-        {
-            if (i == height)
-                continue;
-            float *final_pixel = calloc(channel_count, sizeof(float));
-            for (m = -1, k = 0; m <= 1; m++, k++)
                 for (c = 0; c < channel_count; c++)
-                    final_pixel[c] += bordered_img[i + 1 + m][j].channel[c] * K[k];
-
-            for (c = 0; c < channel_count; c++)
-                img[i][j - 1].channel[c] = clamp_to_byte(final_pixel[c]);
-
-            free(final_pixel);
-        }
+                    out[i][j].channel[c] = clamp_to_byte(final_pixel[c]);
+            }
+    TRACE_END();
 }
 
-// Applies the horizonal part of the spatial sepratable convolution
-void *conv_horizontal(void *var)
+// Applies the horizonal part of the spatial sepratable convolution, reading the bordered 'img' and writing 'out'
+int conv_horizontal(Channels **img, Channels **out, int thread_id)
 {
-    int thread_id = *(int *)var;
-    unsigned long start, end;
-    start = thread_id * ceil((double)height / n_threads);
-    end = fmin(height, (thread_id + 1) * ceil((double)height / n_threads));
-
     int i, j, n, c, k;
     int top = 0;
+    Tile tile;
     float K[channel_count] = {-1.f / channel_count, 0 / channel_count, 1.f / channel_count};
 
-    Channels **bordered_img = new_channel_array(height + 2, width + 2);
-
-    for (i = 0; i < height; i++)
-        for (j = 0; j < width; j++)
-            bordered_img[i][j + 1] = img[i][j];
+    TRACE_BEGIN("conv_horizontal");
+    scheduler_begin(sched, thread_id, n_threads, 0, height, width, opts.tile);
+    while (scheduler_next(sched, thread_id, &tile))
+        for (i = tile.row; i < tile.row + tile.rows; i++)
+            for (j = tile.col; j < tile.col + tile.cols; j++)
+            {
+                float final_pixel[channel_count] = {0};
+                for (n = -1, k = 0; n <= 1; n++, k++)
+                    for (c = 0; c < channel_count; c++)
+                        final_pixel[c] += img[i][j + n].channel[c] * K[k];
 
-    for (i = start; i <= end; i++)
-        for (j = 1; j < width + 1; j++)
-        {
-            if (i == height)
-                continue;
-            float *final_pixel = calloc(channel_count, sizeof(float));
-            for (n = -1, k = 0; n <= 1; n++, k++)
                 for (c = 0; c < channel_count; c++)
-                    final_pixel[c] += bordered_img[i + 1][j + n].channel[c] * K[k];
-
-            for (c = 0; c < channel_count; c++)
-            {
-                img[i][j - 1].channel[c] = clamp_to_byte(final_pixel[c]);
-                // Also keep in mind the top range of the distribution here to avoid another traversal
-                top = fmax(top, img[i][j - 1].channel[c]);
+                {
+                    out[i][j].channel[c] = clamp_to_byte(final_pixel[c]);
+                    // Also keep in mind the top range of the distribution here to avoid another traversal
+                    top = fmax(top, out[i][j].channel[c]);
+                }
             }
+    TRACE_END();
 
-            free(final_pixel);
-        }
+    return top;
+}
 
-    pthread_mutex_lock(&mutex_top);
-    if (top > global_top)
-        global_top = top;
-    pthread_mutex_unlock(&mutex_top);
+/* Applies both spatial kernels in a single sweep over the rows [start, end), the threads taking
+bands of them from the scheduler. The sweep works in place on whole rows, so its tiles always
+span the width. The borders of every band are kept in 'halos', which the threads share.
+Rows outside [first, last) of the image are read as 0. */
+int conv_spatial_fused(Channels **img, int first, int last, int start, int end, int thread_id)
+{
+    int top = 0;
+    Tile tile;
+    TileShape shape = {opts.tile.rows, 0};
+    size_t halo_size = fused_halo_size(width, &opts.vertical);
+    FusedWorkspace *ws = workspaces[thread_id];
+
+    TRACE_BEGIN("conv_spatial_fused");
+    // The band borders have to be read before any of the threads overwrites them
+    scheduler_begin(sched, thread_id, n_threads, start, end, width, shape);
+    while (scheduler_next(sched, thread_id, &tile))
+        fused_store_halo(ws, img, first, last, tile.row, tile.row + tile.rows, halos + tile.index * halo_size);
+    pool_barrier(pool);
+
+    scheduler_begin(sched, thread_id, n_threads, start, end, width, shape);
+    while (scheduler_next(sched, thread_id, &tile))
+    {
+        fused_load_halo(ws, halos + tile.index * halo_size);
+        top = fmax(top, conv_separable_fused(ws, img, first, last, tile.row, tile.row + tile.rows));
+    }
+    TRACE_END();
+
+    return top;
 }
 
 /* Applies a depthwise convolution with a random kernel, increasing the number of channels
 to the specified amount. Must be a multiple of the original arrays number of channels! */
-void *conv_depthwise_encode(void *var)
+void conv_depthwise_encode(StageLines *lines, Channels **tile, int cols, int rows, float *K)
 {
-    // This kernel should be learned by our network, but here we will randomly generate it
-    float *K = get_kernel(42);
-    int i, j, final_pixel, c;
+    // Pools the channels with a stride of 'channel_count'
+    depthwise_encode_rows(lines, tile, cols, 0, rows, channel_count * channel_multiplier, K);
+}
 
-    int thread_id = *(int *)var;
-    unsigned long start, end;
-    start = thread_id * ceil((double)height / n_threads);
-    end = fmin(height, (thread_id + 1) * ceil((double)height / n_threads));
+/* Applies the depthwise convolution with a static kernel, transforming the array back
+into a 3-channel image. Returns the top of the rows it wrote. */
+int conv_depthwise_decode(StageLines *lines, Channels **tile, int cols, int rows)
+{
+    // This has the effect of averaging out all the dimensions into 3 colors
+    // An additional kernel could be used for more complex outputs
+    return depthwise_decode_rows(lines, tile, cols, 0, rows, channel_count * channel_multiplier);
+}
 
-    // Pools the channels with a stride of 'channel_count'
-    for (int channel_id = channel_count; channel_id < channel_count * channel_multiplier; channel_id++)
-    {
-        for (i = start; i < end; i++)
-            for (j = 1; j < width + 1; j++)
-            {
-                final_pixel = 0;
-                for (c = 0; c < channel_count; c++)
-                    final_pixel += img[i][j].channel[channel_id % channel_count] * K[c];
+/* Normalizes, encodes and decodes the rows [start, end) a tile at a time. These stages only
+read the pixel they write, so a tile goes through all of them while it is still in cache and
+the threads never wait for each other in between. Returns the top of the tiles of this thread. */
+int conv_pointwise(Channels **img, int start, int end, float upscale_factor, float *K, int thread_id)
+{
+    int top = 0;
+    Tile tile;
+    Channels *view[opts.tile.rows];
+    StageLines *lines = stage_lines[thread_id];
 
-                img[i][j].channel[channel_id] = clamp_to_byte(final_pixel);
-            }
+    TRACE_BEGIN("conv_pointwise");
+    scheduler_begin(sched, thread_id, n_threads, start, end, width, opts.tile);
+    while (scheduler_next(sched, thread_id, &tile))
+    {
+        tile_view(img, &tile, view);
+        if (opts.expanded)
+        {
+            normalize_batch(lines, view, tile.cols, tile.rows, upscale_factor);
+            conv_depthwise_encode(lines, view, tile.cols, tile.rows, K);
+            top = fmax(top, conv_depthwise_decode(lines, view, tile.cols, tile.rows));
+        }
+        else
+            // All at once, the lines are normalized as they are loaded and the expanded channels never leave them
+            top = fmax(top, pointwise_rows(lines, view, tile.cols, 0, tile.rows, upscale_factor,
+                                           channel_count * channel_multiplier, K, 0));
     }
-    free(K);
+    TRACE_END();
+
+    return top;
 }
 
-/* Applies the depthwise convolution with a static kernel, transforming the array back
-into a 3-channel image. */
-void *conv_depthwise_decode(void *var)
+/* conv_spatial_fused over the planes of the whole image. The sweep reads 3 bytes a pixel instead
+of the 32 of a Channels pixel, and writes its rows in place. */
+int conv_spatial_planar(int thread_id)
 {
-    int i, j, red, green, blue, c;
+    int top = 0;
+    Tile tile;
+    TileShape shape = {opts.tile.rows, 0};
+    size_t halo_size = fused_halo_size(width, &opts.vertical);
+    FusedWorkspace *ws = workspaces[thread_id];
+
+    TRACE_BEGIN("conv_spatial_planar");
+    scheduler_begin(sched, thread_id, n_threads, 0, height, width, shape);
+    while (scheduler_next(sched, thread_id, &tile))
+        fused_store_halo_planar(ws, planes, tile.row, tile.row + tile.rows, halos + tile.index * halo_size);
+    pool_barrier(pool);
+
+    scheduler_begin(sched, thread_id, n_threads, 0, height, width, shape);
+    while (scheduler_next(sched, thread_id, &tile))
+    {
+        fused_load_halo(ws, halos + tile.index * halo_size);
+        top = fmax(top, conv_separable_planar(ws, planes, tile.row, tile.row + tile.rows));
+    }
+    TRACE_END();
 
-    int thread_id = *(int *)var;
-    unsigned long start, end;
-    start = thread_id * ceil((double)height / n_threads);
-    end = fmin(height, (thread_id + 1) * ceil((double)height / n_threads));
+    return top;
+}
 
-    for (i = 1; i < height; i++)
-        for (j = 1; j < width + 1; j++)
-        {
-            red = 0;
-            green = 0;
-            blue = 0;
+// conv_pointwise over the tiles of the planes, returns the top of the tiles of this thread
+int conv_pointwise_planar(float upscale_factor, float *K, int thread_id)
+{
+    int top = 0;
+    Tile tile;
 
-            // This has the effect of averaging out all the dimensions into 3 colors
-            // An additional kernel could be used for more complex outputs
-            for (c = 0; c < channel_count * channel_multiplier; c += channel_count)
-            {
-                red += img[i][j].channel[c + 0];
-                green += img[i][j].channel[c + 1];
-                blue += img[i][j].channel[c + 2];
-            }
-            img[i][j].channel[0] = clamp_to_byte(red / channel_multiplier);
-            img[i][j].channel[1] = clamp_to_byte(green / channel_multiplier);
-            img[i][j].channel[2] = clamp_to_byte(blue / channel_multiplier);
-        }
+    TRACE_BEGIN("conv_pointwise_planar");
+    scheduler_begin(sched, thread_id, n_threads, 0, height, width, opts.tile);
+    while (scheduler_next(sched, thread_id, &tile))
+        top = fmax(top, pointwise_planes(stage_lines[thread_id], planes, tile.col, tile.cols, tile.row,
+                                         tile.row + tile.rows, upscale_factor, channel_count * channel_multiplier, K));
+    TRACE_END();
+
+    return top;
 }
 
-/* Applies the depthwise separable convolution to the given image.
+typedef struct
+{
+    int iterations;
+    // The depthwise kernel, get_kernel reseeds rand so it is generated before the threads start
+    float *K;
+    // Top of the rows written by the last decode, which is the range of the output image
+    int top;
+} SeparableJob;
+
+/* Applies the depthwise separable convolution to the given image, on every thread of the pool.
+The threads take tiles of each phase from the scheduler, stealing from each other when they run
+out. The pointwise stages are one phase, so the top reductions, which every thread has to reach
+before a new phase begins, are the only barriers between iterations.
     - channel_multiplier: Applies a polling step the the array, extending the number of channels
 by the given amount.
 */
-void conv_separable(int iterations)
+void conv_separable(void *var, int thread_id)
+{
+    SeparableJob *job = var;
+
+    for (int j = 0; j < job->iterations; j++)
+    {
+        int top;
+        if (opts.planar)
+            top = conv_spatial_planar(thread_id);
+        else if (opts.fused)
+            // Both spatial kernels in one sweep
+            top = conv_spatial_fused(img, 0, height, 0, height, thread_id);
+        else
+        {
+            // First we apply the vertical kernel
+            conv_vertical(img, spare, thread_id);
+            pool_barrier(pool);
+
+            // The applying the horizonal part of the decomposed kernel, which lands back in the image
+            top = conv_horizontal(spare, img, thread_id);
+        }
+
+        // Normalizing the batch using the widest range of all the tiles, then applying deptwise
+        // encoding to the image, incresing the number of channels by 'channel_multiplier', and
+        // compressing the array back into a 3-channel image
+        top = pool_reduce_max(pool, thread_id, top);
+        if (opts.planar)
+            top = conv_pointwise_planar(255.f / top, job->K, thread_id);
+        else
+            top = conv_pointwise(img, 0, height, 255.f / top, job->K, thread_id);
+
+        // The reduction also keeps the next spatial pass from reading rows that are still being decoded
+        top = pool_reduce_max(pool, thread_id, top);
+        if (thread_id == 0)
+            job->top = top;
+    }
+}
+
+typedef struct
 {
-    int i;
-    pthread_mutex_init(&mutex_top, NULL);
-    pthread_t tid[n_threads];
-    int thread_id[n_threads];
-    for (i = 0; i < n_threads; i++)
-        thread_id[i] = i;
+    TemporalBlock *block;
+    int *tops;
+} TemporalJob;
 
-    for (int j = 0; j < iterations; j++)
+// Passes every tile of a block of iterations through all of its stages, each thread in its own scratch rows
+void temporal_job(void *var, int thread_id)
+{
+    TemporalJob *job = var;
+    TemporalBlock *block = job->block;
+    int tops[TEMPORAL_MAX_DEPTH + 1] = {0};
+    Tile tile;
+
+    TRACE_BEGIN("temporal_tile");
+    scheduler_begin(sched, thread_id, n_threads, 0, height, width, (TileShape){opts.tile.rows, 0});
+    while (scheduler_next(sched, thread_id, &tile))
+        temporal_tile(block, scratches[thread_id], tile.row, tile.row + tile.rows, tops);
+    TRACE_END();
+
+    for (int k = 0; k <= block->depth; k++)
     {
-        // First we apply the vertical kernel
-        for (i = 0; i < n_threads; i++)
-            pthread_create(&(tid[i]), NULL, conv_vertical, &(thread_id[i]));
+        int top = pool_reduce_max(pool, thread_id, tops[k]);
+        if (thread_id == 0)
+            job->tops[k] = top;
+    }
+}
 
-        for (i = 0; i < n_threads; i++)
-            pthread_join(tid[i], NULL);
+void temporal_block(TemporalBlock *block, int *tops)
+{
+    TemporalJob job = {block, tops};
+    pool_run(pool, temporal_job, &job);
+}
 
-        // The applying the horizonal part of the decomposed kernel
-        for (i = 0; i < n_threads; i++)
-            pthread_create(&(tid[i]), NULL, conv_horizontal, &(thread_id[i]));
+/* Applies all the iterations with temporal blocking, the threads taking tiles of whole rows
+through up to 'opts.temporal' iterations while they stay in cache. The result replaces the
+image. Returns the top of the last decode. */
+int conv_temporal(int iterations, float *K)
+{
+    TemporalBlock block = {img, temporal_dst, width, height, 0, &opts.vertical, &opts.horizontal,
+                           channel_count * channel_multiplier, K, opts.expanded};
 
-        for (i = 0; i < n_threads; i++)
-            pthread_join(tid[i], NULL);
+    scratches = malloc(n_threads * sizeof(TemporalScratch *));
+    for (int t = 0; t < n_threads; t++)
+        scratches[t] = new_temporal_scratch(width, opts.tile.rows, opts.temporal, &opts.vertical, &opts.horizontal);
 
-        // Normalizing the batch using the widest range
-        for (i = 0; i < n_threads; i++)
-            pthread_create(&(tid[i]), NULL, normalize_batch, &(thread_id[i]));
+    int top = temporal_image(&block, iterations, opts.temporal, temporal_block);
+    img = block.src;
+    temporal_dst = block.dst;
 
-        for (i = 0; i < n_threads; i++)
-            pthread_join(tid[i], NULL);
+    for (int t = 0; t < n_threads; t++)
+        free_temporal_scratch(scratches[t]);
+    free(scratches);
 
-        // Applying deptwise encoding to the image, incresing the number of channels by 'channel_multiplier'
-        for (i = 0; i < n_threads; i++)
-            pthread_create(&(tid[i]), NULL, conv_depthwise_encode, &(thread_id[i]));
+    return top;
+}
 
-        for (i = 0; i < n_threads; i++)
-            pthread_join(tid[i], NULL);
+// A strip of the streaming mode, split between the threads of the pool
+typedef struct
+{
+    Channels **rows;
+    int first;
+    int last;
+    int start;
+    int end;
+    float upscale_factor;
+    float *K;
+    int top;
+} StripJob;
+
+void stream_spatial_job(void *var, int thread_id)
+{
+    StripJob *job = var;
 
-        // Compressing the array back into a 3-channel image
-        for (i = 0; i < n_threads; i++)
-            pthread_create(&(tid[i]), NULL, conv_depthwise_decode, &(thread_id[i]));
+    int top = conv_spatial_fused(job->rows, job->first, job->last, job->start, job->end, thread_id);
+    top = pool_reduce_max(pool, thread_id, top);
+    if (thread_id == 0)
+        job->top = top;
+}
+
+void stream_pointwise_job(void *var, int thread_id)
+{
+    StripJob *job = var;
+
+    int top = conv_pointwise(job->rows, job->start, job->end, job->upscale_factor, job->K, thread_id);
+    top = pool_reduce_max(pool, thread_id, top);
+    if (thread_id == 0)
+        job->top = top;
+}
+
+int stream_spatial(Channels **rows, int strip_first, int first, int last, int start, int end)
+{
+    // The workspace is made for the strips by the first one
+    if (!arena)
+        new_workspace(opts.stream_rows);
+
+    StripJob job = {rows, first, last, start, end};
+    pool_run(pool, stream_spatial_job, &job);
+
+    return job.top;
+}
 
-        for (i = 0; i < n_threads; i++)
-            pthread_join(tid[i], NULL);
+int stream_pointwise(Channels **rows, int strip_first, int start, int end, float upscale_factor, int iteration)
+{
+    StripJob job = {rows, start, end, start, end, upscale_factor, get_kernel(42)};
+    pool_run(pool, stream_pointwise_job, &job);
+    free(job.K);
+
+    return job.top;
+}
+
+/* Runs all the iterations over the image, which temporal blocking may replace. Returns the
+range for the writer. */
+int run_iterations(void)
+{
+    // The writer takes the range from the last stage, without iterations it has to scan the image
+    SeparableJob job = {iterations, get_kernel(42), -1};
+    if (opts.temporal && iterations > 0)
+        job.top = conv_temporal(iterations, job.K);
+    else
+        pool_run(pool, conv_separable, &job);
+    free(job.K);
+
+    return job.top;
+}
+
+void pin_job(void *var, int thread_id)
+{
+    pin_thread(thread_id, opts.affinity);
+}
+
+// Starts the pool and the scheduler of 'n_threads' threads, pinned as --affinity asks
+void start_workers(void)
+{
+    pool = new_thread_pool(n_threads);
+    sched = new_tile_scheduler(n_threads);
+    if (opts.affinity != AFFINITY_NONE)
+        pool_run(pool, pin_job, NULL);
+}
+
+// Zeroes the band of the images every thread starts its phases with, so that its pages are on its node
+void place_job(void *var, int thread_id)
+{
+    int start, end;
+    scheduler_band(thread_id, n_threads, 0, height, width, opts.tile, &start, &end);
+    touch_rows(img, width, start, end);
+    if (temporal_dst)
+        touch_rows(temporal_dst, width, start, end);
+}
+
+/* Reads the image into pages backed as --pages asks, each band of them first written by the
+thread that is going to work on it. */
+void read_placed_image(char *in_name)
+{
+    img = new_placed_channel_array(height, width, opts.pages);
+    if (opts.temporal && iterations > 0)
+        temporal_dst = new_placed_channel_array(height, width, opts.pages);
+    pool_run(pool, place_job, NULL);
+    read_image_pnm_into(in_name, img);
+}
+
+void stop_workers(void)
+{
+    free_tile_scheduler(sched);
+    free_thread_pool(pool);
+}
+
+// Problem of the image in memory, as the wisdom file knows it
+WisdomKey wisdom_key(void)
+{
+    return (WisdomKey){"pthreads", width, height, weights ? weights->multiplier : channel_multiplier,
+                       opts.vertical.taps, opts.horizontal.taps, opts.fixed_point, weights != NULL, opts.fused};
+}
+
+/* Median wall time of TUNE_REPEATS runs of 'trial_iterations' iterations over copies of
+'source' with the current configuration, everything it needs being made for it alone. */
+double time_candidate(Channels **source, int trial_iterations)
+{
+    double samples[TUNE_REPEATS];
+    int run_iterations_saved = iterations;
+
+    select_kernels(opts.isa, opts.fixed_point);
+    start_workers();
+    new_workspace(height);
+    iterations = trial_iterations;
+    for (int r = 0; r < TUNE_REPEATS; r++)
+    {
+        img = new_channel_array(height, width);
+        for (int i = 0; i < height; i++)
+            memcpy(img[i], source[i], width * sizeof(Channels));
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run_iterations();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        samples[r] = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+        free_channel_array(img, height);
+    }
+    iterations = run_iterations_saved;
+    stop_workers();
+    free_arena(arena);
+    arena = NULL;
+
+    // Insertion sort of the few samples for their median
+    for (int i = 1; i < TUNE_REPEATS; i++)
+        for (int k = i; k > 0 && samples[k] < samples[k - 1]; k--)
+        {
+            double t = samples[k];
+            samples[k] = samples[k - 1];
+            samples[k - 1] = t;
+        }
+    return samples[TUNE_REPEATS / 2];
+}
+
+// Times the current configuration, returns whether it beats '*best', which it then replaces
+int faster(Channels **source, int trial_iterations, double *best)
+{
+    double t = time_candidate(source, trial_iterations);
+    if (t >= *best)
+        return 0;
+    *best = t;
+    return 1;
+}
+
+/* Searches the fastest configuration for the image one setting at a time, each one keeping the
+best of those before it: the instruction set, the threads, the tile rows and columns, the
+depthwise mode and the temporal depth. Settings given on the command line, and a thread count
+above 0, are left alone. The result is applied and stored in the wisdom file. */
+void tune(Channels **source)
+{
+    int trial_iterations = fmax(1, fmin(iterations, TUNE_ITERATIONS));
+    int online = sysconf(_SC_NPROCESSORS_ONLN);
+    int tune_threads = n_threads <= 0;
+    const char *isas[8];
+    int n_isas = supported_isas(isas);
+
+    if (tune_threads)
+        n_threads = online;
+    int tune_isa = !(opts.given & GIVEN_ISA) && !getenv("CONV_ISA");
+    if (tune_isa)
+        opts.isa = (char *)isas[0];
+    double best = time_candidate(source, trial_iterations);
+
+    if (tune_isa)
+    {
+        const char *best_isa = opts.isa;
+        for (int i = 1; i < n_isas; i++)
+        {
+            opts.isa = (char *)isas[i];
+            if (faster(source, trial_iterations, &best))
+                best_isa = isas[i];
+        }
+        opts.isa = (char *)best_isa;
+    }
+
+    if (tune_threads)
+    {
+        int best_threads = n_threads;
+        for (int t = 1; t < online; t *= 2)
+        {
+            n_threads = t;
+            if (faster(source, trial_iterations, &best))
+                best_threads = t;
+        }
+        n_threads = best_threads;
+    }
+
+    if (!(opts.given & GIVEN_TILE))
+    {
+        int rows[] = {8, 16, 32, 64, 128};
+        TileShape best_tile = opts.tile;
+        for (int i = 0; i < (int)(sizeof(rows) / sizeof(rows[0])); i++)
+        {
+            opts.tile = (TileShape){rows[i], 0};
+            if (rows[i] != best_tile.rows && faster(source, trial_iterations, &best))
+                best_tile = opts.tile;
+        }
+
+        // The learned layer needs whole rows
+        int cols[] = {128, 512};
+        for (int i = 0; i < (int)(sizeof(cols) / sizeof(cols[0])) && !weights && cols[i] < width; i++)
+        {
+            opts.tile = (TileShape){best_tile.rows, cols[i]};
+            if (faster(source, trial_iterations, &best))
+                best_tile = opts.tile;
+        }
+        opts.tile = best_tile;
+    }
+
+    if (!(opts.given & GIVEN_DEPTHWISE))
+    {
+        opts.expanded = !opts.expanded;
+        if (!faster(source, trial_iterations, &best))
+            opts.expanded = !opts.expanded;
+    }
+
+    if (!(opts.given & GIVEN_TEMPORAL))
+    {
+        int best_depth = opts.temporal;
+        for (int depth = 2; depth <= trial_iterations; depth *= 2)
+        {
+            opts.temporal = depth;
+            if (faster(source, trial_iterations, &best))
+                best_depth = depth;
+        }
+        opts.temporal = best_depth;
+    }
+
+    select_kernels(opts.isa, opts.fixed_point);
+    wisdom = (Wisdom){n_threads, "", opts.tile, opts.expanded, opts.temporal};
+    snprintf(wisdom.isa, sizeof(wisdom.isa), "%s", kernels.name);
+    WisdomKey key = wisdom_key();
+    store_wisdom(wisdom_filename(&opts), &key, &wisdom);
+    printf("Tuned %dx%d: %d threads, %s, tile %dx%d, depthwise %s, temporal %d, %.4f s per %d iterations\n", width,
+           height, n_threads, wisdom.isa, opts.tile.rows, opts.tile.cols, opts.expanded ? "expanded" : "fused",
+           opts.temporal, best, trial_iterations);
+}
+
+// Compute stage of the batch mode, the workspace is only made again for an image it doesn't fit
+void process_image(BatchImage *image)
+{
+    if (arena && (image->width != width || image->height > height))
+    {
+        free_arena(arena);
+        arena = NULL;
     }
+    width = image->width;
+    height = image->height;
+    if (!arena)
+        new_workspace(height);
+
+    img = image->img;
+    image->top = run_iterations();
+    image->img = img;
 }
 
 int main(int argc, char *argv[])
@@ -229,14 +662,81 @@ int main(int argc, char *argv[])
     n_threads = atoi(argv[1]);
     char *in_name = argv[2];
     char *out_name = argv[3];
-    int iterations = atoi(argv[4]);
+    iterations = atoi(argv[4]);
     channel_multiplier = atoi(argv[5]);
+    opts = parse_options(argc, argv, 6);
+    select_kernels(opts.isa, opts.fixed_point);
+    load_weights(opts.weights);
 
-    img = read_image_pnm(in_name, &width, &height);
+    // A thread count of 0 is taken from the wisdom file, or the online CPUs
+    if (opts.stream_rows || opts.batch)
+    {
+        if (n_threads <= 0)
+            n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        // The threads are created once, every stage after this only wakes them up
+        start_workers();
+    }
+
+    if (opts.stream_rows)
+    {
+        // Out-of-core, only a strip of the image is ever in memory
+        StreamStages stages = {stream_spatial, stream_pointwise, NULL, NULL};
+        stream_image(in_name, out_name, iterations, opts.vertical.taps / 2, opts.stream_rows, 0, 1, &width, &height,
+                     &stages);
+    }
+    else if (opts.batch)
+        // 'in_name' lists the images and 'out_name' is the directory they are written to
+        run_batch(in_name, out_name, opts.queue_depth, opts.io_threads, process_image);
+    else
+    {
+        PnmHeader header = read_pnm_header(in_name);
+        width = header.width;
+        height = header.height;
 
-    conv_separable(iterations);
+        // The configuration of this shape comes from the wisdom file, unless it is searched again
+        WisdomKey key = wisdom_key();
+        if (opts.tune)
+        {
+            Channels **source = read_image_pnm(in_name, &width, &height);
+            tune(source);
+            free_channel_array(source, height);
+        }
+        else if (load_wisdom(wisdom_filename(&opts), &key, &wisdom))
+        {
+            apply_wisdom(&wisdom, &opts, &n_threads);
+            select_kernels(opts.isa, opts.fixed_point);
+        }
+        if (n_threads <= 0)
+            n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+        start_workers();
+        new_workspace(height);
+        if (opts.planar)
+        {
+            // The planes are read and written as they are, the image never exists as Channels rows
+            planes = read_image_planar(in_name);
+            write_image_planar(planes, out_name, run_iterations());
+            free_image(planes);
+        }
+        else
+        {
+            read_placed_image(in_name);
+            write_image_pnm(img, out_name, width, height, run_iterations());
+            if (opts.stats)
+                print_band_nodes(img, width, height, n_threads, opts.tile);
+            free_placed_channel_array(img, height, width, opts.pages);
+            if (temporal_dst)
+                free_placed_channel_array(temporal_dst, height, width, opts.pages);
+        }
+    }
 
-    write_image_pnm(img, out_name, width, height);
+    if (opts.stats)
+        print_scheduler_stats(sched);
+    stop_workers();
+    if (arena)
+        free_arena(arena);
+    free_weights();
+    TRACE_DUMP();
 
     return 0;
 }
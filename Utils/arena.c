@@ -0,0 +1,74 @@
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every allocation starts on its own cache line
+#define ARENA_ALIGNMENT 64
+
+// Returns NULL if the memory can't be had
+Arena *new_arena(size_t size)
+{
+    Arena *arena = malloc(sizeof(Arena));
+    if (!arena)
+        return NULL;
+    arena->size = arena_size(size);
+    arena->used = 0;
+    arena->base = aligned_alloc(ARENA_ALIGNMENT, arena->size ? arena->size : ARENA_ALIGNMENT);
+    if (!arena->base)
+    {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+void free_arena(Arena *arena)
+{
+    free(arena->base);
+    free(arena);
+}
+
+// Bytes an allocation of 'size' takes out of an arena
+size_t arena_size(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
+
+// Running out means the arena was sized wrong, which is a bug rather than a condition to handle
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = arena_size(size);
+    if (arena->used + size > arena->size)
+    {
+        fprintf(stderr, "Workspace arena exhausted, %zu of %zu bytes used and %zu more requested\n", arena->used,
+                arena->size, size);
+        exit(EXIT_FAILURE);
+    }
+
+    void *memory = arena->base + arena->used;
+    arena->used += size;
+
+    return memory;
+}
+
+size_t channel_array_size(int height, int width, int border)
+{
+    return arena_size(height * sizeof(Channels *)) + arena_size((size_t)height * (width + 2 * border) * sizeof(Channels));
+}
+
+/* Zeroed 'height' x 'width' array, every row having 'border' more zero pixels on each side, so
+row[-border] to row[width + border - 1] can all be read. The rows are contiguous. */
+Channels **arena_channel_array(Arena *arena, int height, int width, int border)
+{
+    Channels **rows = arena_alloc(arena, height * sizeof(Channels *));
+    size_t row_size = width + 2 * border;
+    Channels *data = arena_alloc(arena, height * row_size * sizeof(Channels));
+    memset(data, 0, height * row_size * sizeof(Channels));
+
+    for (int i = 0; i < height; i++)
+        rows[i] = data + i * row_size + border;
+
+    return rows;
+}
@@ -0,0 +1,24 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include "utils.h"
+
+/* All the scratch memory of a run, allocated once up front and released at the end. The
+stages carve their buffers out of it in order and never give them back, so it has to be sized
+for everything the run needs with the _size functions before it is created. */
+typedef struct
+{
+    unsigned char *base;
+    size_t size;
+    size_t used;
+} Arena;
+
+Arena *new_arena(size_t size);
+void free_arena(Arena *arena);
+size_t arena_size(size_t size);
+void *arena_alloc(Arena *arena, size_t size);
+size_t channel_array_size(int height, int width, int border);
+Channels **arena_channel_array(Arena *arena, int height, int width, int border);
+
+#endif // ARENA_H_
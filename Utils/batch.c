@@ -0,0 +1,280 @@
+#include "batch.h"
+#include <dirent.h>
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// Blocking queue of at most 'capacity' images, closed once nothing else will be pushed
+typedef struct
+{
+    BatchImage **slots;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ImageQueue;
+
+typedef struct
+{
+    char **inputs;
+    int n_inputs;
+    char *out_dir;
+    // Next input a reader takes, and readers still running
+    int next;
+    int readers;
+    pthread_mutex_t lock;
+    ImageQueue read;
+    ImageQueue written;
+} Batch;
+
+static void queue_init(ImageQueue *q, int capacity)
+{
+    q->slots = malloc(capacity * sizeof(BatchImage *));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+}
+
+static void queue_destroy(ImageQueue *q)
+{
+    free(q->slots);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+}
+
+static void queue_push(ImageQueue *q, BatchImage *image)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->changed, &q->lock);
+    q->slots[(q->head + q->count++) % q->capacity] = image;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Returns NULL once the queue is closed and empty
+static BatchImage *queue_pop(ImageQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->changed, &q->lock);
+
+    BatchImage *image = NULL;
+    if (q->count > 0)
+    {
+        image = q->slots[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return image;
+}
+
+static void queue_close(ImageQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int is_image_name(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    return dot && (strcmp(dot, ".pnm") == 0 || strcmp(dot, ".ppm") == 0 || strcmp(dot, ".pgm") == 0);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void add_input(char ***inputs, int *count, const char *path)
+{
+    *inputs = realloc(*inputs, (*count + 1) * sizeof(char *));
+    (*inputs)[(*count)++] = strdup(path);
+}
+
+/* Lists the images of 'source'. A directory gives its .pnm, .ppm and .pgm files in name order,
+anything with a wildcard is expanded as a glob pattern, and any other file is a manifest. Blank
+lines and lines starting with '#' are skipped in a manifest. */
+static char **list_inputs(char *source, int *count)
+{
+    char **inputs = NULL;
+    struct stat st;
+    *count = 0;
+
+    if (stat(source, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(source);
+        struct dirent *entry;
+        while (dir && (entry = readdir(dir)))
+            if (is_image_name(entry->d_name))
+            {
+                char path[strlen(source) + strlen(entry->d_name) + 2];
+                sprintf(path, "%s/%s", source, entry->d_name);
+                add_input(&inputs, count, path);
+            }
+        if (dir)
+            closedir(dir);
+        if (*count > 0)
+            qsort(inputs, *count, sizeof(char *), compare_names);
+    }
+    else if (strpbrk(source, "*?["))
+    {
+        glob_t matches;
+        if (glob(source, 0, NULL, &matches) == 0)
+            for (size_t i = 0; i < matches.gl_pathc; i++)
+                add_input(&inputs, count, matches.gl_pathv[i]);
+        globfree(&matches);
+    }
+    else
+    {
+        FILE *manifest = fopen(source, "r");
+        if (!manifest)
+        {
+            perror(source);
+            exit(EXIT_FAILURE);
+        }
+
+        char *line = NULL;
+        size_t capacity = 0;
+        while (getline(&line, &capacity, manifest) >= 0)
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0' && line[0] != '#')
+                add_input(&inputs, count, line);
+        }
+        free(line);
+        fclose(manifest);
+    }
+
+    if (*count == 0)
+    {
+        fprintf(stderr, "No images in '%s'\n", source);
+        exit(EXIT_FAILURE);
+    }
+
+    return inputs;
+}
+
+static void *reader(void *var)
+{
+    Batch *batch = var;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&batch->lock);
+        int index = batch->next < batch->n_inputs ? batch->next++ : -1;
+        pthread_mutex_unlock(&batch->lock);
+        if (index < 0)
+            break;
+
+        BatchImage *image = malloc(sizeof(BatchImage));
+        image->input = batch->inputs[index];
+        const char *name = strrchr(image->input, '/') ? strrchr(image->input, '/') + 1 : image->input;
+        image->output = malloc(strlen(batch->out_dir) + strlen(name) + 2);
+        sprintf(image->output, "%s/%s", batch->out_dir, name);
+        image->img = read_image_pnm(image->input, &image->width, &image->height);
+        image->top = -1;
+
+        queue_push(&batch->read, image);
+    }
+
+    // The last reader to finish tells the compute that no more images are coming
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->readers == 0)
+        queue_close(&batch->read);
+    pthread_mutex_unlock(&batch->lock);
+
+    return NULL;
+}
+
+static void *writer(void *var)
+{
+    Batch *batch = var;
+    BatchImage *image;
+
+    while ((image = queue_pop(&batch->written)))
+    {
+        write_image_pnm(image->img, image->output, image->width, image->height, image->top);
+        free_channel_array(image->img, image->height);
+        free(image->output);
+        free(image);
+    }
+
+    return NULL;
+}
+
+static double seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void run_batch(char *source, char *out_dir, int queue_depth, int io_threads, void (*process)(BatchImage *image))
+{
+    double start = seconds();
+    Batch batch;
+    batch.inputs = list_inputs(source, &batch.n_inputs);
+    batch.out_dir = out_dir;
+    batch.next = 0;
+    batch.readers = io_threads;
+    pthread_mutex_init(&batch.lock, NULL);
+    queue_init(&batch.read, queue_depth);
+    queue_init(&batch.written, queue_depth);
+
+    if (mkdir(out_dir, 0777) != 0 && errno != EEXIST)
+    {
+        perror(out_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t readers[io_threads], writers[io_threads];
+    for (int t = 0; t < io_threads; t++)
+    {
+        pthread_create(&readers[t], NULL, reader, &batch);
+        pthread_create(&writers[t], NULL, writer, &batch);
+    }
+
+    // Images are processed in the order the readers finish them, every one of them by all the compute threads
+    BatchImage *image;
+    double pixels = 0;
+    while ((image = queue_pop(&batch.read)))
+    {
+        pixels += (double)image->width * image->height;
+        process(image);
+        queue_push(&batch.written, image);
+    }
+    queue_close(&batch.written);
+
+    for (int t = 0; t < io_threads; t++)
+    {
+        pthread_join(readers[t], NULL);
+        pthread_join(writers[t], NULL);
+    }
+
+    double elapsed = seconds() - start;
+    printf("%d images, %.1f Mpix in %.3f s: %.2f images/s, %.2f Mpix/s\n", batch.n_inputs, pixels / 1e6, elapsed,
+           batch.n_inputs / elapsed, pixels / 1e6 / elapsed);
+
+    for (int i = 0; i < batch.n_inputs; i++)
+        free(batch.inputs[i]);
+    free(batch.inputs);
+    queue_destroy(&batch.read);
+    queue_destroy(&batch.written);
+    pthread_mutex_destroy(&batch.lock);
+}
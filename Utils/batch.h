@@ -0,0 +1,25 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "utils.h"
+
+// An image of a batch, from the moment it is read until it is written
+typedef struct
+{
+    char *input;
+    char *output;
+    Channels **img;
+    int width;
+    int height;
+    // Range the writer puts in the header, -1 makes it scan the image
+    int top;
+} BatchImage;
+
+/* Runs 'process' on every image of 'source', a directory, a glob pattern or a manifest file
+with one path per line, and writes the results under the same names into 'out_dir'. Reader
+threads load the next images while the calling thread runs 'process' on the current one, and
+writer threads save the finished ones. At most 'queue_depth' images wait between two stages.
+'process' may replace image->img and sets image->top. Prints images/s and Mpix/s at the end. */
+void run_batch(char *source, char *out_dir, int queue_depth, int io_threads, void (*process)(BatchImage *image));
+
+#endif // BATCH_H_
@@ -0,0 +1,145 @@
+#include "image.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Allocates a zeroed planar image, every row padded up to a multiple of IMAGE_ALIGNMENT
+Image *new_image(int height, int width, int planes)
+{
+    Image *img = malloc(sizeof(Image));
+    img->width = width;
+    img->height = height;
+    img->planes = planes;
+    img->stride = (width + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+
+    size_t size = (size_t)img->stride * height * planes;
+    img->data = aligned_alloc(IMAGE_ALIGNMENT, size > 0 ? size : IMAGE_ALIGNMENT);
+    memset(img->data, 0, size);
+
+    return img;
+}
+
+void free_image(Image *img)
+{
+    free(img->data);
+    free(img);
+}
+
+// Copies the first 'planes' channels of a channel array into a new planar image
+Image *image_from_channels(Channels **src, int height, int width, int planes)
+{
+    Image *img = new_image(height, width, planes);
+
+    for (int c = 0; c < planes; c++)
+        for (int i = 0; i < height; i++)
+        {
+            unsigned char *row = image_row(img, c, i);
+            for (int j = 0; j < width; j++)
+                row[j] = src[i][j].channel[c];
+        }
+
+    return img;
+}
+
+// Copies the planes back into the matching channels of an already allocated channel array
+void image_to_channels(Image *src, Channels **dst)
+{
+    for (int c = 0; c < src->planes; c++)
+        for (int i = 0; i < src->height; i++)
+        {
+            unsigned char *row = image_row(src, c, i);
+            for (int j = 0; j < src->width; j++)
+                dst[i][j].channel[c] = row[j];
+        }
+}
+
+typedef struct
+{
+    MappedPnm *pnm;
+    Image *img;
+} PlanarReadJob;
+
+static void read_planar_rows(void *var, int start, int end)
+{
+    MappedPnm *pnm = ((PlanarReadJob *)var)->pnm;
+    Image *img = ((PlanarReadJob *)var)->img;
+    PnmHeader *h = &pnm->header;
+    int gray = h->samples == 1;
+
+    for (int i = start; i < end; i++)
+    {
+        const unsigned char *pixels = pnm->data + h->offset + (size_t)i * h->width * h->samples;
+        for (int c = 0; c < channel_count; c++)
+        {
+            unsigned char *row = image_row(img, c, i);
+            for (int j = 0; j < img->width; j++)
+                row[j] = pixels[j * h->samples + (gray ? 0 : c)];
+        }
+    }
+}
+
+// Reads a pnm binary image straight into 3 planes, deinterleaving bands of rows in parallel
+Image *read_image_planar(char *filename)
+{
+    MappedPnm *pnm = map_image_pnm(filename, MADV_WILLNEED);
+    Image *img = new_image(pnm->header.height, pnm->header.width, channel_count);
+
+    PlanarReadJob job = {pnm, img};
+    parallel_rows(img->height, read_planar_rows, &job);
+
+    unmap_image_pnm(pnm);
+
+    return img;
+}
+
+typedef struct
+{
+    Image *img;
+    int fd;
+    size_t offset;
+} PlanarWriteJob;
+
+static void write_planar_rows(void *var, int start, int end)
+{
+    PlanarWriteJob *job = var;
+    Image *img = job->img;
+    size_t row_size = (size_t)img->width * channel_count;
+    unsigned char *pixels = malloc(row_size);
+
+    for (int i = start; i < end; i++)
+    {
+        for (int c = 0; c < channel_count; c++)
+        {
+            unsigned char *row = image_row(img, c, i);
+            for (int j = 0; j < img->width; j++)
+                pixels[j * channel_count + c] = row[j];
+        }
+        write_at(job->fd, pixels, row_size, job->offset + i * row_size);
+    }
+
+    free(pixels);
+}
+
+/* Writes the first 3 planes as a RGB, pnm binary image, interleaving bands of rows in parallel.
+A negative 'top' scans the planes for the range. */
+void write_image_planar(Image *img, char *filename, int top)
+{
+    if (top < 0)
+    {
+        top = 0;
+        for (int c = 0; c < channel_count; c++)
+            for (int i = 0; i < img->height; i++)
+            {
+                unsigned char *row = image_row(img, c, i);
+                for (int j = 0; j < img->width; j++)
+                    if (row[j] > top)
+                        top = row[j];
+            }
+    }
+
+    PlanarWriteJob job = {img};
+    job.fd = create_image_pnm(filename, img->width, img->height, top, &job.offset);
+    parallel_rows(img->height, write_planar_rows, &job);
+    close(job.fd);
+}
@@ -0,0 +1,37 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include "utils.h"
+
+// Rows of every plane start on a cache line, which is also the widest vector register
+#define IMAGE_ALIGNMENT 64
+
+/* Planar image: one plane per channel, all of them in a single aligned allocation.
+Rows are padded to 'stride' bytes so each one is contiguous and aligned. */
+typedef struct
+{
+    int width;
+    int height;
+    int planes;
+    int stride;
+    unsigned char *data;
+} Image;
+
+static inline unsigned char *image_plane(Image *img, int plane)
+{
+    return img->data + (size_t)plane * img->height * img->stride;
+}
+
+static inline unsigned char *image_row(Image *img, int plane, int row)
+{
+    return image_plane(img, plane) + (size_t)row * img->stride;
+}
+
+Image *new_image(int height, int width, int planes);
+void free_image(Image *img);
+Image *image_from_channels(Channels **src, int height, int width, int planes);
+void image_to_channels(Image *src, Channels **dst);
+Image *read_image_planar(char *filename);
+void write_image_planar(Image *img, char *filename, int top);
+
+#endif // IMAGE_H_
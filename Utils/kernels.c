@@ -0,0 +1,1013 @@
+#include "kernels.h"
+#include "utils.h"
+#include <immintrin.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every variant does the float math in the same order as the scalar one and never fuses a
+multiply with an add, so the rounding, and therefore every output byte, is identical. */
+#pragma GCC optimize("fp-contract=off")
+
+// Instantiates the fully unrolled 3, 5 and 7 tap versions of a body, and a generic one for the rest
+#define SPECIALIZE_TAPS(body, taps, ...)        \
+    switch (taps)                               \
+    {                                           \
+    case 3:                                     \
+        return body(__VA_ARGS__, 3);            \
+    case 5:                                     \
+        return body(__VA_ARGS__, 5);            \
+    case 7:                                     \
+        return body(__VA_ARGS__, 7);            \
+    default:                                    \
+        return body(__VA_ARGS__, taps);         \
+    }
+
+// Scalar fallback
+
+__attribute__((always_inline)) static inline unsigned char taps_body_scalar(unsigned char *out,
+                                                                            const unsigned char *const *src,
+                                                                            int from, int n, const float *K,
+                                                                            const int taps)
+{
+    unsigned char top = 0;
+    for (int x = from; x < n; x++)
+    {
+        float final_pixel = 0;
+#pragma GCC unroll 8
+        for (int k = 0; k < taps; k++)
+            final_pixel += src[k][x] * K[k];
+        out[x] = clamp_to_byte(final_pixel);
+        if (out[x] > top)
+            top = out[x];
+    }
+    return top;
+}
+
+// Leftover columns of the vector variants
+static unsigned char taps_tail(unsigned char *out, const unsigned char *const *src, int from, int n,
+                               const Kernel1D *K)
+{
+    return taps_body_scalar(out, src, from, n, K->coefficients, K->taps);
+}
+
+static unsigned char taps_scalar(unsigned char *out, const unsigned char *const *src, int n, const Kernel1D *K)
+{
+    SPECIALIZE_TAPS(taps_body_scalar, K->taps, out, src, 0, n, K->coefficients)
+}
+
+static void scale_scalar(unsigned char *buf, int n, float factor)
+{
+    for (int x = 0; x < n; x++)
+        buf[x] = clamp_to_byte(factor * buf[x]);
+}
+
+static void accumulate_scalar(unsigned short *acc, const unsigned char *src, int n)
+{
+    for (int x = 0; x < n; x++)
+        acc[x] += src[x];
+}
+
+static void divide_scalar(unsigned char *out, const unsigned short *acc, int n, int divisor)
+{
+    for (int x = 0; x < n; x++)
+        out[x] = clamp_to_byte(acc[x] / divisor);
+}
+
+// SSE4.1, 16 bytes at a time
+
+__attribute__((target("sse4.1"))) static inline __m128 load4_sse41(const unsigned char *p)
+{
+    int v;
+    memcpy(&v, p, sizeof(v));
+    return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i clamp_sse41(__m128 v)
+{
+    return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.f)));
+}
+
+__attribute__((target("sse4.1"))) static inline unsigned char reduce_max_sse41(__m128i v)
+{
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 1));
+    return _mm_cvtsi128_si32(v) & 0xff;
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline unsigned char taps_body_sse41(
+    unsigned char *out, const unsigned char *const *src, int n, const Kernel1D *K, const int taps)
+{
+    __m128i top = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i r[4];
+        for (int q = 0; q < 4; q++)
+        {
+            __m128 v = _mm_mul_ps(load4_sse41(src[0] + x + 4 * q), _mm_set1_ps(K->coefficients[0]));
+#pragma GCC unroll 8
+            for (int k = 1; k < taps; k++)
+                v = _mm_add_ps(v, _mm_mul_ps(load4_sse41(src[k] + x + 4 * q), _mm_set1_ps(K->coefficients[k])));
+            r[q] = clamp_sse41(v);
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packus_epi32(r[0], r[1]), _mm_packus_epi32(r[2], r[3]));
+        _mm_storeu_si128((__m128i *)(out + x), bytes);
+        top = _mm_max_epu8(top, bytes);
+    }
+
+    unsigned char tail = taps_tail(out, src, x, n, K);
+    unsigned char body = reduce_max_sse41(top);
+    return body > tail ? body : tail;
+}
+
+__attribute__((target("sse4.1"))) static unsigned char taps_sse41(unsigned char *out, const unsigned char *const *src,
+                                                                  int n, const Kernel1D *K)
+{
+    SPECIALIZE_TAPS(taps_body_sse41, K->taps, out, src, n, K)
+}
+
+__attribute__((target("sse4.1"))) static void scale_sse41(unsigned char *buf, int n, float factor)
+{
+    __m128 f = _mm_set1_ps(factor);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i r[4];
+        for (int q = 0; q < 4; q++)
+            r[q] = clamp_sse41(_mm_mul_ps(f, load4_sse41(buf + x + 4 * q)));
+        __m128i bytes = _mm_packus_epi16(_mm_packus_epi32(r[0], r[1]), _mm_packus_epi32(r[2], r[3]));
+        _mm_storeu_si128((__m128i *)(buf + x), bytes);
+    }
+
+    scale_scalar(buf + x, n - x, factor);
+}
+
+__attribute__((target("sse4.1"))) static void accumulate_sse41(unsigned short *acc, const unsigned char *src, int n)
+{
+    int x = 0;
+
+    for (; x + 8 <= n; x += 8)
+    {
+        __m128i v = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(src + x)));
+        __m128i sum = _mm_add_epi16(_mm_loadu_si128((const __m128i *)(acc + x)), v);
+        _mm_storeu_si128((__m128i *)(acc + x), sum);
+    }
+
+    accumulate_scalar(acc + x, src + x, n - x);
+}
+
+__attribute__((target("sse4.1"))) static void divide_sse41(unsigned char *out, const unsigned short *acc, int n,
+                                                           int divisor)
+{
+    __m128 d = _mm_set1_ps(divisor);
+    int x = 0;
+
+    for (; x + 8 <= n; x += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(acc + x));
+        __m128i lo = clamp_sse41(_mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(v)), d));
+        __m128i hi = clamp_sse41(_mm_div_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8))), d));
+        __m128i words = _mm_packus_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(words, words));
+    }
+
+    divide_scalar(out + x, acc + x, n - x, divisor);
+}
+
+// AVX2, 16 bytes at a time in two 8 float registers
+
+__attribute__((target("avx2"))) static inline __m256 load8_avx2(const unsigned char *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)));
+}
+
+__attribute__((target("avx2"))) static inline __m256i clamp_avx2(__m256 v)
+{
+    return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.f)));
+}
+
+// Packs 16 int32 lanes in the range 0-255 into bytes, keeping their order
+__attribute__((target("avx2"))) static inline __m128i pack_avx2(__m256i lo, __m256i hi)
+{
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+}
+
+__attribute__((target("avx2"), always_inline)) static inline unsigned char taps_body_avx2(
+    unsigned char *out, const unsigned char *const *src, int n, const Kernel1D *K, const int taps)
+{
+    __m128i top = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m256i r[2];
+        for (int q = 0; q < 2; q++)
+        {
+            __m256 v = _mm256_mul_ps(load8_avx2(src[0] + x + 8 * q), _mm256_set1_ps(K->coefficients[0]));
+#pragma GCC unroll 8
+            for (int k = 1; k < taps; k++)
+                v = _mm256_add_ps(v, _mm256_mul_ps(load8_avx2(src[k] + x + 8 * q), _mm256_set1_ps(K->coefficients[k])));
+            r[q] = clamp_avx2(v);
+        }
+        __m128i bytes = pack_avx2(r[0], r[1]);
+        _mm_storeu_si128((__m128i *)(out + x), bytes);
+        top = _mm_max_epu8(top, bytes);
+    }
+
+    unsigned char tail = taps_tail(out, src, x, n, K);
+    unsigned char body = reduce_max_sse41(top);
+    return body > tail ? body : tail;
+}
+
+__attribute__((target("avx2"))) static unsigned char taps_avx2(unsigned char *out, const unsigned char *const *src,
+                                                               int n, const Kernel1D *K)
+{
+    SPECIALIZE_TAPS(taps_body_avx2, K->taps, out, src, n, K)
+}
+
+__attribute__((target("avx2"))) static void scale_avx2(unsigned char *buf, int n, float factor)
+{
+    __m256 f = _mm256_set1_ps(factor);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m256i lo = clamp_avx2(_mm256_mul_ps(f, load8_avx2(buf + x)));
+        __m256i hi = clamp_avx2(_mm256_mul_ps(f, load8_avx2(buf + x + 8)));
+        _mm_storeu_si128((__m128i *)(buf + x), pack_avx2(lo, hi));
+    }
+
+    scale_scalar(buf + x, n - x, factor);
+}
+
+__attribute__((target("avx2"))) static void accumulate_avx2(unsigned short *acc, const unsigned char *src, int n)
+{
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + x)));
+        __m256i sum = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *)(acc + x)), v);
+        _mm256_storeu_si256((__m256i *)(acc + x), sum);
+    }
+
+    accumulate_scalar(acc + x, src + x, n - x);
+}
+
+__attribute__((target("avx2"))) static void divide_avx2(unsigned char *out, const unsigned short *acc, int n,
+                                                        int divisor)
+{
+    __m256 d = _mm256_set1_ps(divisor);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(acc + x)));
+        __m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(acc + x + 8)));
+        lo = clamp_avx2(_mm256_div_ps(_mm256_cvtepi32_ps(lo), d));
+        hi = clamp_avx2(_mm256_div_ps(_mm256_cvtepi32_ps(hi), d));
+        _mm_storeu_si128((__m128i *)(out + x), pack_avx2(lo, hi));
+    }
+
+    divide_scalar(out + x, acc + x, n - x, divisor);
+}
+
+// AVX-512, 16 bytes at a time in one 16 float register
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512 load16_avx512(const unsigned char *p)
+{
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)p)));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m128i clamp_avx512(__m512 v)
+{
+    v = _mm512_min_ps(_mm512_max_ps(v, _mm512_setzero_ps()), _mm512_set1_ps(255.f));
+    return _mm512_cvtepi32_epi8(_mm512_cvttps_epi32(v));
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline)) static inline unsigned char taps_body_avx512(
+    unsigned char *out, const unsigned char *const *src, int n, const Kernel1D *K, const int taps)
+{
+    __m128i top = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m512 v = _mm512_mul_ps(load16_avx512(src[0] + x), _mm512_set1_ps(K->coefficients[0]));
+#pragma GCC unroll 8
+        for (int k = 1; k < taps; k++)
+            v = _mm512_add_ps(v, _mm512_mul_ps(load16_avx512(src[k] + x), _mm512_set1_ps(K->coefficients[k])));
+        __m128i bytes = clamp_avx512(v);
+        _mm_storeu_si128((__m128i *)(out + x), bytes);
+        top = _mm_max_epu8(top, bytes);
+    }
+
+    unsigned char tail = taps_tail(out, src, x, n, K);
+    unsigned char body = reduce_max_sse41(top);
+    return body > tail ? body : tail;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static unsigned char taps_avx512(unsigned char *out,
+                                                                             const unsigned char *const *src, int n,
+                                                                             const Kernel1D *K)
+{
+    SPECIALIZE_TAPS(taps_body_avx512, K->taps, out, src, n, K)
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void scale_avx512(unsigned char *buf, int n, float factor)
+{
+    __m512 f = _mm512_set1_ps(factor);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+        _mm_storeu_si128((__m128i *)(buf + x), clamp_avx512(_mm512_mul_ps(f, load16_avx512(buf + x))));
+
+    scale_scalar(buf + x, n - x, factor);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void accumulate_avx512(unsigned short *acc,
+                                                                          const unsigned char *src, int n)
+{
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32)
+    {
+        __m512i v = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(src + x)));
+        __m512i sum = _mm512_add_epi16(_mm512_loadu_si512(acc + x), v);
+        _mm512_storeu_si512(acc + x, sum);
+    }
+
+    accumulate_scalar(acc + x, src + x, n - x);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void divide_avx512(unsigned char *out,
+                                                                      const unsigned short *acc, int n,
+                                                                      int divisor)
+{
+    __m512 d = _mm512_set1_ps(divisor);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(acc + x)));
+        _mm_storeu_si128((__m128i *)(out + x), clamp_avx512(_mm512_div_ps(_mm512_cvtepi32_ps(v), d)));
+    }
+
+    divide_scalar(out + x, acc + x, n - x, divisor);
+}
+
+/* Pointwise 1x1 convolution, a GEMM of the outputs x inputs matrix with the inputs x pixels
+lines. The vector variants keep the accumulators of up to POINTWISE_OUTPUTS outputs over two
+vectors of pixels in registers, so every input vector they load feeds all of those outputs.
+The pixels are taken in cache blocks whose lines stay in L1 while every register block of
+outputs goes through them. Each output starts from its bias and adds the inputs in order, the
+same as the scalar loop. */
+
+#define POINTWISE_OUTPUTS 4
+// Bytes of input lines in a cache block of pixels
+#define POINTWISE_BLOCK_BYTES 16384
+
+// Instantiates a register block body for 1 to POINTWISE_OUTPUTS outputs
+#define SPECIALIZE_OUTPUTS(top, body, outputs, ...) \
+    switch (outputs)                                \
+    {                                               \
+    case 1:                                         \
+        top = body(__VA_ARGS__, 1);                 \
+        break;                                      \
+    case 2:                                         \
+        top = body(__VA_ARGS__, 2);                 \
+        break;                                      \
+    case 3:                                         \
+        top = body(__VA_ARGS__, 3);                 \
+        break;                                      \
+    default:                                        \
+        top = body(__VA_ARGS__, POINTWISE_OUTPUTS); \
+    }
+
+// Pixels in a cache block, a multiple of the 'step' of a register block
+static int pointwise_block(const Pointwise *P, int step)
+{
+    int pixels = POINTWISE_BLOCK_BYTES / P->inputs / step * step;
+    return pixels > step ? pixels : step;
+}
+
+// Pixels [from, n) of every output, also the leftover columns of the vector variants
+static unsigned char pointwise_tail(unsigned char *const *out, const unsigned char *const *src, int from, int n,
+                                    const Pointwise *P)
+{
+    unsigned char top = 0;
+    for (int o = 0; o < P->outputs; o++)
+    {
+        const float *W = P->weights + o * P->inputs;
+        for (int x = from; x < n; x++)
+        {
+            float final_pixel = P->bias[o];
+            for (int k = 0; k < P->inputs; k++)
+                final_pixel += src[k][x] * W[k];
+            out[o][x] = clamp_to_byte(final_pixel);
+            if (out[o][x] > top)
+                top = out[o][x];
+        }
+    }
+    return top;
+}
+
+static unsigned char pointwise_scalar(unsigned char *const *out, const unsigned char *const *src, int n,
+                                      const Pointwise *P)
+{
+    return pointwise_tail(out, src, 0, n, P);
+}
+
+// 8 pixels of 'outputs' outputs starting at 'o', in two 4 float registers each
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i pointwise_body_sse41(
+    unsigned char *const *out, const unsigned char *const *src, int from, int to, const Pointwise *P, int o,
+    __m128i top, const int outputs)
+{
+    const float *W = P->weights + o * P->inputs;
+
+    for (int x = from; x < to; x += 8)
+    {
+        __m128 acc[POINTWISE_OUTPUTS][2];
+#pragma GCC unroll 4
+        for (int b = 0; b < outputs; b++)
+            acc[b][0] = acc[b][1] = _mm_set1_ps(P->bias[o + b]);
+
+        for (int k = 0; k < P->inputs; k++)
+        {
+            __m128 lo = load4_sse41(src[k] + x);
+            __m128 hi = load4_sse41(src[k] + x + 4);
+#pragma GCC unroll 4
+            for (int b = 0; b < outputs; b++)
+            {
+                __m128 w = _mm_set1_ps(W[b * P->inputs + k]);
+                acc[b][0] = _mm_add_ps(acc[b][0], _mm_mul_ps(lo, w));
+                acc[b][1] = _mm_add_ps(acc[b][1], _mm_mul_ps(hi, w));
+            }
+        }
+
+#pragma GCC unroll 4
+        for (int b = 0; b < outputs; b++)
+        {
+            __m128i words = _mm_packus_epi32(clamp_sse41(acc[b][0]), clamp_sse41(acc[b][1]));
+            __m128i bytes = _mm_packus_epi16(words, _mm_setzero_si128());
+            _mm_storel_epi64((__m128i *)(out[o + b] + x), bytes);
+            top = _mm_max_epu8(top, bytes);
+        }
+    }
+
+    return top;
+}
+
+__attribute__((target("sse4.1"))) static unsigned char pointwise_sse41(unsigned char *const *out,
+                                                                       const unsigned char *const *src, int n,
+                                                                       const Pointwise *P)
+{
+    __m128i top = _mm_setzero_si128();
+    int blocked = n - n % 8;
+    int block = pointwise_block(P, 8);
+
+    for (int from = 0; from < blocked; from += block)
+    {
+        int to = from + block < blocked ? from + block : blocked;
+        for (int o = 0; o < P->outputs; o += POINTWISE_OUTPUTS)
+            SPECIALIZE_OUTPUTS(top, pointwise_body_sse41, P->outputs - o, out, src, from, to, P, o, top)
+    }
+
+    unsigned char tail = pointwise_tail(out, src, blocked, n, P);
+    unsigned char body = reduce_max_sse41(top);
+    return body > tail ? body : tail;
+}
+
+// 16 pixels of 'outputs' outputs starting at 'o', in two 8 float registers each
+__attribute__((target("avx2"), always_inline)) static inline __m128i pointwise_body_avx2(
+    unsigned char *const *out, const unsigned char *const *src, int from, int to, const Pointwise *P, int o,
+    __m128i top, const int outputs)
+{
+    const float *W = P->weights + o * P->inputs;
+
+    for (int x = from; x < to; x += 16)
+    {
+        __m256 acc[POINTWISE_OUTPUTS][2];
+#pragma GCC unroll 4
+        for (int b = 0; b < outputs; b++)
+            acc[b][0] = acc[b][1] = _mm256_set1_ps(P->bias[o + b]);
+
+        for (int k = 0; k < P->inputs; k++)
+        {
+            __m256 lo = load8_avx2(src[k] + x);
+            __m256 hi = load8_avx2(src[k] + x + 8);
+#pragma GCC unroll 4
+            for (int b = 0; b < outputs; b++)
+            {
+                __m256 w = _mm256_set1_ps(W[b * P->inputs + k]);
+                acc[b][0] = _mm256_add_ps(acc[b][0], _mm256_mul_ps(lo, w));
+                acc[b][1] = _mm256_add_ps(acc[b][1], _mm256_mul_ps(hi, w));
+            }
+        }
+
+#pragma GCC unroll 4
+        for (int b = 0; b < outputs; b++)
+        {
+            __m128i bytes = pack_avx2(clamp_avx2(acc[b][0]), clamp_avx2(acc[b][1]));
+            _mm_storeu_si128((__m128i *)(out[o + b] + x), bytes);
+            top = _mm_max_epu8(top, bytes);
+        }
+    }
+
+    return top;
+}
+
+__attribute__((target("avx2"))) static unsigned char pointwise_avx2(unsigned char *const *out,
+                                                                    const unsigned char *const *src, int n,
+                                                                    const Pointwise *P)
+{
+    __m128i top = _mm_setzero_si128();
+    int blocked = n - n % 16;
+    int block = pointwise_block(P, 16);
+
+    for (int from = 0; from < blocked; from += block)
+    {
+        int to = from + block < blocked ? from + block : blocked;
+        for (int o = 0; o < P->outputs; o += POINTWISE_OUTPUTS)
+            SPECIALIZE_OUTPUTS(top, pointwise_body_avx2, P->outputs - o, out, src, from, to, P, o, top)
+    }
+
+    unsigned char tail = pointwise_tail(out, src, blocked, n, P);
+    unsigned char body = reduce_max_sse41(top);
+    return body > tail ? body : tail;
+}
+
+// 32 pixels of 'outputs' outputs starting at 'o', in two 16 float registers each
+__attribute__((target("avx512f,avx512bw"), always_inline)) static inline __m128i pointwise_body_avx512(
+    unsigned char *const *out, const unsigned char *const *src, int from, int to, const Pointwise *P, int o,
+    __m128i top, const int outputs)
+{
+    const float *W = P->weights + o * P->inputs;
+
+    for (int x = from; x < to; x += 32)
+    {
+        __m512 acc[POINTWISE_OUTPUTS][2];
+#pragma GCC unroll 4
+        for (int b = 0; b < outputs; b++)
+            acc[b][0] = acc[b][1] = _mm512_set1_ps(P->bias[o + b]);
+
+        for (int k = 0; k < P->inputs; k++)
+        {
+            __m512 lo = load16_avx512(src[k] + x);
+            __m512 hi = load16_avx512(src[k] + x + 16);
+#pragma GCC unroll 4
+            for (int b = 0; b < outputs; b++)
+            {
+                __m512 w = _mm512_set1_ps(W[b * P->inputs + k]);
+                acc[b][0] = _mm512_add_ps(acc[b][0], _mm512_mul_ps(lo, w));
+                acc[b][1] = _mm512_add_ps(acc[b][1], _mm512_mul_ps(hi, w));
+            }
+        }
+
+#pragma GCC unroll 4
+        for (int b = 0; b < outputs; b++)
+            for (int q = 0; q < 2; q++)
+            {
+                __m128i bytes = clamp_avx512(acc[b][q]);
+                _mm_storeu_si128((__m128i *)(out[o + b] + x + 16 * q), bytes);
+                top = _mm_max_epu8(top, bytes);
+            }
+    }
+
+    return top;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static unsigned char pointwise_avx512(unsigned char *const *out,
+                                                                                  const unsigned char *const *src,
+                                                                                  int n, const Pointwise *P)
+{
+    __m128i top = _mm_setzero_si128();
+    int blocked = n - n % 32;
+    int block = pointwise_block(P, 32);
+
+    for (int from = 0; from < blocked; from += block)
+    {
+        int to = from + block < blocked ? from + block : blocked;
+        for (int o = 0; o < P->outputs; o += POINTWISE_OUTPUTS)
+            SPECIALIZE_OUTPUTS(top, pointwise_body_avx512, P->outputs - o, out, src, from, to, P, o, top)
+    }
+
+    unsigned char tail = pointwise_tail(out, src, blocked, n, P);
+    unsigned char body = reduce_max_sse41(top);
+    return body > tail ? body : tail;
+}
+
+/* Fixed point variants. A kernel is a set of int16 numerators over a common divisor, applied
+as a multiply by the rounded up reciprocal of the divisor in Q16. quantize_kernel keeps every
+partial sum inside int16, see its comment. */
+
+__attribute__((always_inline)) static inline unsigned char taps_fixed_body_scalar(unsigned char *out,
+                                                                                  const unsigned char *const *src,
+                                                                                  int from, int n,
+                                                                                  const FixedKernel *K,
+                                                                                  const int taps)
+{
+    unsigned char top = 0;
+    for (int x = from; x < n; x++)
+    {
+        int final_pixel = 0;
+#pragma GCC unroll 8
+        for (int k = 0; k < taps; k++)
+            final_pixel += K->numerators[k] * src[k][x];
+        if (final_pixel < 0)
+            final_pixel = 0;
+        final_pixel = (final_pixel * K->reciprocal) >> 16;
+        out[x] = final_pixel > 255 ? 255 : final_pixel;
+        if (out[x] > top)
+            top = out[x];
+    }
+    return top;
+}
+
+static unsigned char taps_fixed_tail(unsigned char *out, const unsigned char *const *src, int from, int n,
+                                     const FixedKernel *K)
+{
+    return taps_fixed_body_scalar(out, src, from, n, K, K->taps);
+}
+
+static unsigned char taps_fixed_scalar(unsigned char *out, const unsigned char *const *src, int n,
+                                       const FixedKernel *K)
+{
+    SPECIALIZE_TAPS(taps_fixed_body_scalar, K->taps, out, src, 0, n, K)
+}
+
+static void scale_fixed_scalar(unsigned char *buf, int n, unsigned short factor)
+{
+    for (int x = 0; x < n; x++)
+    {
+        int value = (buf[x] * factor) >> 8;
+        buf[x] = value > 255 ? 255 : value;
+    }
+}
+
+static void divide_fixed_scalar(unsigned char *out, const unsigned short *acc, int n, int divisor)
+{
+    unsigned int reciprocal = (65536 + divisor - 1) / divisor;
+    for (int x = 0; x < n; x++)
+    {
+        unsigned int value = divisor == 1 ? acc[x] : (acc[x] * reciprocal) >> 16;
+        out[x] = value > 255 ? 255 : value;
+    }
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline __m128i taps_fixed_words_sse41(
+    const unsigned char *const *src, int x, int high, const FixedKernel *K, const int taps)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = zero;
+#pragma GCC unroll 8
+    for (int k = 0; k < taps; k++)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(src[k] + x));
+        __m128i words = high ? _mm_unpackhi_epi8(bytes, zero) : _mm_unpacklo_epi8(bytes, zero);
+        v = _mm_add_epi16(v, _mm_mullo_epi16(words, _mm_set1_epi16(K->numerators[k])));
+    }
+    return _mm_mulhi_epu16(_mm_max_epi16(v, zero), _mm_set1_epi16(K->reciprocal));
+}
+
+__attribute__((target("sse4.1"), always_inline)) static inline unsigned char taps_fixed_body_sse41(
+    unsigned char *out, const unsigned char *const *src, int n, const FixedKernel *K, const int taps)
+{
+    __m128i top = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i bytes = _mm_packus_epi16(taps_fixed_words_sse41(src, x, 0, K, taps),
+                                         taps_fixed_words_sse41(src, x, 1, K, taps));
+        _mm_storeu_si128((__m128i *)(out + x), bytes);
+        top = _mm_max_epu8(top, bytes);
+    }
+
+    unsigned char tail = taps_fixed_tail(out, src, x, n, K);
+    unsigned char body = reduce_max_sse41(top);
+    return body > tail ? body : tail;
+}
+
+__attribute__((target("sse4.1"))) static unsigned char taps_fixed_sse41(unsigned char *out,
+                                                                        const unsigned char *const *src, int n,
+                                                                        const FixedKernel *K)
+{
+    SPECIALIZE_TAPS(taps_fixed_body_sse41, K->taps, out, src, n, K)
+}
+
+__attribute__((target("sse4.1"))) static void scale_fixed_sse41(unsigned char *buf, int n, unsigned short factor)
+{
+    __m128i f = _mm_set1_epi16(factor), zero = _mm_setzero_si128();
+    int x = 0;
+
+    // (x << 8) * factor >> 16 is x * factor >> 8
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + x));
+        __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, v), f);
+        __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, v), f);
+        _mm_storeu_si128((__m128i *)(buf + x), _mm_packus_epi16(_mm_min_epu16(lo, _mm_set1_epi16(255)),
+                                                                _mm_min_epu16(hi, _mm_set1_epi16(255))));
+    }
+
+    scale_fixed_scalar(buf + x, n - x, factor);
+}
+
+__attribute__((target("sse4.1"))) static void divide_fixed_sse41(unsigned char *out, const unsigned short *acc, int n,
+                                                                 int divisor)
+{
+    __m128i r = _mm_set1_epi16((65536 + divisor - 1) / divisor);
+    __m128i top = _mm_set1_epi16(255);
+    int x = 0;
+
+    for (; x + 16 <= n && divisor > 1; x += 16)
+    {
+        __m128i lo = _mm_mulhi_epu16(_mm_loadu_si128((const __m128i *)(acc + x)), r);
+        __m128i hi = _mm_mulhi_epu16(_mm_loadu_si128((const __m128i *)(acc + x + 8)), r);
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(_mm_min_epu16(lo, top), _mm_min_epu16(hi, top)));
+    }
+
+    divide_fixed_scalar(out + x, acc + x, n - x, divisor);
+}
+
+__attribute__((target("avx2"), always_inline)) static inline unsigned char taps_fixed_body_avx2(
+    unsigned char *out, const unsigned char *const *src, int n, const FixedKernel *K, const int taps)
+{
+    __m128i top = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m256i v = _mm256_setzero_si256();
+#pragma GCC unroll 8
+        for (int k = 0; k < taps; k++)
+        {
+            __m256i words = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src[k] + x)));
+            v = _mm256_add_epi16(v, _mm256_mullo_epi16(words, _mm256_set1_epi16(K->numerators[k])));
+        }
+        v = _mm256_mulhi_epu16(_mm256_max_epi16(v, _mm256_setzero_si256()), _mm256_set1_epi16(K->reciprocal));
+
+        __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storeu_si128((__m128i *)(out + x), bytes);
+        top = _mm_max_epu8(top, bytes);
+    }
+
+    unsigned char tail = taps_fixed_tail(out, src, x, n, K);
+    unsigned char body = reduce_max_sse41(top);
+    return body > tail ? body : tail;
+}
+
+__attribute__((target("avx2"))) static unsigned char taps_fixed_avx2(unsigned char *out,
+                                                                     const unsigned char *const *src, int n,
+                                                                     const FixedKernel *K)
+{
+    SPECIALIZE_TAPS(taps_fixed_body_avx2, K->taps, out, src, n, K)
+}
+
+__attribute__((target("avx2"))) static void scale_fixed_avx2(unsigned char *buf, int n, unsigned short factor)
+{
+    __m256i f = _mm256_set1_epi16(factor), top = _mm256_set1_epi16(255);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m256i v = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(buf + x))), 8);
+        v = _mm256_min_epu16(_mm256_mulhi_epu16(v, f), top);
+        _mm_storeu_si128((__m128i *)(buf + x), _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+    }
+
+    scale_fixed_scalar(buf + x, n - x, factor);
+}
+
+__attribute__((target("avx2"))) static void divide_fixed_avx2(unsigned char *out, const unsigned short *acc, int n,
+                                                              int divisor)
+{
+    __m256i r = _mm256_set1_epi16((65536 + divisor - 1) / divisor), top = _mm256_set1_epi16(255);
+    int x = 0;
+
+    for (; x + 16 <= n && divisor > 1; x += 16)
+    {
+        __m256i v = _mm256_min_epu16(_mm256_mulhi_epu16(_mm256_loadu_si256((const __m256i *)(acc + x)), r), top);
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+    }
+
+    divide_fixed_scalar(out + x, acc + x, n - x, divisor);
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline)) static inline unsigned char taps_fixed_body_avx512(
+    unsigned char *out, const unsigned char *const *src, int n, const FixedKernel *K, const int taps)
+{
+    __m256i top = _mm256_setzero_si256();
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32)
+    {
+        __m512i v = _mm512_setzero_si512();
+#pragma GCC unroll 8
+        for (int k = 0; k < taps; k++)
+        {
+            __m512i words = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(src[k] + x)));
+            v = _mm512_add_epi16(v, _mm512_mullo_epi16(words, _mm512_set1_epi16(K->numerators[k])));
+        }
+        v = _mm512_mulhi_epu16(_mm512_max_epi16(v, _mm512_setzero_si512()), _mm512_set1_epi16(K->reciprocal));
+
+        __m256i bytes = _mm512_cvtusepi16_epi8(v);
+        _mm256_storeu_si256((__m256i *)(out + x), bytes);
+        top = _mm256_max_epu8(top, bytes);
+    }
+
+    unsigned char tail = taps_fixed_tail(out, src, x, n, K);
+    unsigned char body = reduce_max_sse41(_mm_max_epu8(_mm256_castsi256_si128(top), _mm256_extracti128_si256(top, 1)));
+    return body > tail ? body : tail;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static unsigned char taps_fixed_avx512(unsigned char *out,
+                                                                                   const unsigned char *const *src,
+                                                                                   int n, const FixedKernel *K)
+{
+    SPECIALIZE_TAPS(taps_fixed_body_avx512, K->taps, out, src, n, K)
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void scale_fixed_avx512(unsigned char *buf, int n,
+                                                                           unsigned short factor)
+{
+    __m512i f = _mm512_set1_epi16(factor);
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32)
+    {
+        __m512i v = _mm512_slli_epi16(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(buf + x))), 8);
+        _mm256_storeu_si256((__m256i *)(buf + x), _mm512_cvtusepi16_epi8(_mm512_mulhi_epu16(v, f)));
+    }
+
+    scale_fixed_scalar(buf + x, n - x, factor);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void divide_fixed_avx512(unsigned char *out,
+                                                                            const unsigned short *acc, int n,
+                                                                            int divisor)
+{
+    __m512i r = _mm512_set1_epi16((65536 + divisor - 1) / divisor);
+    int x = 0;
+
+    for (; x + 32 <= n && divisor > 1; x += 32)
+    {
+        __m512i v = _mm512_mulhi_epu16(_mm512_loadu_si512(acc + x), r);
+        _mm256_storeu_si256((__m256i *)(out + x), _mm512_cvtusepi16_epi8(v));
+    }
+
+    divide_fixed_scalar(out + x, acc + x, n - x, divisor);
+}
+
+/* Turns float coefficients into int16 numerators over a common divisor, given as the Q16
+reciprocal of that divisor. Kernels that are exact fractions with a small denominator, like
+{1, 2, 1} / 3, are represented exactly. Anything else is rounded to the finest power of two
+denominator that keeps 255 * sum(|numerator|) inside int16. */
+FixedKernel quantize_kernel(const Kernel1D *K)
+{
+    FixedKernel fixed;
+    fixed.taps = K->taps;
+
+    float magnitude = 0;
+    for (int k = 0; k < K->taps; k++)
+        magnitude += fabsf(K->coefficients[k]);
+
+    // A divisor of 1 has no Q16 reciprocal, the numerators are doubled instead
+    for (int divisor = 2; divisor <= 64 && magnitude * divisor * 255 <= 32767; divisor++)
+    {
+        // The reciprocal overshoots 1 / divisor, which must not carry the largest sum into the next integer
+        int overshoot = (65536 + divisor - 1) / divisor * divisor - 65536;
+        int exact = magnitude * divisor * 255 * overshoot < 65536;
+        for (int k = 0; k < K->taps; k++)
+            exact &= fabsf(K->coefficients[k] * divisor - roundf(K->coefficients[k] * divisor)) < 1e-5f;
+
+        if (exact)
+        {
+            for (int k = 0; k < K->taps; k++)
+                fixed.numerators[k] = roundf(K->coefficients[k] * divisor);
+            fixed.reciprocal = (65536 + divisor - 1) / divisor;
+            return fixed;
+        }
+    }
+
+    int divisor = 2;
+    while (magnitude * divisor * 2 * 255 <= 32767 && divisor < 32768)
+        divisor *= 2;
+
+    for (int k = 0; k < K->taps; k++)
+        fixed.numerators[k] = roundf(K->coefficients[k] * divisor);
+    fixed.reciprocal = 65536 / divisor;
+    return fixed;
+}
+
+/* Parses a comma separated list of coefficients with an optional common divisor, for example
+"1,4,6,4,1/16". Returns 0 unless there is an odd number of taps, at most MAX_TAPS. */
+int parse_kernel(const char *text, Kernel1D *K)
+{
+    char *end;
+    K->taps = 0;
+
+    while (K->taps < MAX_TAPS)
+    {
+        K->coefficients[K->taps++] = strtof(text, &end);
+        if (end == text)
+            return 0;
+
+        text = end + 1;
+        if (*end != ',')
+            break;
+    }
+
+    if (*end == '/')
+    {
+        float divisor = strtof(text, &end);
+        if (end == text || divisor == 0)
+            return 0;
+        for (int k = 0; k < K->taps; k++)
+            K->coefficients[k] /= divisor;
+    }
+
+    return *end == '\0' && K->taps % 2 == 1;
+}
+
+static const Kernels kernels_scalar = {"scalar", 0, taps_scalar, scale_scalar, accumulate_scalar, divide_scalar,
+                                       pointwise_scalar, taps_fixed_scalar, scale_fixed_scalar, divide_fixed_scalar};
+static const Kernels kernels_sse41 = {"sse4.1", 0, taps_sse41, scale_sse41, accumulate_sse41, divide_sse41,
+                                      pointwise_sse41, taps_fixed_sse41, scale_fixed_sse41, divide_fixed_sse41};
+static const Kernels kernels_avx2 = {"avx2", 0, taps_avx2, scale_avx2, accumulate_avx2, divide_avx2,
+                                     pointwise_avx2, taps_fixed_avx2, scale_fixed_avx2, divide_fixed_avx2};
+static const Kernels kernels_avx512 = {"avx512", 0, taps_avx512, scale_avx512, accumulate_avx512, divide_avx512,
+                                       pointwise_avx512, taps_fixed_avx512, scale_fixed_avx512, divide_fixed_avx512};
+
+Kernels kernels = {"scalar", 0, taps_scalar, scale_scalar, accumulate_scalar, divide_scalar,
+                   pointwise_scalar, taps_fixed_scalar, scale_fixed_scalar, divide_fixed_scalar};
+
+static int is_supported(const Kernels *k)
+{
+    __builtin_cpu_init();
+    if (k == &kernels_avx512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    if (k == &kernels_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (k == &kernels_sse41)
+        return __builtin_cpu_supports("sse4.1");
+    return 1;
+}
+
+// Names of the instruction sets this CPU supports, widest first, returns how many there are
+int supported_isas(const char **names)
+{
+    const Kernels *candidates[] = {&kernels_avx512, &kernels_avx2, &kernels_sse41, &kernels_scalar};
+    int n = 0;
+    for (int i = 0; i < (int)(sizeof(candidates) / sizeof(candidates[0])); i++)
+        if (is_supported(candidates[i]))
+            names[n++] = candidates[i]->name;
+    return n;
+}
+
+/* Picks the kernels for the given instruction set, or the widest supported one when it is
+NULL or "auto". The CONV_ISA environment variable is used when no set is given explicitly.
+'fixed_point' makes the stages use the integer variants. */
+void select_kernels(const char *isa, int fixed_point)
+{
+    const Kernels *candidates[] = {&kernels_avx512, &kernels_avx2, &kernels_sse41, &kernels_scalar};
+    int count = sizeof(candidates) / sizeof(candidates[0]);
+
+    if (isa == NULL)
+        isa = getenv("CONV_ISA");
+
+    if (isa == NULL || strcmp(isa, "auto") == 0)
+    {
+        for (int i = 0; i < count; i++)
+            if (is_supported(candidates[i]))
+            {
+                kernels = *candidates[i];
+                kernels.fixed_point = fixed_point;
+                return;
+            }
+    }
+
+    for (int i = 0; i < count; i++)
+        if (strcmp(isa, candidates[i]->name) == 0)
+        {
+            if (!is_supported(candidates[i]))
+            {
+                fprintf(stderr, "Instruction set '%s' is not supported by this CPU\n", isa);
+                exit(EXIT_FAILURE);
+            }
+            kernels = *candidates[i];
+            kernels.fixed_point = fixed_point;
+            return;
+        }
+
+    fprintf(stderr, "Unknown instruction set '%s'\n", isa);
+    exit(EXIT_FAILURE);
+}
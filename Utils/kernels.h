@@ -0,0 +1,70 @@
+#ifndef KERNELS_H_
+#define KERNELS_H_
+
+#define MAX_TAPS 31
+
+// One dimensional kernel with an odd number of taps, centred on its middle tap
+typedef struct
+{
+    int taps;
+    float coefficients[MAX_TAPS];
+} Kernel1D;
+
+// A kernel as int16 numerators over a divisor, applied through the Q16 reciprocal of the divisor
+typedef struct
+{
+    int taps;
+    short numerators[MAX_TAPS];
+    unsigned short reciprocal;
+} FixedKernel;
+
+// Matrix of a 1x1 convolution, a row of 'inputs' weights per output, and a bias per output
+typedef struct
+{
+    int inputs;
+    int outputs;
+    float *weights;
+    float *bias;
+} Pointwise;
+
+/* Row kernels behind every stage, working on packed bytes. One implementation per instruction
+set is compiled in and the widest one the CPU supports is picked at startup, unless a specific
+one is forced with --isa or the CONV_ISA environment variable. All of them give the same bytes.
+The tap kernels have fully unrolled versions for 3, 5 and 7 taps and a generic loop for the rest.
+
+With --arith=fixed the stages use the int16 variants instead. Each stage is within 1 of its
+float counterpart on every channel and the decode is exact. With the default kernels a single
+iteration of the pipeline stays within 1, which the bench checks. Custom kernels carry the
+rounding of the vertical pass through the horizontal taps, and the normalization multiplies any
+difference by 255 / top, so they can be further off. Further iterations amplify the differences
+in the same way, the bench prints the maximum after each of its first 3. */
+typedef struct
+{
+    const char *name;
+    int fixed_point;
+    // out[x] = clamp(sum of src[k][x] * K[k]), returns the largest byte written
+    unsigned char (*taps)(unsigned char *out, const unsigned char *const *src, int n, const Kernel1D *K);
+    // buf[x] = clamp(factor * buf[x])
+    void (*scale)(unsigned char *buf, int n, float factor);
+    // acc[x] += src[x]
+    void (*accumulate)(unsigned short *acc, const unsigned char *src, int n);
+    // out[x] = clamp(acc[x] / divisor)
+    void (*divide)(unsigned char *out, const unsigned short *acc, int n, int divisor);
+    // out[o][x] = clamp(bias[o] + sum of src[k][x] * weights[o][k]) for every output, returns the largest byte written
+    unsigned char (*pointwise)(unsigned char *const *out, const unsigned char *const *src, int n, const Pointwise *P);
+
+    // Same as above with a kernel given by quantize_kernel
+    unsigned char (*taps_fixed)(unsigned char *out, const unsigned char *const *src, int n, const FixedKernel *K);
+    // buf[x] = min(255, buf[x] * factor >> 8)
+    void (*scale_fixed)(unsigned char *buf, int n, unsigned short factor);
+    void (*divide_fixed)(unsigned char *out, const unsigned short *acc, int n, int divisor);
+} Kernels;
+
+extern Kernels kernels;
+
+void select_kernels(const char *isa, int fixed_point);
+int supported_isas(const char **names);
+FixedKernel quantize_kernel(const Kernel1D *K);
+int parse_kernel(const char *text, Kernel1D *K);
+
+#endif // KERNELS_H_
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "numa.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Highest node number told apart in the reports, and pages asked about in one call
+#define MAX_NODES 64
+#define QUERY_PAGES 1024
+
+/* CPUs the process may run on, sorted by node then by number. The CPUs of the i-th node with
+any of them are cpus[node_first[i]] to cpus[node_first[i] + node_count[i] - 1]. */
+static struct
+{
+    int n_cpus;
+    int cpus[CPU_SETSIZE];
+    int node_of[CPU_SETSIZE];
+    int n_nodes;
+    int node_first[MAX_NODES];
+    int node_count[MAX_NODES];
+} topology;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+// CPU every thread id was last pinned to, -1 if never
+static int pinned[CPU_SETSIZE];
+
+// Marks the CPUs of a sysfs cpulist, like "0-3,8-11", as being on 'node'
+static void read_cpulist(const char *filename, int node)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+        return;
+
+    char list[4096];
+    if (fgets(list, sizeof(list), file))
+        for (char *p = list; *p >= '0' && *p <= '9';)
+        {
+            int first = strtol(p, &p, 10), last = first;
+            if (*p == '-')
+                last = strtol(p + 1, &p, 10);
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                topology.node_of[cpu] = node;
+            if (*p == ',')
+                p++;
+        }
+    fclose(file);
+}
+
+static void load_topology(void)
+{
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        topology.node_of[cpu] = -1;
+        pinned[cpu] = -1;
+    }
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)))
+    {
+        int node;
+        char filename[300];
+        if (sscanf(entry->d_name, "node%d", &node) == 1 && node < MAX_NODES)
+        {
+            snprintf(filename, sizeof(filename), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+            read_cpulist(filename, node);
+        }
+    }
+    if (dir)
+        closedir(dir);
+
+    // Taken before any thread is pinned, so it is the mask the process was started with
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        CPU_ZERO(&allowed);
+        for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &allowed);
+    }
+
+    for (int node = 0; node < MAX_NODES; node++)
+    {
+        int first = topology.n_cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            // Without a node in sysfs every CPU is on node 0
+            if (CPU_ISSET(cpu, &allowed) &&
+                (topology.node_of[cpu] == node || (node == 0 && topology.node_of[cpu] < 0)))
+            {
+                topology.node_of[cpu] = node;
+                topology.cpus[topology.n_cpus++] = cpu;
+            }
+        if (topology.n_cpus > first)
+        {
+            topology.node_first[topology.n_nodes] = first;
+            topology.node_count[topology.n_nodes++] = topology.n_cpus - first;
+        }
+    }
+}
+
+/* Pins the calling thread, the 'thread_id'-th of its team, to one CPU. Compact fills the CPUs
+of the first node before going on to the next one, scatter deals the threads to the nodes in
+turn. Returns the CPU, or -1 if the thread is left to the OS. */
+int pin_thread(int thread_id, int affinity)
+{
+    pthread_once(&topology_once, load_topology);
+    if (affinity == AFFINITY_NONE || topology.n_cpus == 0)
+        return -1;
+
+    int cpu;
+    if (affinity == AFFINITY_COMPACT)
+        cpu = topology.cpus[thread_id % topology.n_cpus];
+    else
+    {
+        int node = thread_id % topology.n_nodes;
+        int k = thread_id / topology.n_nodes % topology.node_count[node];
+        cpu = topology.cpus[topology.node_first[node] + k];
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        return -1;
+    if (thread_id < CPU_SETSIZE)
+        pinned[thread_id] = cpu;
+
+    return cpu;
+}
+
+// Node of a CPU, -1 if it isn't one the process may run on
+int cpu_node(int cpu)
+{
+    pthread_once(&topology_once, load_topology);
+    return cpu >= 0 && cpu < CPU_SETSIZE ? topology.node_of[cpu] : -1;
+}
+
+// Bytes mapped for an image, whole huge pages when it is large enough to get them
+static size_t placed_size(int height, int width, int pages, int *huge)
+{
+    size_t size = (size_t)height * width * sizeof(Channels);
+    size_t page = sysconf(_SC_PAGESIZE);
+    *huge = pages != PAGES_DEFAULT && size >= HUGE_PAGE_SIZE;
+    if (*huge)
+        page = HUGE_PAGE_SIZE;
+
+    return (size + page - 1) / page * page;
+}
+
+/* Image whose rows follow each other in a single anonymous mapping, none of its pages written
+yet. Huge pages from the hugetlb pool fall back to transparent ones when the pool is short. */
+Channels **new_placed_channel_array(int height, int width, int pages)
+{
+    int huge;
+    size_t size = placed_size(height, width, pages, &huge);
+
+    void *base = MAP_FAILED;
+    if (huge && pages == PAGES_HUGE)
+    {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED)
+            fprintf(stderr, "No %zu bytes of hugetlb pages, using transparent huge pages\n", size);
+    }
+    if (base == MAP_FAILED)
+    {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        if (huge)
+            madvise(base, size, MADV_HUGEPAGE);
+    }
+
+    Channels **img = malloc(height * sizeof(Channels *));
+    for (int i = 0; i < height; i++)
+        img[i] = (Channels *)base + (size_t)i * width;
+
+    return img;
+}
+
+void free_placed_channel_array(Channels **img, int height, int width, int pages)
+{
+    int huge;
+    munmap(img[0], placed_size(height, width, pages, &huge));
+    free(img);
+}
+
+// Zeroes the rows [start, end), which places their pages on the node of the calling thread
+void touch_rows(Channels **img, int width, int start, int end)
+{
+    for (int i = start; i < end; i++)
+        memset(img[i], 0, width * sizeof(Channels));
+}
+
+/* Prints, for every worker, the CPU it is pinned to and the nodes the pages of its band of the
+image are on, as move_pages finds them. */
+void print_band_nodes(Channels **img, int width, int height, int workers, TileShape shape)
+{
+    pthread_once(&topology_once, load_topology);
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    for (int w = 0; w < workers; w++)
+    {
+        int start, end;
+        scheduler_band(w, workers, 0, height, width, shape, &start, &end);
+
+        long counts[MAX_NODES] = {0}, absent = 0;
+        int known = 1;
+        if (start < end)
+        {
+            unsigned long first = (unsigned long)img[start] / page * page;
+            unsigned long last = (unsigned long)(img[end - 1] + width);
+            void *addresses[QUERY_PAGES];
+            int status[QUERY_PAGES];
+            for (unsigned long address = first; address < last && known;)
+            {
+                int n = 0;
+                for (; n < QUERY_PAGES && address < last; n++, address += page)
+                    addresses[n] = (void *)address;
+                // Without a target node move_pages only reports where every page is
+                known = syscall(SYS_move_pages, 0, n, addresses, NULL, status, 0) == 0;
+                for (int k = 0; k < n && known; k++)
+                    if (status[k] >= 0 && status[k] < MAX_NODES)
+                        counts[status[k]]++;
+                    else
+                        absent++;
+            }
+        }
+
+        char line[4096];
+        int length = snprintf(line, sizeof(line), "thread %d", w);
+        if (w < CPU_SETSIZE && pinned[w] >= 0)
+            length += snprintf(line + length, sizeof(line) - length, " on cpu %d (node %d)", pinned[w],
+                               cpu_node(pinned[w]));
+        length += snprintf(line + length, sizeof(line) - length, ", rows [%d, %d):", start, end);
+        if (!known)
+            length += snprintf(line + length, sizeof(line) - length, " nodes unknown");
+        const char *separator = " ";
+        for (int node = 0; node < MAX_NODES && known; node++)
+            if (counts[node])
+            {
+                length += snprintf(line + length, sizeof(line) - length, "%s%ld pages on node %d", separator,
+                                   counts[node], node);
+                separator = ", ";
+            }
+        if (absent && known)
+            snprintf(line + length, sizeof(line) - length, "%s%ld pages not resident", separator, absent);
+        fprintf(stderr, "%s\n", line);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include "scheduler.h"
+#include "utils.h"
+
+// Values of Options.affinity: threads left to the OS, packed on the CPUs of one node after the other, or dealt across the nodes
+#define AFFINITY_NONE 0
+#define AFFINITY_COMPACT 1
+#define AFFINITY_SCATTER 2
+
+// Values of Options.pages: base pages, transparent huge pages, or pages of the hugetlb pool
+#define PAGES_DEFAULT 0
+#define PAGES_THP 1
+#define PAGES_HUGE 2
+
+// Images smaller than a huge page keep base pages whatever is asked
+#define HUGE_PAGE_SIZE (2 << 20)
+
+/* Placement of the in-memory image. The NUMA topology is read from sysfs, without libnuma, and
+a machine without one is a single node holding every CPU. Linux puts a page on the node of the
+thread that first writes it, so the rows of an image from new_placed_channel_array are left
+untouched until the worker that starts a phase with them zeroes them in touch_rows. */
+int pin_thread(int thread_id, int affinity);
+int cpu_node(int cpu);
+Channels **new_placed_channel_array(int height, int width, int pages);
+void free_placed_channel_array(Channels **img, int height, int width, int pages);
+void touch_rows(Channels **img, int width, int start, int end);
+void print_band_nodes(Channels **img, int width, int height, int workers, TileShape shape);
+
+#endif // NUMA_H_
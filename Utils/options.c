@@ -0,0 +1,252 @@
+#include "options.h"
+#include "temporal.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void unknown_option(char *arg)
+{
+    fprintf(stderr, "Unknown option '%s'\n", arg);
+    exit(EXIT_FAILURE);
+}
+
+static Kernel1D kernel_option(char *arg, char *value)
+{
+    Kernel1D K;
+    if (!parse_kernel(value, &K))
+    {
+        fprintf(stderr, "Invalid kernel '%s', expected an odd number of up to %d taps\n", arg, MAX_TAPS);
+        exit(EXIT_FAILURE);
+    }
+    return K;
+}
+
+// Parses the flags starting at argv[first], anything not recognized aborts the run
+Options parse_options(int argc, char *argv[], int first)
+{
+    Options opts;
+    opts.fused = 1;
+    opts.isa = NULL;
+    opts.fixed_point = 0;
+    opts.vertical = (Kernel1D){3, {1.f / channel_count, 2.f / channel_count, 1.f / channel_count}};
+    opts.horizontal = (Kernel1D){3, {-1.f / channel_count, 0 / channel_count, 1.f / channel_count}};
+    opts.stream_rows = 0;
+    opts.tile = (TileShape){32, 0};
+    opts.stats = 0;
+    opts.temporal = 0;
+    opts.exchange = 0;
+    opts.grid = 0;
+    opts.expanded = 0;
+    opts.weights = NULL;
+    opts.batch = 0;
+    opts.queue_depth = 2;
+    opts.io_threads = 1;
+    opts.tune = 0;
+    opts.wisdom = NULL;
+    opts.affinity = AFFINITY_NONE;
+    opts.pages = PAGES_DEFAULT;
+    opts.planar = 0;
+    opts.given = 0;
+    int custom_kernels = 0;
+
+    for (int i = first; i < argc; i++)
+    {
+        char *arg = argv[i];
+
+        if (strcmp(arg, "--separable=fused") == 0)
+            opts.fused = 1;
+        else if (strcmp(arg, "--separable=split") == 0)
+            opts.fused = 0;
+        else if (strcmp(arg, "--depthwise=fused") == 0)
+        {
+            opts.expanded = 0;
+            opts.given |= GIVEN_DEPTHWISE;
+        }
+        else if (strcmp(arg, "--depthwise=expanded") == 0)
+        {
+            opts.expanded = 1;
+            opts.given |= GIVEN_DEPTHWISE;
+        }
+        else if (strcmp(arg, "--halo=ghost") == 0)
+            opts.exchange = 0;
+        else if (strcmp(arg, "--halo=exchange") == 0)
+            opts.exchange = 1;
+        else if (strcmp(arg, "--decomp=rows") == 0)
+            opts.grid = 0;
+        else if (strcmp(arg, "--decomp=grid") == 0)
+            opts.grid = 1;
+        else if (strncmp(arg, "--isa=", 6) == 0)
+        {
+            opts.isa = arg + 6;
+            opts.given |= GIVEN_ISA;
+        }
+        else if (strcmp(arg, "--arith=float") == 0)
+            opts.fixed_point = 0;
+        else if (strcmp(arg, "--arith=fixed") == 0)
+            opts.fixed_point = 1;
+        else if (strncmp(arg, "--vertical=", 11) == 0)
+        {
+            opts.vertical = kernel_option(arg, arg + 11);
+            custom_kernels = 1;
+        }
+        else if (strncmp(arg, "--horizontal=", 13) == 0)
+        {
+            opts.horizontal = kernel_option(arg, arg + 13);
+            custom_kernels = 1;
+        }
+        else if (strncmp(arg, "--stream=", 9) == 0)
+        {
+            opts.stream_rows = atoi(arg + 9);
+            if (opts.stream_rows <= 0)
+            {
+                fprintf(stderr, "Invalid strip height '%s'\n", arg);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(arg, "--tile=", 7) == 0)
+        {
+            // ROWSxCOLS, or only ROWS for tiles as wide as the image
+            opts.tile.cols = 0;
+            if (sscanf(arg + 7, "%dx%d", &opts.tile.rows, &opts.tile.cols) < 1 || opts.tile.rows <= 0 ||
+                opts.tile.cols < 0)
+            {
+                fprintf(stderr, "Invalid tile shape '%s'\n", arg);
+                exit(EXIT_FAILURE);
+            }
+            opts.given |= GIVEN_TILE;
+        }
+        else if (strncmp(arg, "--weights=", 10) == 0)
+            opts.weights = arg + 10;
+        else if (strcmp(arg, "--batch") == 0)
+            opts.batch = 1;
+        else if (strncmp(arg, "--queue=", 8) == 0)
+        {
+            opts.queue_depth = atoi(arg + 8);
+            if (opts.queue_depth <= 0)
+            {
+                fprintf(stderr, "Invalid queue depth '%s'\n", arg);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strncmp(arg, "--io-threads=", 13) == 0)
+        {
+            opts.io_threads = atoi(arg + 13);
+            if (opts.io_threads <= 0)
+            {
+                fprintf(stderr, "Invalid number of I/O threads '%s'\n", arg);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(arg, "--stats") == 0)
+            opts.stats = 1;
+        else if (strcmp(arg, "--tune") == 0)
+            opts.tune = 1;
+        else if (strncmp(arg, "--wisdom=", 9) == 0)
+            opts.wisdom = arg + 9;
+        else if (strcmp(arg, "--affinity=none") == 0)
+            opts.affinity = AFFINITY_NONE;
+        else if (strcmp(arg, "--affinity=compact") == 0)
+            opts.affinity = AFFINITY_COMPACT;
+        else if (strcmp(arg, "--affinity=scatter") == 0)
+            opts.affinity = AFFINITY_SCATTER;
+        else if (strcmp(arg, "--pages=default") == 0)
+            opts.pages = PAGES_DEFAULT;
+        else if (strcmp(arg, "--pages=thp") == 0)
+            opts.pages = PAGES_THP;
+        else if (strcmp(arg, "--pages=huge") == 0)
+            opts.pages = PAGES_HUGE;
+        else if (strcmp(arg, "--layout=packed") == 0)
+            opts.planar = 0;
+        else if (strcmp(arg, "--layout=planar") == 0)
+            opts.planar = 1;
+        else if (strncmp(arg, "--temporal=", 11) == 0)
+        {
+            opts.temporal = atoi(arg + 11);
+            if (opts.temporal <= 0 || opts.temporal > TEMPORAL_MAX_DEPTH)
+            {
+                fprintf(stderr, "Invalid temporal depth '%s', expected 1 to %d\n", arg, TEMPORAL_MAX_DEPTH);
+                exit(EXIT_FAILURE);
+            }
+            opts.given |= GIVEN_TEMPORAL;
+        }
+        else
+            unknown_option(arg);
+    }
+
+    // The split passes only implement the default 3 tap kernels
+    if (custom_kernels && !opts.fused)
+    {
+        fprintf(stderr, "Custom kernels need --separable=fused\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Streaming runs the spatial stage through the fused engine only
+    if (opts.stream_rows && !opts.fused)
+    {
+        fprintf(stderr, "--stream needs --separable=fused\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Tiles are taken through the iterations by the fused engine, streamed strips already are
+    if (opts.temporal && (!opts.fused || opts.stream_rows))
+    {
+        fprintf(stderr, "--temporal needs --separable=fused and can't be combined with --stream\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Streamed strips already carry their own halo through the files
+    if (opts.exchange && opts.stream_rows)
+    {
+        fprintf(stderr, "--halo=exchange can't be combined with --stream\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The blocks of a grid always exchange their halos before every stage, through the fused engine
+    if (opts.grid && (!opts.fused || opts.stream_rows))
+    {
+        fprintf(stderr, "--decomp=grid needs --separable=fused and can't be combined with --stream\n");
+        exit(EXIT_FAILURE);
+    }
+    if (opts.grid)
+        opts.exchange = 1;
+
+    // Every image of a batch is held whole, which is what streaming avoids
+    if (opts.batch && opts.stream_rows)
+    {
+        fprintf(stderr, "--batch can't be combined with --stream\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The search runs the whole pipeline over the image in memory, a batch has many shapes
+    if (opts.tune && (opts.stream_rows || opts.batch || !opts.fused))
+    {
+        fprintf(stderr, "--tune needs a single image in memory and --separable=fused\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only the image of a single in-memory run is placed, streamed strips and batch images are not
+    if (opts.pages != PAGES_DEFAULT && (opts.stream_rows || opts.batch))
+    {
+        fprintf(stderr, "--pages needs a single image in memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The depthwise kernels of a learned layer run along the rows, past any column split
+    if (opts.weights && (opts.tile.cols || opts.grid))
+    {
+        fprintf(stderr, "--weights needs tiles of whole rows and --decomp=rows\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The planes only hold the 3 channels of a single image in memory, which the fused stages never expand
+    if (opts.planar && (!opts.fused || opts.expanded || opts.weights || opts.temporal || opts.stream_rows ||
+                        opts.batch || opts.tune || opts.pages != PAGES_DEFAULT))
+    {
+        fprintf(stderr, "--layout=planar needs a single image in memory, --separable=fused and --depthwise=fused, "
+                        "and can't be combined with --weights, --temporal, --tune or --pages\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return opts;
+}
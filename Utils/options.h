@@ -0,0 +1,63 @@
+#ifndef OPTIONS_H_
+#define OPTIONS_H_
+
+#include "kernels.h"
+#include "numa.h"
+#include "scheduler.h"
+
+// Bits of Options.given, for the flags the wisdom of --tune never overrides
+#define GIVEN_ISA 1
+#define GIVEN_TILE 2
+#define GIVEN_DEPTHWISE 4
+#define GIVEN_TEMPORAL 8
+
+// Optional '--name=value' flags accepted after the positional arguments of every backend
+typedef struct
+{
+    // Apply the spatial kernels in one fused sweep instead of two separate passes
+    int fused;
+    // Instruction set of the row kernels, NULL picks it from CONV_ISA or the CPU
+    char *isa;
+    // Run the stages in int16 fixed point instead of float
+    int fixed_point;
+    // Kernels of the spatial separable convolution
+    Kernel1D vertical;
+    Kernel1D horizontal;
+    // Height of the strips of the out-of-core streaming mode, 0 loads the whole image
+    int stream_rows;
+    // Shape of the tiles handed out by the work stealing scheduler
+    TileShape tile;
+    // Print how many tiles every thread executed and stole
+    int stats;
+    // Write the expanded channels of the depthwise encode into the image instead of decoding on the fly
+    int expanded;
+    // Weight file of a learned layer replacing the encode and decode, NULL keeps them
+    char *weights;
+    // Process every image of a directory, glob or manifest instead of a single one
+    int batch;
+    // Images waiting between two stages of the batch pipeline, and reader and writer threads each
+    int queue_depth;
+    int io_threads;
+    // Iterations a tile goes through while it is in cache, 0 runs every stage over the whole image
+    int temporal;
+    // MPI only, exchange taps / 2 halo rows with the neighbours before every spatial stage instead of one deep ghost zone
+    int exchange;
+    // MPI only, split the image into a 2D grid of blocks instead of bands of whole rows
+    int grid;
+    // Search the fastest configuration for the image and store it in the wisdom file
+    int tune;
+    // Wisdom file, NULL takes it from CONV_WISDOM or ~/.conv_wisdom
+    char *wisdom;
+    // AFFINITY_* pinning of the worker threads
+    int affinity;
+    // PAGES_* backing of the image in memory
+    int pages;
+    // pthreads only, keep the image in memory as 3 planes instead of Channels rows
+    int planar;
+    // GIVEN_* bits of the flags that were on the command line
+    int given;
+} Options;
+
+Options parse_options(int argc, char *argv[], int first);
+
+#endif // OPTIONS_H_
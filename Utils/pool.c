@@ -0,0 +1,142 @@
+#include "pool.h"
+#include "trace.h"
+#include <stdlib.h>
+
+typedef struct
+{
+    ThreadPool *pool;
+    int thread_id;
+} PoolWorker;
+
+// Workers wait on the start barrier for the next job, a NULL job shuts them down
+static void *pool_worker(void *var)
+{
+    ThreadPool *pool = ((PoolWorker *)var)->pool;
+    int thread_id = ((PoolWorker *)var)->thread_id;
+    free(var);
+
+    // The barriers are only sized once all the threads that could be started are
+    pthread_mutex_lock(&pool->creating);
+    pthread_mutex_unlock(&pool->creating);
+
+    for (;;)
+    {
+        pthread_barrier_wait(&pool->start);
+        if (!pool->job)
+            break;
+        pool->job(pool->arg, thread_id);
+        pthread_barrier_wait(&pool->phase);
+    }
+
+    return NULL;
+}
+
+/* Returns NULL if the memory or any of the threads can't be had, the threads that did start are
+then shut down again. */
+ThreadPool *new_thread_pool(int n_threads)
+{
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+    if (!pool)
+        return NULL;
+    pool->tid = malloc(n_threads * sizeof(pthread_t));
+    pool->slots = aligned_alloc(sizeof(PoolSlot), 2 * n_threads * sizeof(PoolSlot));
+    pool->rounds = calloc(n_threads, sizeof(int));
+    pool->job = NULL;
+    if (!pool->tid || !pool->slots || !pool->rounds)
+    {
+        free(pool->tid);
+        free(pool->slots);
+        free(pool->rounds);
+        free(pool);
+        return NULL;
+    }
+
+    TRACE_BEGIN("new_thread_pool");
+    pthread_mutex_init(&pool->creating, NULL);
+    pthread_mutex_lock(&pool->creating);
+    int started = 1;
+    for (int t = 1; t < n_threads && started == t; t++)
+    {
+        PoolWorker *worker = malloc(sizeof(PoolWorker));
+        if (worker)
+            *worker = (PoolWorker){pool, t};
+        if (worker && pthread_create(&pool->tid[t], NULL, pool_worker, worker) == 0)
+            started++;
+        else
+            free(worker);
+    }
+    pool->n_threads = started;
+    pthread_barrier_init(&pool->start, NULL, started);
+    pthread_barrier_init(&pool->phase, NULL, started);
+    pthread_mutex_unlock(&pool->creating);
+    TRACE_END();
+
+    if (started < n_threads)
+    {
+        free_thread_pool(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void free_thread_pool(ThreadPool *pool)
+{
+    pool->job = NULL;
+    pthread_barrier_wait(&pool->start);
+    for (int t = 1; t < pool->n_threads; t++)
+        pthread_join(pool->tid[t], NULL);
+
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->phase);
+    pthread_mutex_destroy(&pool->creating);
+    free(pool->tid);
+    free(pool->slots);
+    free(pool->rounds);
+    free(pool);
+}
+
+// Runs 'job' on every thread of the pool and returns once all of them are done
+void pool_run(ThreadPool *pool, void (*job)(void *arg, int thread_id), void *arg)
+{
+    pool->job = job;
+    pool->arg = arg;
+    pthread_barrier_wait(&pool->start);
+    job(arg, 0);
+    pthread_barrier_wait(&pool->phase);
+}
+
+// Waits for all the threads of the running job
+void pool_barrier(ThreadPool *pool)
+{
+    TRACE_BEGIN("pool_barrier");
+    pthread_barrier_wait(&pool->phase);
+    TRACE_END();
+}
+
+/* Barrier that also returns the largest 'value' given by any thread. The slots alternate
+between two sets, a thread can only write a set again after everyone left the barrier that
+read it. */
+int pool_reduce_max(ThreadPool *pool, int thread_id, int value)
+{
+    PoolSlot *slots = pool->slots + (pool->rounds[thread_id]++ & 1) * pool->n_threads;
+    slots[thread_id].value = value;
+    TRACE_BEGIN("pool_reduce_max");
+    pthread_barrier_wait(&pool->phase);
+    TRACE_END();
+
+    int top = slots[0].value;
+    for (int t = 1; t < pool->n_threads; t++)
+        if (slots[t].value > top)
+            top = slots[t].value;
+
+    return top;
+}
+
+// Splits the rows [first, last) evenly between the threads of the pool
+void pool_band(ThreadPool *pool, int thread_id, int first, int last, int *start, int *end)
+{
+    int band = (last - first + pool->n_threads - 1) / pool->n_threads;
+    *start = first + thread_id * band < last ? first + thread_id * band : last;
+    *end = *start + band < last ? *start + band : last;
+}
@@ -0,0 +1,38 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+
+// Padded to a cache line, so the threads publishing their values don't share one
+typedef struct
+{
+    int value;
+    char padding[60];
+} PoolSlot;
+
+/* Persistent pool of worker threads, created once per process. Between jobs the workers are
+parked on a barrier. A job runs on every thread of the pool at once, the calling thread
+being thread 0, and its phases are separated with pool_barrier or pool_reduce_max. */
+typedef struct
+{
+    int n_threads;
+    pthread_t *tid;
+    pthread_barrier_t start;
+    pthread_barrier_t phase;
+    // Held while the threads are being started
+    pthread_mutex_t creating;
+    void (*job)(void *arg, int thread_id);
+    void *arg;
+    // Two sets of slots, alternated by every reduction, each one n_threads long
+    PoolSlot *slots;
+    int *rounds;
+} ThreadPool;
+
+ThreadPool *new_thread_pool(int n_threads);
+void free_thread_pool(ThreadPool *pool);
+void pool_run(ThreadPool *pool, void (*job)(void *arg, int thread_id), void *arg);
+void pool_barrier(ThreadPool *pool);
+int pool_reduce_max(ThreadPool *pool, int thread_id, int value);
+void pool_band(ThreadPool *pool, int thread_id, int first, int last, int *start, int *end);
+
+#endif // POOL_H_
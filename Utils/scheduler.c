@@ -0,0 +1,156 @@
+#include "scheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PACK_RANGE(head, tail) ((unsigned long long)(head) << 32 | (unsigned)(tail))
+#define RANGE_HEAD(range) ((int)((range) >> 32))
+#define RANGE_TAIL(range) ((int)((range)&0xffffffffu))
+
+// Returns NULL if the memory can't be had
+TileScheduler *new_tile_scheduler(int max_workers)
+{
+    TileScheduler *s = malloc(sizeof(TileScheduler));
+    if (!s)
+        return NULL;
+    s->max_workers = max_workers;
+    s->deques = aligned_alloc(sizeof(WorkerDeque), max_workers * sizeof(WorkerDeque));
+    if (!s->deques)
+    {
+        free(s);
+        return NULL;
+    }
+    for (int w = 0; w < max_workers; w++)
+    {
+        atomic_init(&s->deques[w].range, 0);
+        s->deques[w].workers = 0;
+        s->deques[w].executed = 0;
+        s->deques[w].stolen = 0;
+    }
+
+    return s;
+}
+
+void free_tile_scheduler(TileScheduler *s)
+{
+    free(s->deques);
+    free(s);
+}
+
+static TileGrid tile_grid(int first, int last, int width, TileShape shape)
+{
+    if (shape.cols <= 0 || shape.cols > width)
+        shape.cols = width;
+    if (shape.rows <= 0)
+        shape.rows = 1;
+
+    TileGrid grid = {first, last, width, shape};
+    grid.tiles_per_row = (width + shape.cols - 1) / shape.cols;
+    grid.n_tiles = last > first ? (last - first + shape.rows - 1) / shape.rows * grid.tiles_per_row : 0;
+
+    return grid;
+}
+
+// Number of tiles of the rows [first, last), their indices are below this
+int tile_count(int first, int last, int width, TileShape shape)
+{
+    return tile_grid(first, last, width, shape).n_tiles;
+}
+
+/* Rows [*start, *end) of the tiles 'worker' claims first in a phase over the rows [first, last),
+where its data is best placed. The bands of the workers follow each other without overlapping. */
+void scheduler_band(int worker, int workers, int first, int last, int width, TileShape shape, int *start, int *end)
+{
+    TileGrid grid = tile_grid(first, last, width, shape);
+    int bounds[2];
+    for (int k = 0; k < 2; k++)
+    {
+        long index = (long)grid.n_tiles * (worker + k) / workers;
+        int row = grid.first + index / grid.tiles_per_row * grid.shape.rows;
+        bounds[k] = row < last ? row : last;
+    }
+    *start = bounds[0];
+    *end = worker + 1 < workers ? bounds[1] : last;
+}
+
+/* Starts a phase for 'worker', one of the 'workers' running it, by claiming its block of the
+tiles of the rows [first, last). */
+void scheduler_begin(TileScheduler *s, int worker, int workers, int first, int last, int width, TileShape shape)
+{
+    WorkerDeque *own = &s->deques[worker];
+    own->workers = workers;
+    own->grid = tile_grid(first, last, width, shape);
+
+    long n_tiles = own->grid.n_tiles;
+    atomic_store(&own->range, PACK_RANGE(n_tiles * worker / workers, n_tiles * (worker + 1) / workers));
+}
+
+static void tile_at(TileGrid *grid, int index, Tile *tile)
+{
+    int row = index / grid->tiles_per_row;
+    int col = index % grid->tiles_per_row;
+
+    tile->index = index;
+    tile->row = grid->first + row * grid->shape.rows;
+    tile->col = col * grid->shape.cols;
+    tile->rows = grid->last - tile->row < grid->shape.rows ? grid->last - tile->row : grid->shape.rows;
+    tile->cols = grid->width - tile->col < grid->shape.cols ? grid->width - tile->col : grid->shape.cols;
+}
+
+// Takes the back half of the victim's block, returns how many tiles it got into [*head, *tail)
+static int steal(WorkerDeque *victim, int *head, int *tail)
+{
+    unsigned long long range = atomic_load(&victim->range);
+    for (;;)
+    {
+        int h = RANGE_HEAD(range), t = RANGE_TAIL(range);
+        if (h >= t)
+            return 0;
+
+        int mid = t - (t - h + 1) / 2;
+        if (atomic_compare_exchange_weak(&victim->range, &range, PACK_RANGE(h, mid)))
+        {
+            *head = mid;
+            *tail = t;
+            return t - mid;
+        }
+    }
+}
+
+// Hands the next tile to 'worker', stealing once its own block is empty. Returns 0 when the phase is over.
+int scheduler_next(TileScheduler *s, int worker, Tile *tile)
+{
+    WorkerDeque *own = &s->deques[worker];
+    unsigned long long range = atomic_load(&own->range);
+
+    for (;;)
+    {
+        while (RANGE_HEAD(range) < RANGE_TAIL(range))
+            if (atomic_compare_exchange_weak(&own->range, &range,
+                                             PACK_RANGE(RANGE_HEAD(range) + 1, RANGE_TAIL(range))))
+            {
+                tile_at(&own->grid, RANGE_HEAD(range), tile);
+                own->executed++;
+                return 1;
+            }
+
+        // Visit the other workers starting from the next one, so thieves spread over the victims
+        int head, tail, stolen = 0;
+        for (int v = 1; v < own->workers && !stolen; v++)
+            stolen = steal(&s->deques[(worker + v) % own->workers], &head, &tail);
+        if (!stolen)
+            return 0;
+
+        // Only this worker adds to its own block, thieves have seen it empty and left it alone
+        own->stolen += stolen;
+        range = PACK_RANGE(head, tail);
+        atomic_store(&own->range, range);
+    }
+}
+
+// Prints how many tiles every worker executed and how many of those it stole
+void print_scheduler_stats(TileScheduler *s)
+{
+    for (int w = 0; w < s->max_workers; w++)
+        fprintf(stderr, "thread %d: %ld tiles executed, %ld stolen\n", w, s->deques[w].executed,
+                s->deques[w].stolen);
+}
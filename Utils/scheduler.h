@@ -0,0 +1,74 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdatomic.h>
+#include "utils.h"
+
+// Rows x columns of a tile, 0 columns spans the whole width
+typedef struct
+{
+    int rows;
+    int cols;
+} TileShape;
+
+typedef struct
+{
+    int index;
+    int row;
+    int col;
+    int rows;
+    int cols;
+} Tile;
+
+// Tiles covering the rows [first, last) of an image 'width' pixels wide
+typedef struct
+{
+    int first;
+    int last;
+    int width;
+    TileShape shape;
+    int tiles_per_row;
+    int n_tiles;
+} TileGrid;
+
+// Padded to two cache lines, every worker only writes its own
+typedef struct
+{
+    // The tiles [head, tail) a worker still owns, packed as head << 32 | tail
+    _Atomic unsigned long long range;
+    // Workers taking part in the current phase and its tiles, as seen by the owner
+    int workers;
+    TileGrid grid;
+    long executed;
+    long stolen;
+    char padding[128 - 8 - 4 - sizeof(TileGrid) - 2 * sizeof(long)];
+} WorkerDeque;
+
+/* Work stealing scheduler over the tiles of a band of rows. Every phase starts with each worker
+claiming a contiguous block of the tiles in scheduler_begin, which it then takes from the front.
+Once its block is empty it steals the back half of the block of another worker. Tiles are never
+added during a phase, so a deque is only a range of tile indices updated with compare and swap.
+All the workers of a phase have to pass the same tiles, and a phase has to be over for every
+worker before any of them begins the next one. */
+typedef struct
+{
+    int max_workers;
+    WorkerDeque *deques;
+} TileScheduler;
+
+TileScheduler *new_tile_scheduler(int max_workers);
+void free_tile_scheduler(TileScheduler *s);
+int tile_count(int first, int last, int width, TileShape shape);
+void scheduler_begin(TileScheduler *s, int worker, int workers, int first, int last, int width, TileShape shape);
+void scheduler_band(int worker, int workers, int first, int last, int width, TileShape shape, int *start, int *end);
+int scheduler_next(TileScheduler *s, int worker, Tile *tile);
+void print_scheduler_stats(TileScheduler *s);
+
+// Points 'view' at the tile, so the row helpers can work on it as if it was a whole image
+static inline void tile_view(Channels **img, Tile *tile, Channels **view)
+{
+    for (int i = 0; i < tile->rows; i++)
+        view[i] = img[tile->row + i] + tile->col;
+}
+
+#endif // SCHEDULER_H_
@@ -0,0 +1,282 @@
+#include "separable.h"
+#include "stages.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Copies the RGB channels of a row into a packed line, rows outside the image are read as 0
+static void load_row(unsigned char *dst, Channels **img, int row, int first, int last, int width)
+{
+    if (row < first || row >= last)
+    {
+        memset(dst, 0, width * channel_count);
+        return;
+    }
+
+    pack_channels(dst, img[row], width, 0);
+}
+
+// Copies a row of every plane into a line, one after the other, rows outside the image are read as 0
+static void load_planes(unsigned char *dst, Image *img, int row)
+{
+    if (row < 0 || row >= img->height)
+    {
+        memset(dst, 0, img->width * channel_count);
+        return;
+    }
+
+    for (int c = 0; c < channel_count; c++)
+        memcpy(dst + c * img->width, image_row(img, c, row), img->width);
+}
+
+// Every part of the workspace starts on its own cache line
+static size_t cache_lines(size_t bytes)
+{
+    return (bytes + 63) / 64 * 64;
+}
+
+static size_t line_bytes(int pixels)
+{
+    return cache_lines((size_t)pixels * channel_count);
+}
+
+// Bytes a workspace takes, lines included
+size_t fused_workspace_size(int width, Kernel1D *vertical, Kernel1D *horizontal)
+{
+    int lines = vertical->taps + vertical->taps / 2 + 1;
+    return cache_lines(sizeof(FusedWorkspace)) + lines * line_bytes(width) + line_bytes(width + horizontal->taps - 1);
+}
+
+/* Lays a workspace out in 'memory', which has to hold fused_workspace_size bytes, so workspaces
+can come out of a run's arena as well as from malloc. */
+FusedWorkspace *place_fused_workspace(void *memory, int width, Kernel1D *vertical, Kernel1D *horizontal)
+{
+    FusedWorkspace *ws = memory;
+    unsigned char *next = (unsigned char *)memory + cache_lines(sizeof(FusedWorkspace));
+    ws->width = width;
+    ws->first_col = 0;
+    ws->last_col = width;
+    ws->vertical = *vertical;
+    ws->horizontal = *horizontal;
+    ws->vertical_fixed = quantize_kernel(vertical);
+    ws->horizontal_fixed = quantize_kernel(horizontal);
+
+    for (int r = 0; r < vertical->taps; r++, next += line_bytes(width))
+        ws->ring[r] = next;
+    for (int r = 0; r < vertical->taps / 2; r++, next += line_bytes(width))
+        ws->below[r] = next;
+    ws->out = next;
+    next += line_bytes(width);
+
+    // The vertical line is bordered with 0 pixels on each side for the horizontal kernel
+    ws->line = next;
+    memset(ws->line, 0, line_bytes(width + horizontal->taps - 1));
+
+    return ws;
+}
+
+FusedWorkspace *new_fused_workspace(int width, Kernel1D *vertical, Kernel1D *horizontal)
+{
+    void *memory = aligned_alloc(64, fused_workspace_size(width, vertical, horizontal));
+    return place_fused_workspace(memory, width, vertical, horizontal);
+}
+
+void free_fused_workspace(FusedWorkspace *ws)
+{
+    free(ws);
+}
+
+/* Snapshots the rows just outside the band [start, end). When several workers share one
+image, every worker has to capture its halo before any of them starts writing. */
+void fused_capture_halo(FusedWorkspace *ws, Channels **img, int first, int last, int start, int end)
+{
+    int radius = ws->vertical.taps / 2;
+
+    for (int r = 0; r < radius; r++)
+    {
+        load_row(ws->ring[r], img, start - radius + r, first, last, ws->width);
+        load_row(ws->below[r], img, end + r, first, last, ws->width);
+    }
+}
+
+// Bytes taken by the halo of one band when it is kept outside of a workspace
+size_t fused_halo_size(int width, Kernel1D *vertical)
+{
+    return (size_t)2 * (vertical->taps / 2) * width * channel_count;
+}
+
+/* Same as fused_capture_halo, but into 'halo' instead of the workspace. Schedulers that hand
+out the bands of a pass dynamically don't know which worker will run a band, so they capture
+all of them first and load each one with fused_load_halo right before it is processed. */
+void fused_store_halo(FusedWorkspace *ws, Channels **img, int first, int last, int start, int end,
+                      unsigned char *halo)
+{
+    int radius = ws->vertical.taps / 2;
+    int line_size = ws->width * channel_count;
+
+    for (int r = 0; r < radius; r++)
+    {
+        load_row(halo + r * line_size, img, start - radius + r, first, last, ws->width);
+        load_row(halo + (radius + r) * line_size, img, end + r, first, last, ws->width);
+    }
+}
+
+void fused_load_halo(FusedWorkspace *ws, const unsigned char *halo)
+{
+    int radius = ws->vertical.taps / 2;
+    int line_size = ws->width * channel_count;
+
+    for (int r = 0; r < radius; r++)
+    {
+        memcpy(ws->ring[r], halo + r * line_size, line_size);
+        memcpy(ws->below[r], halo + (radius + r) * line_size, line_size);
+    }
+}
+
+/* Applies the vertical and then the horizontal kernel to the rows [start, end) of the image in
+a single sweep, returning the top of the distribution. Only the rows [first, last) hold image
+data, the rest are treated as 0 and are also written as 0. */
+int conv_separable_fused(FusedWorkspace *ws, Channels **img, int first, int last, int start, int end)
+{
+    int width = ws->width;
+    int line_size = width * channel_count;
+    int radius = ws->vertical.taps / 2;
+    int border = ws->horizontal.taps / 2;
+    unsigned char *line = ws->line + border * channel_count;
+    int offset = ws->first_col * channel_count;
+    int out_size = (ws->last_col - ws->first_col) * channel_count;
+    int top = 0;
+
+    // window[k] holds the original row i - radius + k, the first 'radius' of them were captured
+    unsigned char *window[MAX_TAPS];
+    const unsigned char *shifted[MAX_TAPS];
+    for (int k = 0; k < ws->vertical.taps; k++)
+        window[k] = ws->ring[k];
+    for (int k = 0; k < ws->horizontal.taps; k++)
+        shifted[k] = line + offset + (k - border) * channel_count;
+
+    for (int row = start; row < start + radius; row++)
+        if (row < end)
+            load_row(window[radius + row - start], img, row, first, last, width);
+        else
+            memcpy(window[radius + row - start], ws->below[row - end], line_size);
+
+    for (int i = start; i < end; i++)
+    {
+        int next = i + radius;
+        if (next < end)
+            load_row(window[2 * radius], img, next, first, last, width);
+        else
+            memcpy(window[2 * radius], ws->below[next - end], line_size);
+
+        if (i < first || i >= last)
+        {
+            for (int j = 0; j < width; j++)
+                for (int c = 0; c < channel_count; c++)
+                    img[i][j].channel[c] = 0;
+        }
+        else
+        {
+            const unsigned char *const *rows = (const unsigned char *const *)window;
+            unsigned char row_top;
+            if (kernels.fixed_point)
+            {
+                kernels.taps_fixed(line, rows, line_size, &ws->vertical_fixed);
+                row_top = kernels.taps_fixed(ws->out, shifted, out_size, &ws->horizontal_fixed);
+            }
+            else
+            {
+                kernels.taps(line, rows, line_size, &ws->vertical);
+                row_top = kernels.taps(ws->out, shifted, out_size, &ws->horizontal);
+            }
+            if (row_top > top)
+                top = row_top;
+
+            unpack_channels(img[i] + ws->first_col, ws->out, ws->last_col - ws->first_col, 0);
+        }
+
+        // Slide the window, the original row i is still needed by the rows below it
+        unsigned char *oldest = window[0];
+        for (int k = 0; k < 2 * radius; k++)
+            window[k] = window[k + 1];
+        window[2 * radius] = oldest;
+    }
+
+    return top;
+}
+
+void fused_store_halo_planar(FusedWorkspace *ws, Image *img, int start, int end, unsigned char *halo)
+{
+    int radius = ws->vertical.taps / 2;
+    int line_size = ws->width * channel_count;
+
+    for (int r = 0; r < radius; r++)
+    {
+        load_planes(halo + r * line_size, img, start - radius + r);
+        load_planes(halo + (radius + r) * line_size, img, end + r);
+    }
+}
+
+/* conv_separable_fused over the rows [start, end) of the planes, whose rows are contiguous, so
+they are copied into the window as they are and the horizontal kernel writes straight into
+them. The kernels run on each plane in turn. Returns the top of the distribution. */
+int conv_separable_planar(FusedWorkspace *ws, Image *img, int start, int end)
+{
+    int width = ws->width;
+    int radius = ws->vertical.taps / 2;
+    int border = ws->horizontal.taps / 2;
+    unsigned char *line = ws->line + border;
+    int top = 0;
+
+    unsigned char *window[MAX_TAPS];
+    const unsigned char *rows[MAX_TAPS];
+    const unsigned char *shifted[MAX_TAPS];
+    for (int k = 0; k < ws->vertical.taps; k++)
+        window[k] = ws->ring[k];
+    for (int k = 0; k < ws->horizontal.taps; k++)
+        shifted[k] = line + k - border;
+    // A plane takes only a third of the line, the horizontal kernel reads 0 past its end
+    memset(line + width, 0, border);
+
+    for (int row = start; row < start + radius; row++)
+        if (row < end)
+            load_planes(window[radius + row - start], img, row);
+        else
+            memcpy(window[radius + row - start], ws->below[row - end], width * channel_count);
+
+    for (int i = start; i < end; i++)
+    {
+        int next = i + radius;
+        if (next < end)
+            load_planes(window[2 * radius], img, next);
+        else
+            memcpy(window[2 * radius], ws->below[next - end], width * channel_count);
+
+        for (int c = 0; c < channel_count; c++)
+        {
+            for (int k = 0; k < ws->vertical.taps; k++)
+                rows[k] = window[k] + c * width;
+
+            unsigned char row_top;
+            if (kernels.fixed_point)
+            {
+                kernels.taps_fixed(line, rows, width, &ws->vertical_fixed);
+                row_top = kernels.taps_fixed(image_row(img, c, i), shifted, width, &ws->horizontal_fixed);
+            }
+            else
+            {
+                kernels.taps(line, rows, width, &ws->vertical);
+                row_top = kernels.taps(image_row(img, c, i), shifted, width, &ws->horizontal);
+            }
+            if (row_top > top)
+                top = row_top;
+        }
+
+        // Slide the window, the original row i is still needed by the rows below it
+        unsigned char *oldest = window[0];
+        for (int k = 0; k < 2 * radius; k++)
+            window[k] = window[k + 1];
+        window[2 * radius] = oldest;
+    }
+
+    return top;
+}
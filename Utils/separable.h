@@ -0,0 +1,47 @@
+#ifndef SEPARABLE_H_
+#define SEPARABLE_H_
+
+#include "image.h"
+#include "kernels.h"
+#include "utils.h"
+
+/* Per worker state of the fused spatial pass. The vertical kernel needs the original rows
+i - radius to i + radius while row i is overwritten in place, so only those rows are kept in a
+ring, together with the vertical result of the row that is being emitted and its horizontal
+result before it is scattered back into the image. The rows just below the band are captured
+up front in 'below'. The fixed point versions of the kernels are kept here as well. */
+typedef struct
+{
+    int width;
+    // Columns [first_col, last_col) the horizontal kernel writes and takes the top of, all of them by default.
+    // The columns around them are the halo of a 2D block, which is only read
+    int first_col;
+    int last_col;
+    Kernel1D vertical;
+    Kernel1D horizontal;
+    FixedKernel vertical_fixed;
+    FixedKernel horizontal_fixed;
+    unsigned char *ring[MAX_TAPS];
+    unsigned char *below[MAX_TAPS / 2];
+    unsigned char *line;
+    unsigned char *out;
+} FusedWorkspace;
+
+size_t fused_workspace_size(int width, Kernel1D *vertical, Kernel1D *horizontal);
+FusedWorkspace *place_fused_workspace(void *memory, int width, Kernel1D *vertical, Kernel1D *horizontal);
+FusedWorkspace *new_fused_workspace(int width, Kernel1D *vertical, Kernel1D *horizontal);
+void free_fused_workspace(FusedWorkspace *ws);
+void fused_capture_halo(FusedWorkspace *ws, Channels **img, int first, int last, int start, int end);
+size_t fused_halo_size(int width, Kernel1D *vertical);
+void fused_store_halo(FusedWorkspace *ws, Channels **img, int first, int last, int start, int end,
+                      unsigned char *halo);
+void fused_load_halo(FusedWorkspace *ws, const unsigned char *halo);
+int conv_separable_fused(FusedWorkspace *ws, Channels **img, int first, int last, int start, int end);
+
+/* The fused pass over the 3 planes of an image. A line of the workspace holds the same row of
+every plane one after the other, so the halos have the same size and fused_load_halo takes
+them as well. */
+void fused_store_halo_planar(FusedWorkspace *ws, Image *img, int start, int end, unsigned char *halo);
+int conv_separable_planar(FusedWorkspace *ws, Image *img, int start, int end);
+
+#endif // SEPARABLE_H_
@@ -0,0 +1,367 @@
+#include "stages.h"
+#include "kernels.h"
+#include "weights.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Copies the 3 channels starting at 'first_channel' of every pixel into a packed line
+void pack_channels(unsigned char *dst, Channels *row, int width, int first_channel)
+{
+    for (int j = 0; j < width; j++)
+        for (int c = 0; c < channel_count; c++)
+            dst[j * channel_count + c] = row[j].channel[first_channel + c];
+}
+
+// Copies a packed line back into the 3 channels starting at 'first_channel' of every pixel
+void unpack_channels(Channels *row, unsigned char *src, int width, int first_channel)
+{
+    for (int j = 0; j < width; j++)
+        for (int c = 0; c < channel_count; c++)
+            row[j].channel[first_channel + c] = src[j * channel_count + c];
+}
+
+// Every line starts on its own cache line
+static size_t cache_lines(size_t bytes)
+{
+    return (bytes + 63) / 64 * 64;
+}
+
+// Bytes the layer lines take, none without weights
+static size_t layer_lines_size(int width)
+{
+    if (!weights)
+        return 0;
+
+    int radius = weights->depthwise[0].taps / 2;
+    return cache_lines(channel_count * width) + channel_count * cache_lines(width + 2 * radius) +
+           (weights->channels + channel_count) * cache_lines(width);
+}
+
+// Bytes a set of lines takes, the struct included
+size_t stage_lines_size(int width)
+{
+    size_t line_size = width * channel_count;
+    return cache_lines(sizeof(StageLines)) + 2 * cache_lines(line_size) +
+           cache_lines(line_size * sizeof(unsigned short)) + layer_lines_size(width);
+}
+
+/* Lays the lines out in 'memory', which has to hold stage_lines_size bytes, so they can come
+out of a run's arena as well as from malloc. */
+StageLines *place_stage_lines(void *memory, int width)
+{
+    StageLines *lines = memory;
+    unsigned char *next = (unsigned char *)memory + cache_lines(sizeof(StageLines));
+    size_t line_size = width * channel_count;
+    lines->width = width;
+
+    lines->line = next;
+    next += cache_lines(line_size);
+    lines->pooled = next;
+    next += cache_lines(line_size);
+    lines->sum = (unsigned short *)next;
+    next += cache_lines(line_size * sizeof(unsigned short));
+
+    if (weights)
+    {
+        // The layer only runs on whole rows, so the zeros around its input lines are never written
+        memset(next, 0, layer_lines_size(width));
+        int radius = weights->depthwise[0].taps / 2;
+        LayerLines *layer = &lines->layer;
+        layer->packed = next;
+        next += cache_lines(line_size);
+        for (int c = 0; c < channel_count; c++, next += cache_lines(width + 2 * radius))
+            layer->input[c] = next + radius;
+        for (int e = 0; e < weights->channels; e++, next += cache_lines(width))
+            layer->expanded[e] = next;
+        for (int o = 0; o < channel_count; o++, next += cache_lines(width))
+            layer->output[o] = next;
+    }
+
+    return lines;
+}
+
+StageLines *new_stage_lines(int width)
+{
+    void *memory = aligned_alloc(64, stage_lines_size(width));
+    return place_stage_lines(memory, width);
+}
+
+void free_stage_lines(StageLines *lines)
+{
+    free(lines);
+}
+
+// Converts a scale factor to the Q8 multiplier of scale_fixed
+static unsigned short fixed_factor(float factor)
+{
+    return fminf(roundf(factor * 256), 65535);
+}
+
+// Standardizes a packed line of 'n' bytes into the range 0-255
+static void normalize_line(unsigned char *line, int n, float upscale_factor)
+{
+    if (kernels.fixed_point)
+        kernels.scale_fixed(line, n, fixed_factor(upscale_factor));
+    else
+        kernels.scale(line, n, upscale_factor);
+}
+
+// Standardizes the rows [start, end) into the range 0-255
+void normalize_rows(StageLines *lines, Channels **img, int width, int start, int end, float upscale_factor)
+{
+    unsigned char *line = lines->line;
+
+    for (int i = start; i < end; i++)
+    {
+        pack_channels(line, img[i], width, 0);
+        normalize_line(line, width * channel_count, upscale_factor);
+        unpack_channels(img[i], line, width, 0);
+    }
+}
+
+// Runs the depthwise kernels of the learned layer over the packed line, leaving every expanded channel in its line
+static void layer_depthwise(LayerLines *lines, int width)
+{
+    int radius = weights->depthwise[0].taps / 2;
+    const unsigned char *taps[MAX_TAPS];
+
+    for (int j = 0; j < width; j++)
+        for (int c = 0; c < channel_count; c++)
+            lines->input[c][j] = lines->packed[j * channel_count + c];
+
+    for (int e = 0; e < weights->channels; e++)
+    {
+        for (int k = 0; k < weights->depthwise[e].taps; k++)
+            taps[k] = lines->input[e % channel_count] + k - radius;
+        kernels.taps(lines->expanded[e], taps, width, &weights->depthwise[e]);
+    }
+}
+
+// Mixes the expanded lines back into the first channels of a row, returns the top of what it wrote
+static int layer_pointwise(LayerLines *lines, Channels *row, int width)
+{
+    int top = kernels.pointwise(lines->output, (const unsigned char *const *)lines->expanded, width,
+                                &weights->pointwise);
+
+    for (int j = 0; j < width; j++)
+        for (int o = 0; o < channel_count; o++)
+            row[j].channel[o] = lines->output[o][j];
+
+    return top;
+}
+
+/* Depthwise part of the learned layer over the rows [start, end), which end up with all the
+expanded channels. They overwrite the original channels, so every row is read before any of
+its channels is written. */
+static void layer_encode_rows(LayerLines *lines, Channels **img, int width, int start, int end)
+{
+    for (int i = start; i < end; i++)
+    {
+        pack_channels(lines->packed, img[i], width, 0);
+        layer_depthwise(lines, width);
+        for (int j = 0; j < width; j++)
+            for (int e = 0; e < weights->channels; e++)
+                img[i][j].channel[e] = lines->expanded[e][j];
+    }
+}
+
+// Pointwise part of the learned layer over the rows [start, end), returns the top of what it wrote
+static int layer_decode_rows(LayerLines *lines, Channels **img, int width, int start, int end)
+{
+    int top = 0;
+
+    for (int i = start; i < end; i++)
+    {
+        for (int j = 0; j < width; j++)
+            for (int e = 0; e < weights->channels; e++)
+                lines->expanded[e][j] = img[i][j].channel[e];
+        top = fmax(top, layer_pointwise(lines, img[i], width));
+    }
+
+    return top;
+}
+
+/* Extends the rows [start, end) to 'num_channels' channels. Every new channel pools the
+original channel it maps to with a stride of 'channel_count' through the 3 taps of K. With
+weights loaded it runs their depthwise kernels instead, and the channels are theirs. */
+void depthwise_encode_rows(StageLines *lines, Channels **img, int width, int start, int end, int num_channels,
+                           float *K)
+{
+    if (weights)
+    {
+        layer_encode_rows(&lines->layer, img, width, start, end);
+        return;
+    }
+
+    int line_size = width * channel_count;
+    unsigned char *line = lines->line;
+    unsigned char *pooled = lines->pooled;
+
+    Kernel1D pool = {channel_count};
+    const unsigned char *taps[channel_count];
+    for (int c = 0; c < channel_count; c++)
+    {
+        pool.coefficients[c] = K[c];
+        taps[c] = line;
+    }
+
+    // All the taps read the same channel, so in fixed point they collapse into a single factor
+    unsigned short factor = fixed_factor(K[0] + K[1] + K[2]);
+
+    for (int i = start; i < end; i++)
+    {
+        if (kernels.fixed_point)
+        {
+            pack_channels(pooled, img[i], width, 0);
+            kernels.scale_fixed(pooled, line_size, factor);
+        }
+        else
+        {
+            pack_channels(line, img[i], width, 0);
+            kernels.taps(pooled, taps, line_size, &pool);
+        }
+
+        for (int first_channel = channel_count; first_channel < num_channels; first_channel += channel_count)
+            unpack_channels(img[i], pooled, width, first_channel);
+    }
+}
+
+/* Averages the channel groups of the rows [start, end) back into the first 3 channels and
+returns the top of what it wrote, which is the range of the final image after the last stage.
+With weights loaded it runs their pointwise convolution instead. */
+int depthwise_decode_rows(StageLines *lines, Channels **img, int width, int start, int end, int num_channels)
+{
+    if (weights)
+        return layer_decode_rows(&lines->layer, img, width, start, end);
+
+    int line_size = width * channel_count;
+    unsigned char *line = lines->line;
+    unsigned short *sum = lines->sum;
+    int top = 0;
+
+    for (int i = start; i < end; i++)
+    {
+        memset(sum, 0, line_size * sizeof(unsigned short));
+        for (int first_channel = 0; first_channel < num_channels; first_channel += channel_count)
+        {
+            pack_channels(line, img[i], width, first_channel);
+            kernels.accumulate(sum, line, line_size);
+        }
+
+        if (kernels.fixed_point)
+            kernels.divide_fixed(line, sum, line_size, num_channels / channel_count);
+        else
+            kernels.divide(line, sum, line_size, num_channels / channel_count);
+        unpack_channels(img[i], line, width, 0);
+
+        // The line is still in cache, unlike the image when it gets written
+        for (int x = 0; x < line_size; x++)
+            if (line[x] > top)
+                top = line[x];
+    }
+
+    return top;
+}
+
+/* Normalize, encode and decode of a line of 'n' bytes in place, with the encode pooling into
+'groups - 1' channel groups. Returns the top of the line. */
+static int pointwise_line(StageLines *lines, unsigned char *line, int n, float upscale_factor, int groups, float *K)
+{
+    unsigned char *pooled = lines->pooled;
+    unsigned short *sum = lines->sum;
+    int top = 0;
+
+    Kernel1D pool = {channel_count};
+    const unsigned char *taps[channel_count];
+    for (int c = 0; c < channel_count; c++)
+    {
+        pool.coefficients[c] = K[c];
+        taps[c] = line;
+    }
+
+    normalize_line(line, n, upscale_factor);
+    if (kernels.fixed_point)
+    {
+        memcpy(pooled, line, n);
+        kernels.scale_fixed(pooled, n, fixed_factor(K[0] + K[1] + K[2]));
+    }
+    else
+        kernels.taps(pooled, taps, n, &pool);
+
+    for (int x = 0; x < n; x++)
+        sum[x] = line[x] + (groups - 1) * pooled[x];
+
+    if (kernels.fixed_point)
+        kernels.divide_fixed(line, sum, n, groups);
+    else
+        kernels.divide(line, sum, n, groups);
+
+    for (int x = 0; x < n; x++)
+        if (line[x] > top)
+            top = line[x];
+
+    return top;
+}
+
+/* Normalize, encode and decode of the rows [start, end), all of them applied to a line as it
+is loaded and without ever writing the expanded channels. Every group the encode adds holds
+the same pooled line, so the sum the decode takes over the groups is the original line plus
+'groups - 1' times the pooled one, formed while both lines are in cache. Gives the same 3
+channels as normalize_rows, depthwise_encode_rows and depthwise_decode_rows one after the
+other, and leaves the channels past them untouched. With 'expanded' set it runs those three
+instead, for callers that need the expanded channels in the image. Returns the top of the
+rows [start, end). With weights loaded, the learned layer runs a row at a time the same way. */
+int pointwise_rows(StageLines *lines, Channels **img, int width, int start, int end, float upscale_factor,
+                   int num_channels, float *K, int expanded)
+{
+    if (expanded)
+    {
+        normalize_rows(lines, img, width, start, end, upscale_factor);
+        depthwise_encode_rows(lines, img, width, start, end, num_channels, K);
+        return depthwise_decode_rows(lines, img, width, start, end, num_channels);
+    }
+
+    if (weights)
+    {
+        LayerLines *layer = &lines->layer;
+        int top = 0;
+        for (int i = start; i < end; i++)
+        {
+            pack_channels(layer->packed, img[i], width, 0);
+            normalize_line(layer->packed, width * channel_count, upscale_factor);
+            layer_depthwise(layer, width);
+            top = fmax(top, layer_pointwise(layer, img[i], width));
+        }
+        return top;
+    }
+
+    int line_size = width * channel_count;
+    int top = 0;
+
+    for (int i = start; i < end; i++)
+    {
+        pack_channels(lines->line, img[i], width, 0);
+        top = fmax(top, pointwise_line(lines, lines->line, line_size, upscale_factor, num_channels / channel_count, K));
+        unpack_channels(img[i], lines->line, width, 0);
+    }
+
+    return top;
+}
+
+/* pointwise_rows over the columns [col, col + cols) of the rows [start, end) of a planar image.
+Every stage it fuses works on each byte of a line on its own, so they run on the rows of the
+planes where they are, without packing them. There are no expanded channels to write and no
+learned layer. Returns the top of what it wrote. */
+int pointwise_planes(StageLines *lines, Image *img, int col, int cols, int start, int end, float upscale_factor,
+                     int num_channels, float *K)
+{
+    int top = 0;
+
+    for (int i = start; i < end; i++)
+        for (int c = 0; c < channel_count; c++)
+            top = fmax(top, pointwise_line(lines, image_row(img, c, i) + col, cols, upscale_factor,
+                                           num_channels / channel_count, K));
+
+    return top;
+}
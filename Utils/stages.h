@@ -0,0 +1,48 @@
+#ifndef STAGES_H_
+#define STAGES_H_
+
+#include "image.h"
+#include "utils.h"
+#include <stddef.h>
+
+// Lines of one row for the learned layer, one per channel
+typedef struct
+{
+    unsigned char *packed;
+    // The channels of the image, with the taps / 2 zeros the depthwise kernels read past each end
+    unsigned char *input[channel_count];
+    unsigned char *expanded[LAYER_HEIGHT];
+    unsigned char *output[channel_count];
+} LayerLines;
+
+/* Lines the stages below pack a row into, for rows of at most 'width' pixels. Every thread
+has its own, sized once for the run, and the layer lines are only there with weights loaded,
+so they have to be loaded before the lines are sized. */
+typedef struct
+{
+    int width;
+    unsigned char *line;
+    unsigned char *pooled;
+    unsigned short *sum;
+    LayerLines layer;
+} StageLines;
+
+size_t stage_lines_size(int width);
+StageLines *place_stage_lines(void *memory, int width);
+StageLines *new_stage_lines(int width);
+void free_stage_lines(StageLines *lines);
+
+/* Row band versions of the per pixel stages, shared by all the backends. Each row is packed
+into contiguous bytes, run through the selected kernels and scattered back. */
+void pack_channels(unsigned char *dst, Channels *row, int width, int first_channel);
+void unpack_channels(Channels *row, unsigned char *src, int width, int first_channel);
+void normalize_rows(StageLines *lines, Channels **img, int width, int start, int end, float upscale_factor);
+void depthwise_encode_rows(StageLines *lines, Channels **img, int width, int start, int end, int num_channels,
+                           float *K);
+int depthwise_decode_rows(StageLines *lines, Channels **img, int width, int start, int end, int num_channels);
+int pointwise_rows(StageLines *lines, Channels **img, int width, int start, int end, float upscale_factor,
+                   int num_channels, float *K, int expanded);
+int pointwise_planes(StageLines *lines, Image *img, int col, int cols, int start, int end, float upscale_factor,
+                     int num_channels, float *K);
+
+#endif // STAGES_H_
@@ -0,0 +1,320 @@
+#include "stream.h"
+#include "stages.h"
+#include "trace.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Strips in flight on each side of the compute, one being filled or drained while one is used
+#define STREAM_DEPTH 2
+
+// Rows [first_row, first_row + rows) of the image, packed with 'samples' bytes per pixel
+typedef struct
+{
+    int first_row;
+    int rows;
+    unsigned char *data;
+} StripBuffer;
+
+// Blocking queue of at most STREAM_DEPTH strip buffers
+typedef struct
+{
+    StripBuffer *slots[STREAM_DEPTH];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} StripQueue;
+
+// Where the samples of an image start in a file and how many there are per pixel
+typedef struct
+{
+    int fd;
+    size_t offset;
+    int samples;
+} StripFile;
+
+// One sweep over the band of the process, reading 'src' and writing 'dst' a strip at a time
+typedef struct
+{
+    StripFile src;
+    StripFile dst;
+    int width;
+    int height;
+    int band_first;
+    int band_last;
+    int strip_rows;
+    int halo;
+    StripQueue free_reads;
+    StripQueue full_reads;
+    StripQueue free_writes;
+    StripQueue full_writes;
+} Pass;
+
+static void queue_init(StripQueue *q)
+{
+    q->head = 0;
+    q->count = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+}
+
+static void queue_destroy(StripQueue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+}
+
+static void queue_push(StripQueue *q, StripBuffer *buf)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == STREAM_DEPTH)
+        pthread_cond_wait(&q->changed, &q->lock);
+    q->slots[(q->head + q->count++) % STREAM_DEPTH] = buf;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static StripBuffer *queue_pop(StripQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+        pthread_cond_wait(&q->changed, &q->lock);
+    StripBuffer *buf = q->slots[q->head];
+    q->head = (q->head + 1) % STREAM_DEPTH;
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+
+    return buf;
+}
+
+// Reads every strip of the band together with its halo, running ahead of the compute
+static void *read_strips(void *var)
+{
+    Pass *p = var;
+    size_t row_size = (size_t)p->width * p->src.samples;
+
+    for (int s = p->band_first; s < p->band_last; s += p->strip_rows)
+    {
+        StripBuffer *buf = queue_pop(&p->free_reads);
+        buf->first_row = fmax(0, s - p->halo);
+        buf->rows = fmin(p->height, fmin(p->band_last, s + p->strip_rows) + p->halo) - buf->first_row;
+        TRACE_BEGIN("read strip");
+        read_at(p->src.fd, buf->data, buf->rows * row_size, p->src.offset + buf->first_row * row_size);
+        TRACE_END();
+        queue_push(&p->full_reads, buf);
+    }
+
+    return NULL;
+}
+
+// Writes the finished strips behind the compute
+static void *write_strips(void *var)
+{
+    Pass *p = var;
+    size_t row_size = (size_t)p->width * p->dst.samples;
+
+    for (int s = p->band_first; s < p->band_last; s += p->strip_rows)
+    {
+        StripBuffer *buf = queue_pop(&p->full_writes);
+        TRACE_BEGIN("write strip");
+        write_at(p->dst.fd, buf->data, buf->rows * row_size, p->dst.offset + buf->first_row * row_size);
+        TRACE_END();
+        queue_push(&p->free_writes, buf);
+    }
+
+    return NULL;
+}
+
+/* Streams the band through the pointwise stages of iteration 'iteration - 1', if there is one,
+and then through the spatial pass when 'spatial' is set. Returns the top of the last stage. */
+static int run_pass(Pass *p, Channels **rows, StreamStages *stages, int iteration, float upscale_factor,
+                    int spatial)
+{
+    size_t read_size = (size_t)(p->strip_rows + 2 * p->halo) * p->width * p->src.samples;
+    size_t write_size = (size_t)p->strip_rows * p->width * channel_count;
+    StripBuffer reads[STREAM_DEPTH], writes[STREAM_DEPTH];
+
+    queue_init(&p->free_reads);
+    queue_init(&p->full_reads);
+    queue_init(&p->free_writes);
+    queue_init(&p->full_writes);
+    for (int b = 0; b < STREAM_DEPTH; b++)
+    {
+        reads[b].data = malloc(read_size);
+        writes[b].data = malloc(write_size);
+        queue_push(&p->free_reads, &reads[b]);
+        queue_push(&p->free_writes, &writes[b]);
+    }
+
+    pthread_t reader, writer;
+    pthread_create(&reader, NULL, read_strips, p);
+    pthread_create(&writer, NULL, write_strips, p);
+
+    int top = 0;
+    for (int s = p->band_first; s < p->band_last; s += p->strip_rows)
+    {
+        int size = fmin(p->band_last, s + p->strip_rows) - s;
+
+        // Row i of 'rows' is row s - halo + i of the image, the halo is only loaded inside the image
+        StripBuffer *in = queue_pop(&p->full_reads);
+        int first = in->first_row - (s - p->halo);
+        int last = first + in->rows;
+        for (int i = 0; i < in->rows; i++)
+        {
+            unsigned char *src = in->data + (size_t)i * p->width * p->src.samples;
+            Channels *row = rows[first + i];
+            for (int j = 0; j < p->width; j++)
+                for (int c = 0; c < channel_count; c++)
+                    row[j].channel[c] = src[j * p->src.samples + (p->src.samples == 1 ? 0 : c)];
+        }
+        queue_push(&p->free_reads, in);
+
+        // Without any stage the strip is only copied, so its range has to be scanned
+        int strip_top = 0;
+        if (iteration > 0)
+            strip_top = stages->pointwise(rows, s - p->halo, first, last, upscale_factor, iteration - 1);
+        if (spatial)
+            strip_top = stages->spatial(rows, s - p->halo, first, last, p->halo, p->halo + size);
+        else if (iteration == 0)
+            strip_top = get_range(rows + p->halo, p->width, size);
+        if (strip_top > top)
+            top = strip_top;
+
+        StripBuffer *out = queue_pop(&p->free_writes);
+        out->first_row = s;
+        out->rows = size;
+        for (int i = 0; i < size; i++)
+            pack_channels(out->data + (size_t)i * p->width * channel_count, rows[p->halo + i], p->width, 0);
+        queue_push(&p->full_writes, out);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    for (int b = 0; b < STREAM_DEPTH; b++)
+    {
+        free(reads[b].data);
+        free(writes[b].data);
+    }
+    queue_destroy(&p->free_reads);
+    queue_destroy(&p->full_reads);
+    queue_destroy(&p->free_writes);
+    queue_destroy(&p->full_writes);
+
+    return top;
+}
+
+// Opens a file holding the samples of the output, the first process creates and sizes it
+static int open_strip_file(char *filename, size_t size, int part, StreamStages *stages)
+{
+    int fd = -1;
+    if (part == 0)
+    {
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0 && ftruncate(fd, size) < 0)
+            fd = -1;
+    }
+    if (stages->barrier)
+        stages->barrier();
+    if (part != 0)
+        fd = open(filename, O_RDWR);
+
+    if (fd < 0)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+/* Runs the whole pipeline on an image without ever holding more than a strip of it in memory.
+The image is split into 'parts' bands of rows, this process streams band 'part' in strips of
+'strip_rows' rows.
+
+Every iteration normalizes with the top of its spatial stage over the whole image, so no
+pointwise stage can run before the spatial pass has seen every row. Each iteration is
+therefore one pass over the image, which reads 'radius' ghost rows on each side of a strip and
+writes the spatial result. The pointwise stages are applied when the next pass loads the
+strip, and a final pass applies those of the last iteration in place. The passes alternate
+between the output file and a scratch file next to it, so the rows a pass reads are never
+overwritten by a neighbouring strip or process. The memory used is about
+(strip_rows + 2 * radius) * width * sizeof(Channels) bytes, plus 4 packed strips of I/O.
+
+The maxval of the output is only known at the end, so it is padded to 3 characters to keep
+the size of the header fixed. 'width' and 'height' are set from the input before any stage
+runs. */
+void stream_image(char *in_name, char *out_name, int iterations, int radius, int strip_rows, int part, int parts,
+                  int *width, int *height, StreamStages *stages)
+{
+    PnmHeader header = read_pnm_header(in_name);
+    *width = header.width;
+    *height = header.height;
+
+    Pass p;
+    p.width = header.width;
+    p.height = header.height;
+    p.strip_rows = strip_rows;
+    int band = ceil((double)p.height / parts);
+    p.band_first = fmin(p.height, part * band);
+    p.band_last = fmin(p.height, (part + 1) * band);
+
+    char text[64];
+    size_t offset = snprintf(text, sizeof(text), "P6\n%d %d\n%3d\n", p.width, p.height, 255);
+    size_t size = offset + (size_t)p.width * p.height * channel_count;
+
+    StripFile input = {open(in_name, O_RDONLY), header.offset, header.samples};
+    if (input.fd < 0)
+    {
+        perror(in_name);
+        exit(EXIT_FAILURE);
+    }
+    StripFile files[2] = {{open_strip_file(out_name, size, part, stages), offset, channel_count}};
+
+    char *scratch_name = malloc(strlen(out_name) + 8);
+    sprintf(scratch_name, "%s.strips", out_name);
+    if (iterations > 1)
+        files[1] = (StripFile){open_strip_file(scratch_name, size, part, stages), offset, channel_count};
+
+    Channels **rows = new_channel_array(strip_rows + 2 * radius, p.width);
+    float upscale_factor = 0;
+    int top = 0;
+
+    p.src = input;
+    for (int i = 0; i <= iterations; i++)
+    {
+        // The last spatial pass lands in the output, which the final pass then updates in place
+        int spatial = i < iterations;
+        p.dst = spatial ? files[(iterations - 1 - i) % 2] : files[0];
+        p.halo = spatial ? radius : 0;
+
+        top = run_pass(&p, rows, stages, i, upscale_factor, spatial);
+        if (stages->reduce_top)
+            top = stages->reduce_top(top);
+        upscale_factor = 255.f / top;
+
+        p.src = p.dst;
+    }
+
+    if (part == 0)
+    {
+        snprintf(text, sizeof(text), "P6\n%d %d\n%3d\n", p.width, p.height, top);
+        write_at(files[0].fd, (unsigned char *)text, offset, 0);
+        if (iterations > 1)
+            unlink(scratch_name);
+    }
+
+    close(input.fd);
+    close(files[0].fd);
+    if (iterations > 1)
+        close(files[1].fd);
+    free(scratch_name);
+
+    free_channel_array(rows, strip_rows + 2 * radius);
+}
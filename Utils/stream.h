@@ -0,0 +1,23 @@
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include "utils.h"
+
+/* Stages a backend plugs into the streaming mode. Each one gets a strip of rows, where row i of
+the strip is row 'strip_first + i' of the image. */
+typedef struct
+{
+    // Spatial pass over the rows [start, end), rows outside [first, last) are 0; returns the top
+    int (*spatial)(Channels **rows, int strip_first, int first, int last, int start, int end);
+    // Normalize, encode and decode of 'iteration' over the rows [start, end); returns the decode top
+    int (*pointwise)(Channels **rows, int strip_first, int start, int end, float upscale_factor, int iteration);
+    // Largest top of all the processes streaming the image, NULL when there is a single one
+    int (*reduce_top)(int top);
+    // Waits for all the processes streaming the image, NULL when there is a single one
+    void (*barrier)(void);
+} StreamStages;
+
+void stream_image(char *in_name, char *out_name, int iterations, int radius, int strip_rows, int part, int parts,
+                  int *width, int *height, StreamStages *stages);
+
+#endif // STREAM_H_
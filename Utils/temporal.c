@@ -0,0 +1,145 @@
+#include "temporal.h"
+#include "stages.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+TemporalScratch *new_temporal_scratch(int width, int tile_rows, int max_depth, Kernel1D *vertical,
+                                      Kernel1D *horizontal)
+{
+    TemporalScratch *scratch = malloc(sizeof(TemporalScratch));
+    scratch->ws = new_fused_workspace(width, vertical, horizontal);
+    scratch->lines = new_stage_lines(width);
+    scratch->capacity = tile_rows + 2 * max_depth * (vertical->taps / 2);
+    scratch->rows = new_channel_array(scratch->capacity, width);
+
+    return scratch;
+}
+
+void free_temporal_scratch(TemporalScratch *scratch)
+{
+    free_fused_workspace(scratch->ws);
+    free_stage_lines(scratch->lines);
+    free_channel_array(scratch->rows, scratch->capacity);
+    free(scratch);
+}
+
+/* Takes the rows [start, end) of the image through every stage of the block while they stay in
+the scratch rows. They are loaded with 'depth * radius' rows of halo on each side, and every
+spatial stage leaves one radius less of it valid, so the last one is valid on the tile alone.
+Halo rows are computed by the neighbouring tiles as well, they only agree because all of them
+use the same guesses. 'tops' gets the largest top of every stage of the block this tile saw. */
+void temporal_tile(TemporalBlock *block, TemporalScratch *scratch, int start, int end, int *tops)
+{
+    int radius = block->vertical->taps / 2;
+    int lo = fmax(0, start - block->depth * radius);
+    int hi = fmin(block->height, end + block->depth * radius);
+    // Row i of the image is rows[i - lo], the rows past the loaded ones are never reached
+    Channels **rows = scratch->rows;
+
+    for (int i = lo; i < hi; i++)
+        memcpy(rows[i - lo], block->src[i], block->width * sizeof(Channels));
+
+    for (int k = 0; k <= block->depth; k++)
+    {
+        // Rows beyond the tile the spatial stage k computes, the pointwise stages before it cover one radius more
+        int reach = (block->depth - 1 - k) * radius;
+        int spatial_start = fmax(block->first, start - reach);
+        int spatial_end = fmin(block->height, end + reach);
+        int pointwise_start = k < block->depth ? fmax(block->first, spatial_start - radius) : start;
+        int pointwise_end = k < block->depth ? fmin(block->height, spatial_end + radius) : end;
+
+        if ((k > 0 || block->leading) && (k < block->depth || block->trailing))
+        {
+            Channels **view = rows + pointwise_start - lo;
+            int n = pointwise_end - pointwise_start;
+            int top = pointwise_rows(scratch->lines, view, block->width, 0, n, 255.f / block->guesses[k],
+                                     block->num_channels, block->K, block->expanded);
+            if (k == block->depth)
+                tops[k] = fmax(tops[k], top);
+        }
+
+        if (k == block->depth)
+            break;
+
+        fused_capture_halo(scratch->ws, rows, 0, hi - lo, spatial_start - lo, spatial_end - lo);
+        tops[k] = fmax(tops[k], conv_separable_fused(scratch->ws, rows, 0, hi - lo, spatial_start - lo,
+                                                     spatial_end - lo));
+    }
+
+    for (int i = start; i < end; i++)
+        memcpy(block->dst[i], rows[i - lo], block->width * sizeof(Channels));
+}
+
+/* Runs 'iterations' iterations on block->src in blocks of up to 'max_depth' iterations, each
+one a single sweep of the image through run_block. run_block has to pass every tile of the rows
+[block->first, block->height) through temporal_tile and leave the largest tops of all of them
+in 'tops', which comes zeroed.
+
+The guesses are the top of the last spatial stage before the block, which hardly moves once
+the first few iterations are over. A block is only kept when all of them turn out right.
+Otherwise the stages up to the first wrong one did see the right tops, so the block is run
+again up to there, with all of its tops known. The depth doubles after every block that is
+kept and restarts from the one that was run again after a miss. The result replaces
+block->src, the other image is freed, unless the caller made it and passed it in block->dst,
+which then gets it back. Returns the top of the last decode. */
+int temporal_image(TemporalBlock *block, int iterations, int max_depth,
+                   void (*run_block)(TemporalBlock *block, int *tops))
+{
+    int tops[TEMPORAL_MAX_DEPTH + 1];
+    int done = 0, depth = 1, known = 0, finished = 0, top = 0;
+
+    int own = !block->dst;
+    if (own)
+        block->dst = new_channel_array(block->height, block->width);
+    for (int i = 0; i < block->first; i++)
+        memcpy(block->dst[i], block->src[i], block->width * sizeof(Channels));
+
+    while (!finished)
+    {
+        // Until a spatial stage is over there is nothing to guess from, so the first block has no guesses
+        block->depth = fmin(depth, iterations - done);
+        block->leading = done > 0;
+        block->trailing = done > 0 && done + block->depth == iterations;
+        for (int k = known + 1; k <= block->depth; k++)
+            block->guesses[k] = block->guesses[known];
+
+        memset(tops, 0, sizeof(tops));
+        run_block(block, tops);
+
+        int k = 1;
+        while (k < block->depth + block->trailing && block->guesses[k] == tops[k - 1])
+            k++;
+
+        if (k < block->depth + block->trailing)
+        {
+            for (int j = 1; j <= k; j++)
+                block->guesses[j] = tops[j - 1];
+            depth = known = k;
+            continue;
+        }
+
+        Channels **result = block->dst;
+        block->dst = block->src;
+        block->src = result;
+
+        done += block->depth;
+        if (block->depth > 0)
+            block->guesses[0] = tops[block->depth - 1];
+        if (block->trailing)
+        {
+            top = tops[block->depth];
+            finished = 1;
+        }
+        depth = fmin(max_depth, 2 * fmax(1, block->depth));
+        known = 0;
+    }
+
+    if (own)
+    {
+        free_channel_array(block->dst, block->height);
+        block->dst = NULL;
+    }
+
+    return top;
+}
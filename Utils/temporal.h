@@ -0,0 +1,57 @@
+#ifndef TEMPORAL_H_
+#define TEMPORAL_H_
+
+#include "separable.h"
+#include "stages.h"
+#include "utils.h"
+
+// Most iterations a tile goes through at once
+#define TEMPORAL_MAX_DEPTH 64
+
+/* A block of iterations of the in-memory pipeline, run a tile at a time. Every iteration is the
+spatial stage followed by the pointwise ones, which normalize with the top of that spatial
+stage over the whole image. A block therefore ends right after a spatial stage and the next one
+starts with the pointwise stages it left, whose top is known by then. The tops of the spatial
+stages inside the block are not, so the pointwise stages between them use guesses, which are
+checked once the block is over. */
+typedef struct
+{
+    // The image before the block, and where the tiles write it after the block
+    Channels **src;
+    Channels **dst;
+    int width;
+    int height;
+    // Rows above 'first' are read by the spatial stage but never updated
+    int first;
+    Kernel1D *vertical;
+    Kernel1D *horizontal;
+    int num_channels;
+    float *K;
+    // Write the expanded channels of the encode into the rows, see pointwise_rows
+    int expanded;
+    // Spatial stages in the block
+    int depth;
+    // Whether the block starts with the pointwise stages of the iteration before it, and ends with those of its last one
+    int leading;
+    int trailing;
+    // Top used by the pointwise stages before spatial stage k, or after the last one for k = depth
+    int guesses[TEMPORAL_MAX_DEPTH + 1];
+} TemporalBlock;
+
+// Rows of a tile and its halo, owned by a single worker
+typedef struct
+{
+    FusedWorkspace *ws;
+    StageLines *lines;
+    Channels **rows;
+    int capacity;
+} TemporalScratch;
+
+TemporalScratch *new_temporal_scratch(int width, int tile_rows, int max_depth, Kernel1D *vertical,
+                                      Kernel1D *horizontal);
+void free_temporal_scratch(TemporalScratch *scratch);
+void temporal_tile(TemporalBlock *block, TemporalScratch *scratch, int start, int end, int *tops);
+int temporal_image(TemporalBlock *block, int iterations, int max_depth,
+                   void (*run_block)(TemporalBlock *block, int *tops));
+
+#endif // TEMPORAL_H_
@@ -0,0 +1,189 @@
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct
+{
+    const char *name;
+    unsigned long long start;
+    unsigned long long end;
+} TraceEvent;
+
+/* Events of one thread. A thread that exits hands its buffer over to the next one that starts,
+events included, so the threads made for every image or strip don't pile up buffers. */
+typedef struct TraceBuffer
+{
+    int tid;
+    // Events ever recorded, the latest TRACE_EVENTS of them are in the ring
+    unsigned long long count;
+    TraceEvent events[TRACE_EVENTS];
+    int depth;
+    const char *open_names[TRACE_DEPTH];
+    unsigned long long open_starts[TRACE_DEPTH];
+    struct TraceBuffer *next;
+    struct TraceBuffer *next_free;
+} TraceBuffer;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static TraceBuffer *buffers;
+static TraceBuffer *free_buffers;
+static int n_buffers;
+static int process;
+static __thread TraceBuffer *own;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void release_buffer(void *var)
+{
+    TraceBuffer *buffer = var;
+    pthread_mutex_lock(&lock);
+    buffer->depth = 0;
+    buffer->next_free = free_buffers;
+    free_buffers = buffer;
+    pthread_mutex_unlock(&lock);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&key, release_buffer);
+}
+
+// Buffer of the calling thread, taken on its first span
+static TraceBuffer *thread_buffer(void)
+{
+    if (own)
+        return own;
+
+    pthread_once(&once, make_key);
+    pthread_mutex_lock(&lock);
+    if (free_buffers)
+    {
+        own = free_buffers;
+        free_buffers = own->next_free;
+    }
+    else
+    {
+        own = calloc(1, sizeof(TraceBuffer));
+        if (!own)
+        {
+            perror("trace");
+            exit(EXIT_FAILURE);
+        }
+        own->tid = n_buffers++;
+        own->next = buffers;
+        buffers = own;
+    }
+    pthread_mutex_unlock(&lock);
+    pthread_setspecific(key, own);
+
+    return own;
+}
+
+void trace_begin(const char *name)
+{
+    TraceBuffer *buffer = thread_buffer();
+    // Spans nested deeper than the stack are dropped, their ends still have to match
+    if (buffer->depth < TRACE_DEPTH)
+    {
+        buffer->open_names[buffer->depth] = name;
+        buffer->open_starts[buffer->depth] = now_ns();
+    }
+    buffer->depth++;
+}
+
+void trace_end(void)
+{
+    TraceBuffer *buffer = thread_buffer();
+    if (buffer->depth == 0)
+        return;
+    if (--buffer->depth < TRACE_DEPTH)
+    {
+        TraceEvent *event = &buffer->events[buffer->count++ % TRACE_EVENTS];
+        event->name = buffer->open_names[buffer->depth];
+        event->start = buffer->open_starts[buffer->depth];
+        event->end = now_ns();
+    }
+}
+
+// Process id of the events, the rank under MPI
+void trace_set_process(int pid)
+{
+    process = pid;
+}
+
+const char *trace_filename(void)
+{
+    const char *name = getenv("CONV_TRACE");
+    return name && *name ? name : "trace.json";
+}
+
+/* Formats the events of every thread as comma separated trace_event objects, without the
+enclosing array, so the events of several processes can be joined. The threads must have
+stopped recording. Returns a string of 'size' bytes the caller frees. */
+char *trace_format(size_t *size)
+{
+    size_t capacity = 4096, used = 0;
+    char *text = malloc(capacity);
+
+    for (TraceBuffer *buffer = buffers; buffer; buffer = buffer->next)
+    {
+        unsigned long long kept = buffer->count < TRACE_EVENTS ? buffer->count : TRACE_EVENTS;
+        for (unsigned long long e = buffer->count - kept; e < buffer->count; e++)
+        {
+            TraceEvent *event = &buffer->events[e % TRACE_EVENTS];
+            if (capacity - used < 256)
+            {
+                capacity *= 2;
+                text = realloc(text, capacity);
+            }
+            used += snprintf(text + used, capacity - used,
+                             "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                             used ? ",\n" : "", event->name, process, buffer->tid, event->start / 1000.,
+                             (event->end - event->start) / 1000.);
+        }
+    }
+
+    *size = used;
+    return text;
+}
+
+// Writes the events formatted by 'n' processes, 'sizes[p]' bytes of them starting at events[p], into a trace_event file
+void trace_write(const char *filename, const char *events, const int *sizes, int n)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file)
+    {
+        perror(filename);
+        return;
+    }
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+    int written = 0;
+    for (int p = 0; p < n; events += sizes[p], p++)
+        if (sizes[p])
+        {
+            if (written++)
+                fputs(",\n", file);
+            fwrite(events, 1, sizes[p], file);
+        }
+    fputs("\n]}\n", file);
+    fclose(file);
+}
+
+// Writes the events of the process to the trace file
+void trace_dump(void)
+{
+    size_t size;
+    char *events = trace_format(&size);
+    int sizes[1] = {size};
+    trace_write(trace_filename(), events, sizes, 1);
+    free(events);
+}
@@ -0,0 +1,34 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+
+/* Spans of time around the stages, the I/O and the MPI operations, compiled in with -DTRACE
+(make build TRACE=1) and to nothing otherwise. Every thread records the spans it closes into a
+ring buffer of its own, which keeps the latest TRACE_EVENTS of them, so recording never takes a
+lock. At exit they are written as a Chrome trace_event file, one track per thread, to the file
+named by the CONV_TRACE environment variable, or trace.json. Spans nest, a thread can have up
+to TRACE_DEPTH of them open at once. */
+#define TRACE_EVENTS 65536
+#define TRACE_DEPTH 32
+
+#ifdef TRACE
+#define TRACE_BEGIN(name) trace_begin(name)
+#define TRACE_END() trace_end()
+#define TRACE_DUMP() trace_dump()
+#else
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END() ((void)0)
+#define TRACE_DUMP() ((void)0)
+#endif
+
+// 'name' has to outlive the run, a string literal
+void trace_begin(const char *name);
+void trace_end(void);
+void trace_set_process(int pid);
+const char *trace_filename(void);
+char *trace_format(size_t *size);
+void trace_write(const char *filename, const char *events, const int *sizes, int n);
+void trace_dump(void);
+
+#endif // TRACE_H_
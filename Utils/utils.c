@@ -1,7 +1,15 @@
 #include "utils.h"
+#include "trace.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 unsigned char clamp_to_byte(float byte)
 {
@@ -15,48 +23,205 @@ unsigned char clamp_to_byte(float byte)
     return clammped_byte;
 }
 
-// Reads a pnm binary image
-Channels **read_image_pnm(char *filename, int *width, int *height)
+// Skips whitespace and '#' comments, which run until the end of the line
+static size_t skip_separators(const unsigned char *data, size_t size, size_t pos)
 {
-    FILE *fp;
+    while (pos < size)
+    {
+        if (data[pos] == '#')
+            while (pos < size && data[pos] != '\n' && data[pos] != '\r')
+                pos++;
+        else if (isspace(data[pos]))
+            pos++;
+        else
+            break;
+    }
+    return pos;
+}
 
-    fp = fopen(filename, "rb");
+// Reads a decimal header field, returns 0 if there is none or it does not fit in an int
+static int parse_header_field(const unsigned char *data, size_t size, size_t *pos, int *value)
+{
+    *pos = skip_separators(data, size, *pos);
+    if (*pos >= size || !isdigit(data[*pos]))
+        return 0;
 
-    char type[10];
-    int maxval;
+    long field = 0;
+    while (*pos < size && isdigit(data[*pos]))
+    {
+        field = field * 10 + data[(*pos)++] - '0';
+        if (field > 0x7fffffff)
+            return 0;
+    }
+    *value = field;
 
-    char *line = NULL;
-    size_t len = 0;
+    return 1;
+}
 
-    getline(&line, &len, fp);
-    sscanf(line, "%s", type); // P5 or P6
-    getline(&line, &len, fp); // Generated by Gimp
-    getline(&line, &len, fp); // width and height
-    sscanf(line, "%d%d", width, height);
-    getline(&line, &len, fp);
-    sscanf(line, "%d", &maxval);
+/* Parses the header of a binary pnm image (P5 or P6) held in memory. Comments and any amount
+of whitespace are allowed between the fields, a single whitespace character separates the
+maxval from the samples. Returns 0 if the header is malformed, uses 16 bit samples or
+announces more samples than 'size' holds. */
+int parse_pnm_header(const unsigned char *data, size_t size, PnmHeader *header)
+{
+    if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
+        return 0;
+    header->samples = data[1] == '6' ? channel_count : 1;
 
-    Channels **img = (Channels **)calloc(*height, sizeof(Channels *));
+    size_t pos = 2;
+    if (!parse_header_field(data, size, &pos, &header->width) ||
+        !parse_header_field(data, size, &pos, &header->height) ||
+        !parse_header_field(data, size, &pos, &header->maxval))
+        return 0;
+    if (pos >= size || !isspace(data[pos]))
+        return 0;
+    header->offset = pos + 1;
 
-    for (int i = 0; i < *height; i++)
-        img[i] = (Channels *)calloc(*width, sizeof(Channels));
+    if (header->width == 0 || header->height == 0 || header->maxval == 0 || header->maxval > 255)
+        return 0;
 
-    for (int i = 0; i < *height; i++)
-        for (int j = 0; j < *width; j++)
-        {
-            unsigned char r, g, b;
-            fread(&r, 1, 1, fp);
-            fread(&g, 1, 1, fp);
-            fread(&b, 1, 1, fp);
-
-            img[i][j].channel[0] = r;
-            img[i][j].channel[1] = g;
-            img[i][j].channel[2] = b;
-        }
+    return (size - header->offset) / header->samples / header->width >= (size_t)header->height;
+}
+
+/* Maps a binary pnm image read only, aborting the run if it can't be opened or parsed. 'advice'
+is passed on to madvise for the whole mapping. */
+MappedPnm *map_image_pnm(char *filename, int advice)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    MappedPnm *pnm = malloc(sizeof(MappedPnm));
+    pnm->size = st.st_size;
+    pnm->data = pnm->size > 0 ? mmap(NULL, pnm->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (pnm->data == MAP_FAILED || !parse_pnm_header(pnm->data, pnm->size, &pnm->header))
+    {
+        fprintf(stderr, "Invalid pnm image '%s'\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    madvise(pnm->data, pnm->size, advice);
+
+    return pnm;
+}
+
+void unmap_image_pnm(MappedPnm *pnm)
+{
+    munmap(pnm->data, pnm->size);
+    free(pnm);
+}
+
+// Parses only the header of a pnm image, none of its samples are read
+PnmHeader read_pnm_header(char *filename)
+{
+    MappedPnm *pnm = map_image_pnm(filename, MADV_RANDOM);
+    PnmHeader header = pnm->header;
+    unmap_image_pnm(pnm);
+
+    return header;
+}
+
+typedef struct
+{
+    void (*body)(void *arg, int start, int end);
+    void *arg;
+    int start;
+    int end;
+} RowBand;
+
+static void *run_row_band(void *var)
+{
+    RowBand *band = var;
+    TRACE_BEGIN("pnm rows");
+    band->body(band->arg, band->start, band->end);
+    TRACE_END();
+    return NULL;
+}
+
+/* Splits the rows [0, rows) into one band per online CPU and runs 'body' on all of them in
+parallel. Used by the image I/O, which happens outside of the backends' own workers. */
+void parallel_rows(int rows, void (*body)(void *arg, int start, int end), void *arg)
+{
+    int n_threads = fmax(1, fmin(rows, sysconf(_SC_NPROCESSORS_ONLN)));
+    int band = (rows + n_threads - 1) / n_threads;
+    pthread_t tid[n_threads];
+    RowBand bands[n_threads];
+
+    for (int t = 0; t < n_threads; t++)
+    {
+        bands[t] = (RowBand){body, arg, fmin(rows, t * band), fmin(rows, (t + 1) * band)};
+        if (t > 0)
+            pthread_create(&tid[t], NULL, run_row_band, &bands[t]);
+    }
+
+    // The calling thread takes the first band itself
+    run_row_band(&bands[0]);
+    for (int t = 1; t < n_threads; t++)
+        pthread_join(tid[t], NULL);
+}
+
+typedef struct
+{
+    MappedPnm *pnm;
+    Channels **img;
+} ReadJob;
+
+static void read_rows(void *var, int start, int end)
+{
+    ReadJob *job = var;
+    PnmHeader *h = &job->pnm->header;
+    int gray = h->samples == 1;
+
+    for (int i = start; i < end; i++)
+    {
+        const unsigned char *src = job->pnm->data + h->offset + (size_t)i * h->width * h->samples;
+        // Rows the caller didn't provide are allocated here
+        Channels *row = job->img[i] ? job->img[i] : calloc(h->width, sizeof(Channels));
 
-    fclose(fp);
+        // Grayscale images are replicated into the 3 channels
+        for (int j = 0; j < h->width; j++)
+            for (int c = 0; c < channel_count; c++)
+                row[j].channel[c] = src[j * h->samples + (gray ? 0 : c)];
 
-    return img;
+        job->img[i] = row;
+    }
+}
+
+// Reads a pnm binary image, mapping the file and splitting its rows between several threads
+Channels **read_image_pnm(char *filename, int *width, int *height)
+{
+    TRACE_BEGIN("read_image_pnm");
+    // The rows are deinterleaved by several threads at once, so ask for the whole file up front
+    MappedPnm *pnm = map_image_pnm(filename, MADV_WILLNEED);
+    *width = pnm->header.width;
+    *height = pnm->header.height;
+
+    ReadJob job = {pnm, calloc(*height, sizeof(Channels *))};
+    parallel_rows(*height, read_rows, &job);
+
+    unmap_image_pnm(pnm);
+    TRACE_END();
+
+    return job.img;
+}
+
+/* Same as read_image_pnm, into the rows of 'img', which have to be as many and as wide as the
+image. Lets the rows come from a single contiguous allocation. */
+void read_image_pnm_into(char *filename, Channels **img)
+{
+    TRACE_BEGIN("read_image_pnm");
+    MappedPnm *pnm = map_image_pnm(filename, MADV_WILLNEED);
+    ReadJob job = {pnm, img};
+    parallel_rows(pnm->header.height, read_rows, &job);
+
+    unmap_image_pnm(pnm);
+    TRACE_END();
 }
 
 // Gets the distribution range of the array, useful if there is no normalization
@@ -74,22 +239,111 @@ int get_range(Channels **img, int width, int height)
     return top;
 }
 
-// Writes a channels array as a RGB, pnm binary image
-void write_image_pnm(Channels **img, char *filename, int width, int height)
+/* Creates a P6 image, writes its header and sizes the file for all the samples, so the rows
+can then be filled in any order with pwrite. Returns the descriptor and sets 'offset' to the
+position of the first sample. */
+int create_image_pnm(char *filename, int width, int height, int top, size_t *offset)
 {
-    FILE *out = fopen(filename, "wb");
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
 
-    int top = get_range(img, width, height);
-    fprintf(out, "%s\n%d %d\n%d\n", "P6", width, height, top);
+    char header[64];
+    int length = snprintf(header, sizeof(header), "%s\n%d %d\n%d\n", "P6", width, height, top);
+    *offset = length;
 
-    for (int i = 0; i < height; i++)
-        for (int j = 0; j < width; j++)
+    if (write(fd, header, length) != length ||
+        ftruncate(fd, *offset + (size_t)width * height * channel_count) < 0)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+// Writes 'size' bytes at 'offset', retrying short writes
+void write_at(int fd, const unsigned char *buf, size_t size, size_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, buf, size, offset);
+        if (written <= 0)
         {
-            fwrite(&img[i][j].channel[0], 1, 1, out);
-            fwrite(&img[i][j].channel[1], 1, 1, out);
-            fwrite(&img[i][j].channel[2], 1, 1, out);
+            perror("pwrite");
+            exit(EXIT_FAILURE);
         }
-    fclose(out);
+        buf += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+// Reads 'size' bytes at 'offset', retrying short reads
+void read_at(int fd, unsigned char *buf, size_t size, size_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t read = pread(fd, buf, size, offset);
+        if (read <= 0)
+        {
+            perror("pread");
+            exit(EXIT_FAILURE);
+        }
+        buf += read;
+        size -= read;
+        offset += read;
+    }
+}
+
+// Rows interleaved into a buffer before every pwrite
+#define WRITE_BATCH_ROWS 16
+
+typedef struct
+{
+    Channels **img;
+    int width;
+    int fd;
+    size_t offset;
+} WriteJob;
+
+static void write_rows(void *var, int start, int end)
+{
+    WriteJob *job = var;
+    size_t row_size = (size_t)job->width * channel_count;
+    unsigned char *pixels = malloc(row_size * WRITE_BATCH_ROWS);
+
+    for (int first = start; first < end; first += WRITE_BATCH_ROWS)
+    {
+        int rows = fmin(WRITE_BATCH_ROWS, end - first);
+        for (int i = 0; i < rows; i++)
+            for (int j = 0; j < job->width; j++)
+                for (int c = 0; c < channel_count; c++)
+                    pixels[i * row_size + j * channel_count + c] = job->img[first + i][j].channel[c];
+
+        write_at(job->fd, pixels, rows * row_size, job->offset + first * row_size);
+    }
+
+    free(pixels);
+}
+
+/* Writes a channels array as a RGB, pnm binary image, several threads filling their own rows.
+'top' is the range of the image as reported by the last stage that wrote it, a negative value
+falls back to scanning the image. */
+void write_image_pnm(Channels **img, char *filename, int width, int height, int top)
+{
+    TRACE_BEGIN("write_image_pnm");
+    if (top < 0)
+        top = get_range(img, width, height);
+
+    WriteJob job = {img, width};
+    job.fd = create_image_pnm(filename, width, height, top, &job.offset);
+    parallel_rows(height, write_rows, &job);
+    close(job.fd);
+    TRACE_END();
 }
 
 // Simulates a learned kernel by randomly generating it
@@ -97,6 +351,8 @@ float *get_kernel(int kernel_id)
 {
     srand(kernel_id);
     float *K = malloc(channel_count * sizeof(float));
+    if (!K)
+        return NULL;
     for (int i = 0; i < channel_count; i++)
         K[i] = (rand() % 1000 + 500) / 1000.f / channel_count;
 
@@ -113,3 +369,10 @@ Channels **new_channel_array(int height, int width)
 
     return bordered_img;
 }
+
+void free_channel_array(Channels **img, int height)
+{
+    for (int i = 0; i < height; i++)
+        free(img[i]);
+    free(img);
+}
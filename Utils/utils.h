@@ -1,6 +1,8 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <stddef.h>
+
 #define LAYER_HEIGHT 32
 #define channel_count 3
 
@@ -9,11 +11,40 @@ typedef struct
     unsigned char channel[LAYER_HEIGHT];
 } Channels;
 
+// Layout of a binary pnm image, its samples start 'offset' bytes into the file
+typedef struct
+{
+    int width;
+    int height;
+    int maxval;
+    // 1 for P5 (grayscale), 3 for P6 (RGB)
+    int samples;
+    size_t offset;
+} PnmHeader;
+
+// A pnm image mapped read only into memory
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    PnmHeader header;
+} MappedPnm;
+
 unsigned char clamp_to_byte(float byte);
+int parse_pnm_header(const unsigned char *data, size_t size, PnmHeader *header);
+MappedPnm *map_image_pnm(char *filename, int advice);
+void unmap_image_pnm(MappedPnm *pnm);
+PnmHeader read_pnm_header(char *filename);
+void parallel_rows(int rows, void (*body)(void *arg, int start, int end), void *arg);
 Channels **read_image_pnm(char *filename, int *width, int *height);
-void write_image_pnm(Channels **img, char *filename, int width, int height);
+void read_image_pnm_into(char *filename, Channels **img);
+int create_image_pnm(char *filename, int width, int height, int top, size_t *offset);
+void write_at(int fd, const unsigned char *buf, size_t size, size_t offset);
+void read_at(int fd, unsigned char *buf, size_t size, size_t offset);
+void write_image_pnm(Channels **img, char *filename, int width, int height, int top);
 int get_range(Channels **img, int width, int height);
 float *get_kernel(int kernel_id);
 Channels **new_channel_array(int height, int width);
+void free_channel_array(Channels **img, int height);
 
 #endif // UTILS_H_
\ No newline at end of file
@@ -0,0 +1,92 @@
+#include "weights.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Weights *weights = NULL;
+
+/* Header of a weight file, all of it little endian. It is followed by float32 arrays: the
+depthwise taps of every expanded channel, the pointwise matrix row by row, and the bias. */
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    // Channels of the image and outputs of the pointwise convolution, both have to be channel_count
+    uint32_t channels;
+    uint32_t multiplier;
+    uint32_t taps;
+    uint32_t outputs;
+} WeightsHeader;
+
+static void invalid_weights(const char *filename, const char *reason)
+{
+    fprintf(stderr, "Invalid weight file '%s': %s\n", filename, reason);
+    exit(EXIT_FAILURE);
+}
+
+static void read_floats(FILE *file, const char *filename, float *dst, size_t count)
+{
+    if (fread(dst, sizeof(float), count, file) != count)
+        invalid_weights(filename, "truncated");
+}
+
+/* Reads the layer of a weight file into 'weights', aborting the run if the file can't be read
+or doesn't hold a layer the pipeline can run. Does nothing without a file. */
+void load_weights(const char *filename)
+{
+    if (!filename)
+        return;
+
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    WeightsHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, WEIGHTS_MAGIC, 4) != 0)
+        invalid_weights(filename, "not a weight file");
+    if (header.version != WEIGHTS_VERSION)
+        invalid_weights(filename, "unsupported version");
+    if (header.channels != channel_count || header.outputs != channel_count)
+        invalid_weights(filename, "the layer has to take and give 3 channels");
+    // The expanded mode writes every expanded channel into the pixels
+    if (header.multiplier == 0 || header.multiplier > LAYER_HEIGHT / channel_count)
+        invalid_weights(filename, "the channel multiplier has to be between 1 and 10");
+    if (header.taps % 2 == 0 || header.taps > MAX_TAPS)
+        invalid_weights(filename, "the depthwise kernels need an odd number of taps, up to 31");
+
+    Weights *w = malloc(sizeof(Weights));
+    w->multiplier = header.multiplier;
+    w->channels = channel_count * header.multiplier;
+    w->depthwise = malloc(w->channels * sizeof(Kernel1D));
+    for (int e = 0; e < w->channels; e++)
+    {
+        w->depthwise[e].taps = header.taps;
+        read_floats(file, filename, w->depthwise[e].coefficients, header.taps);
+    }
+
+    float *matrix = malloc((w->channels + 1) * channel_count * sizeof(float));
+    read_floats(file, filename, matrix, (w->channels + 1) * channel_count);
+    w->pointwise = (Pointwise){w->channels, channel_count, matrix, matrix + w->channels * channel_count};
+
+    // Anything after the bias means the file was written for another layer
+    if (fgetc(file) != EOF)
+        invalid_weights(filename, "trailing data");
+    fclose(file);
+
+    weights = w;
+}
+
+void free_weights(void)
+{
+    if (!weights)
+        return;
+
+    free(weights->depthwise);
+    free(weights->pointwise.weights);
+    free(weights);
+    weights = NULL;
+}
@@ -0,0 +1,32 @@
+#ifndef WEIGHTS_H_
+#define WEIGHTS_H_
+
+#include "kernels.h"
+#include "utils.h"
+
+#define WEIGHTS_MAGIC "DSCW"
+#define WEIGHTS_VERSION 1
+
+/* A learned depthwise separable layer, which replaces the pooling encode and the averaging
+decode of every iteration when a weight file is given. Each of the 3 channels is expanded
+into 'multiplier' channels by depthwise kernels that run along the rows, and the expanded
+channels are mixed back into 3 by a 1x1 convolution. Expanded channel e reads channel
+e % channel_count, the same order the pooling encode fills them in. */
+typedef struct
+{
+    int multiplier;
+    // Expanded channels, channel_count * multiplier
+    int channels;
+    // Depthwise kernel of every expanded channel, all of them with the same number of taps
+    Kernel1D *depthwise;
+    // channel_count outputs of 'channels' inputs
+    Pointwise pointwise;
+} Weights;
+
+// Layer of the run, NULL unless load_weights was given a file
+extern Weights *weights;
+
+void load_weights(const char *filename);
+void free_weights(void);
+
+#endif // WEIGHTS_H_
@@ -0,0 +1,137 @@
+#include "wisdom.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest line of a wisdom file, the CPU model included
+#define WISDOM_LINE_SIZE 512
+
+// File named by --wisdom, CONV_WISDOM or ~/.conv_wisdom, in that order
+const char *wisdom_filename(const Options *opts)
+{
+    static char home_file[WISDOM_LINE_SIZE];
+
+    if (opts->wisdom)
+        return opts->wisdom;
+    if (getenv("CONV_WISDOM"))
+        return getenv("CONV_WISDOM");
+    snprintf(home_file, sizeof(home_file), "%s/.conv_wisdom", getenv("HOME") ? getenv("HOME") : ".");
+    return home_file;
+}
+
+// Model name of the first CPU, the same one every call
+static const char *cpu_model(void)
+{
+    static char model[WISDOM_LINE_SIZE];
+    if (*model)
+        return model;
+
+    strcpy(model, "unknown");
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (!file)
+        return model;
+
+    char line[WISDOM_LINE_SIZE];
+    while (fgets(line, sizeof(line), file))
+    {
+        char *value = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && value)
+        {
+            value += strspn(value + 1, " \t") + 1;
+            value[strcspn(value, "\n")] = '\0';
+            // Tabs separate the fields of an entry
+            for (char *c = value; *c; c++)
+                if (*c == '\t')
+                    *c = ' ';
+            snprintf(model, sizeof(model), "%s", value);
+            break;
+        }
+    }
+    fclose(file);
+
+    return model;
+}
+
+/* Key of an entry as it starts its line, the backend, the CPU model and the problem separated
+by tabs, followed by another tab. */
+static void format_key(char *text, size_t size, const WisdomKey *key)
+{
+    snprintf(text, size, "%s\t%s\t%dx%d multiplier=%d taps=%d,%d arith=%s weights=%d separable=%s\t", key->backend,
+             cpu_model(), key->width, key->height, key->channel_multiplier, key->vertical_taps, key->horizontal_taps,
+             key->fixed_point ? "fixed" : "float", key->weights, key->fused ? "fused" : "split");
+}
+
+/* Looks up the entry of 'key' for this CPU. Returns 1 and fills 'wisdom' if there is one. A
+missing file is the same as an empty one, entries that can't be parsed are skipped. */
+int load_wisdom(const char *filename, const WisdomKey *key, Wisdom *wisdom)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+        return 0;
+
+    char prefix[WISDOM_LINE_SIZE];
+    char line[WISDOM_LINE_SIZE];
+    format_key(prefix, sizeof(prefix), key);
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), file))
+        if (strncmp(line, prefix, strlen(prefix)) == 0)
+            found = sscanf(line + strlen(prefix), "threads=%d isa=%15s tile=%dx%d depthwise=%d temporal=%d",
+                           &wisdom->threads, wisdom->isa, &wisdom->tile.rows, &wisdom->tile.cols, &wisdom->expanded,
+                           &wisdom->temporal) == 6 &&
+                    wisdom->threads > 0 && wisdom->tile.rows > 0 && wisdom->tile.cols >= 0;
+    fclose(file);
+
+    return found;
+}
+
+/* Stores the entry of 'key' for this CPU, replacing the one it had. The file is written aside
+and renamed over the old one, so concurrent runs never read half of it. */
+void store_wisdom(const char *filename, const WisdomKey *key, const Wisdom *wisdom)
+{
+    char prefix[WISDOM_LINE_SIZE];
+    char line[WISDOM_LINE_SIZE];
+    char temp_name[WISDOM_LINE_SIZE];
+    format_key(prefix, sizeof(prefix), key);
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+
+    FILE *out = fopen(temp_name, "w");
+    if (!out)
+    {
+        perror(temp_name);
+        return;
+    }
+    FILE *in = fopen(filename, "r");
+    if (in)
+    {
+        while (fgets(line, sizeof(line), in))
+            if (strncmp(line, prefix, strlen(prefix)) != 0)
+                fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%sthreads=%d isa=%s tile=%dx%d depthwise=%d temporal=%d\n", prefix, wisdom->threads, wisdom->isa,
+            wisdom->tile.rows, wisdom->tile.cols, wisdom->expanded, wisdom->temporal);
+    fclose(out);
+
+    if (rename(temp_name, filename) != 0)
+        perror(filename);
+}
+
+/* Takes the configuration of an entry, except for what was given on the command line and what
+the options in effect can't run. A thread count of 0 asks for the one of the entry. 'wisdom' has
+to outlive 'opts'. */
+void apply_wisdom(const Wisdom *wisdom, Options *opts, int *n_threads)
+{
+    if (*n_threads <= 0)
+        *n_threads = wisdom->threads;
+    // CONV_ISA counts as given, like in select_kernels
+    if (!(opts->given & GIVEN_ISA) && !getenv("CONV_ISA"))
+        opts->isa = (char *)wisdom->isa;
+    if (!(opts->given & GIVEN_TILE))
+        opts->tile = wisdom->tile;
+    // The planes run neither the expanded stages nor temporal blocking
+    if (!(opts->given & GIVEN_DEPTHWISE) && !opts->planar)
+        opts->expanded = wisdom->expanded;
+    // Temporal blocking runs through the fused pass of a single image in memory
+    if (!(opts->given & GIVEN_TEMPORAL) && opts->fused && !opts->stream_rows && !opts->batch && !opts->planar)
+        opts->temporal = wisdom->temporal;
+}
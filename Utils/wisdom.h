@@ -0,0 +1,40 @@
+#ifndef WISDOM_H_
+#define WISDOM_H_
+
+#include "options.h"
+
+// Longest name of an instruction set kept in a wisdom entry
+#define WISDOM_ISA_SIZE 16
+
+/* Problem a configuration was tuned for. The CPU model is added when the entry is stored, so a
+file can be shared between hosts. */
+typedef struct
+{
+    const char *backend;
+    int width;
+    int height;
+    int channel_multiplier;
+    int vertical_taps;
+    int horizontal_taps;
+    int fixed_point;
+    int weights;
+    // Fused or split spatial passes, which temporal blocking depends on
+    int fused;
+} WisdomKey;
+
+// Fastest configuration --tune found for a problem
+typedef struct
+{
+    int threads;
+    char isa[WISDOM_ISA_SIZE];
+    TileShape tile;
+    int expanded;
+    int temporal;
+} Wisdom;
+
+const char *wisdom_filename(const Options *opts);
+int load_wisdom(const char *filename, const WisdomKey *key, Wisdom *wisdom);
+void store_wisdom(const char *filename, const WisdomKey *key, const Wisdom *wisdom);
+void apply_wisdom(const Wisdom *wisdom, Options *opts, int *n_threads);
+
+#endif // WISDOM_H_